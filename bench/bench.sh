@@ -0,0 +1,92 @@
+#!/bin/bash
+
+# Runs every stage over synthetic scenes of several sizes, thread counts and execution modes, and gathers the
+# metrics of every run into one CSV for bench/compare.py.
+#
+# Settings (environment):
+#   BENCH_DIR      Folder of the scenes, runs and results
+#   BENCH_SIZES    Scene sizes, as WIDTHxHEIGHT
+#   BENCH_THREADS  Thread counts, -threads= of each run
+#   BENCH_MODES    staged, fused (-fused) or stream (-stream)
+#   BENCH_RUNS     Runs of each combination
+#   BENCH_COVER    Land cover mix of the scenes, VEG,SOIL,WATER
+#   BENCH_FLAGS    Extra flags of every run
+#   METHOD         Endmembers method, -meth= of each run
+
+BENCH_DIR=${BENCH_DIR:-./output/bench}
+BENCH_SIZES=${BENCH_SIZES:-"1000x1000 2000x2000 4000x4000"}
+BENCH_THREADS=${BENCH_THREADS:-"1 2 4"}
+BENCH_MODES=${BENCH_MODES:-"staged fused stream"}
+BENCH_RUNS=${BENCH_RUNS:-3}
+BENCH_COVER=${BENCH_COVER:-"0.5,0.4,0.1"}
+BENCH_FLAGS=${BENCH_FLAGS:-}
+METHOD=${METHOD:-0}
+
+MAIN=./crop/main
+GENERATE=./bench/generate
+
+for binary in $MAIN $GENERATE; do
+  if [ ! -x $binary ]; then
+    echo "Bench problem! - $binary is missing, run make build-crop build-generate" >&2
+    exit 1
+  fi
+done
+
+REVISION=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+RESULTS=$BENCH_DIR/results-$REVISION.csv
+
+mkdir -p $BENCH_DIR/scenes $BENCH_DIR/runs
+
+header_written=0
+for size in $BENCH_SIZES; do
+  width=${size%x*}
+  height=${size#*x}
+  scene=$BENCH_DIR/scenes/$size
+
+  # Scenes are deterministic, so they are only generated once per size and mix
+  if [ ! -f $scene/station.csv ] || [ "$(cat $scene/cover 2>/dev/null)" != "$BENCH_COVER" ]; then
+    echo "Generating $size scene"
+    mkdir -p $scene
+    $GENERATE $scene $width $height -cover=$BENCH_COVER || exit 1
+    echo "$BENCH_COVER" > $scene/cover
+  fi
+
+  for threads in $BENCH_THREADS; do
+    for mode in $BENCH_MODES; do
+      case $mode in
+        staged) mode_flags="" ;;
+        fused) mode_flags="-fused" ;;
+        stream) mode_flags="-stream" ;;
+        *)
+          echo "Bench problem! - Unknown mode $mode" >&2
+          exit 1
+          ;;
+      esac
+
+      for run in $(seq 1 $BENCH_RUNS); do
+        output=$BENCH_DIR/runs/$size-$threads-$mode-$run
+        rm -rf $output
+        mkdir -p $output
+
+        echo "Running $size threads=$threads mode=$mode run=$run"
+        $MAIN $scene/B2.TIF $scene/B3.TIF $scene/B4.TIF $scene/B5.TIF $scene/B6.TIF $scene/B10.TIF $scene/B7.TIF \
+          $scene/elevation.tif $scene/MTL.txt $scene/station.csv $output \
+          -meth=$METHOD -threads=$threads $mode_flags -metrics=$output/metrics.csv $BENCH_FLAGS > $output/timing.txt 2>&1
+        if [ $? -ne 0 ] || [ ! -f $output/metrics.csv ]; then
+          echo "Bench problem! - Run failed, see $output/timing.txt" >&2
+          exit 1
+        fi
+
+        # The metrics rows prefixed with the run settings, under a single header
+        if [ $header_written -eq 0 ]; then
+          echo "revision,size,threads,mode,method,run,$(head -n 1 $output/metrics.csv)" > $RESULTS
+          header_written=1
+        fi
+        tail -n +2 $output/metrics.csv | sed "s/^/$REVISION,$size,$threads,$mode,$METHOD,$run,/" >> $RESULTS
+      done
+    done
+  done
+done
+
+cp $RESULTS $BENCH_DIR/results.csv
+echo "Results saved in $RESULTS"
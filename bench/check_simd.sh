@@ -0,0 +1,61 @@
+#!/bin/bash
+
+# Checks that the scalar, AVX2 and AVX-512 kernels give the same product planes, bit for bit, with both math tiers.
+# Each variant saves the planes of the Rn/G chain (NDVI, albedo, Ts, Rn and G) through the product store, and every
+# store file is compared with the scalar one. A variant the CPU lacks falls back to the widest available one.
+#
+# Settings (environment):
+#   CHECK_DIR   Folder of the scene and the store files
+#   CHECK_SIZE  Scene size, as WIDTHxHEIGHT
+#   METHOD      Endmembers method, -meth= of each run
+
+CHECK_DIR=${CHECK_DIR:-./output/check-simd}
+CHECK_SIZE=${CHECK_SIZE:-1000x800}
+METHOD=${METHOD:-0}
+
+MAIN=./crop/main
+GENERATE=./bench/generate
+
+for binary in $MAIN $GENERATE; do
+  if [ ! -x $binary ]; then
+    echo "Check problem! - $binary is missing, run make build-crop build-generate" >&2
+    exit 1
+  fi
+done
+
+scene=$CHECK_DIR/scene
+rm -rf $CHECK_DIR
+mkdir -p $scene
+$GENERATE $scene ${CHECK_SIZE%x*} ${CHECK_SIZE#*x} || exit 1
+
+failures=0
+for math in exact fast; do
+  for isa in scalar avx2 avx512; do
+    store=$CHECK_DIR/$math-$isa
+    mkdir -p $store
+    $MAIN $scene/B2.TIF $scene/B3.TIF $scene/B4.TIF $scene/B5.TIF $scene/B6.TIF $scene/B10.TIF $scene/B7.TIF \
+      $scene/elevation.tif $scene/MTL.txt $scene/station.csv $store \
+      -meth=$METHOD -simd=$isa -math=$math -store=$store > $store/timing.txt 2>&1
+    if [ $? -ne 0 ] || ! ls $store/*.prod > /dev/null 2>&1; then
+      echo "Check problem! - Run failed, see $store/timing.txt" >&2
+      exit 1
+    fi
+
+    # The endmembers come from the planes, so they must match too
+    grep -E "HOT|COLD" $store/timing.txt > $store/endmembers.txt
+    for file in $store/*.prod $store/endmembers.txt; do
+      reference=$CHECK_DIR/$math-scalar/$(basename $file)
+      if cmp -s $reference $file; then
+        echo "OK       math=$math simd=$isa $(basename $file)"
+      else
+        echo "MISMATCH math=$math simd=$isa $(basename $file)"
+        failures=$((failures + 1))
+      fi
+    done
+  done
+done
+
+if [ $failures -gt 0 ]; then
+  echo "$failures file(s) differ from the scalar kernels"
+  exit 1
+fi
@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+import argparse
+import csv
+import sys
+
+
+def load_times(path):
+    """
+    Wall time of each stage per run, keyed by (size, threads, mode, method, stage). The summed stages may be recorded
+    more than once per run, so the records of a run are added up.
+    """
+    runs = {}
+    with open(path, newline='') as results:
+        for row in csv.DictReader(results):
+            key = (row['size'], row['threads'], row['mode'], row['method'], row['stage'])
+            run = (row['run'], row['scene'])
+            runs.setdefault(key, {})
+            runs[key][run] = runs[key].get(run, 0) + int(row['wall_ns'])
+
+    return {key: sorted(times.values()) for key, times in runs.items()}
+
+
+def median(values):
+    middle = len(values) // 2
+    if len(values) % 2 == 1:
+        return values[middle]
+    return (values[middle - 1] + values[middle]) / 2
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Compares the median stage times of two bench results')
+    parser.add_argument('baseline', help='Results CSV of the reference revision')
+    parser.add_argument('current', help='Results CSV of the revision under test')
+    parser.add_argument('--threshold', type=float, default=0.10, help='Relative slowdown reported as a regression')
+    parser.add_argument('--min-ms', type=float, default=1.0, help='Stages faster than this in the baseline are not judged')
+    args = parser.parse_args()
+
+    baseline = load_times(args.baseline)
+    current = load_times(args.current)
+
+    regressions = 0
+    print('%-10s %-7s %-7s %-6s %-18s %12s %12s %8s' % ('size', 'threads', 'mode', 'method', 'stage', 'base_ms', 'curr_ms', 'change'))
+    for key in sorted(set(baseline) & set(current)):
+        base = median(baseline[key]) / 1e6
+        curr = median(current[key]) / 1e6
+        change = (curr - base) / base if base > 0 else 0.0
+
+        mark = ''
+        if base >= args.min_ms and change > args.threshold:
+            mark = ' REGRESSION'
+            regressions += 1
+        print('%-10s %-7s %-7s %-6s %-18s %12.3f %12.3f %+7.1f%%%s' % (key + (base, curr, 100 * change, mark)))
+
+    for key in sorted(set(baseline) ^ set(current)):
+        print('%s only in the %s results' % (','.join(key), 'baseline' if key in baseline else 'current'))
+
+    if regressions > 0:
+        print('%d stage(s) slower than the baseline by more than %.0f%%' % (regressions, 100 * args.threshold))
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
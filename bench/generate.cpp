@@ -0,0 +1,287 @@
+#include "constants.h"
+
+#define COVER_VEGETATION  0
+#define COVER_SOIL        1
+#define COVER_WATER       2
+#define COVERS            3
+
+// Scene of the generated MTL: Landsat 8, path/row 215/065, day 131 of 2017
+const string SCENE_ID = "LC82150652017131LGN00";
+const double SUN_ELEVATION = 50.0;
+
+// Level-1 rescaling of the generated MTL, the reflective bands sharing one set
+const double RADIANCE_MULT = 1.2e-2;
+const double RADIANCE_ADD = -60.0;
+const double REFLECTANCE_MULT = 2.0e-5;
+const double REFLECTANCE_ADD = -0.1;
+const double THERMAL_MULT = 3.342e-4;
+const double THERMAL_ADD = 0.1;
+
+// Thermal constants of the Landsat 8 band 10, as used by the surface temperature kernel
+const double K1 = 774.8853;
+const double K2 = 1321.0789;
+
+// Reflectance of blue, green, red, NIR, SWIR1, (thermal) and SWIR2 for dense vegetation, bare soil and water
+const double SPECTRA[COVERS][7] = {{0.03, 0.06, 0.04, 0.40, 0.18, 0, 0.08},
+                                   {0.15, 0.20, 0.25, 0.30, 0.35, 0, 0.30},
+                                   {0.06, 0.05, 0.03, 0.02, 0.01, 0, 0.005}};
+
+const string BAND_NAMES[8] = {"B2.TIF", "B3.TIF", "B4.TIF", "B5.TIF", "B6.TIF", "B10.TIF", "B7.TIF", "elevation.tif"};
+
+/**
+ * @brief  Parameters of a synthetic scene.
+ */
+struct SceneOptions
+{
+  int width, height;
+  double covers[COVERS];
+  double nodata;
+  uint32_t seed;
+  bool integer;
+};
+
+/**
+ * @brief  Deterministic value in [0, 1) of a lattice point.
+ */
+static double lattice(uint32_t seed, int x, int y)
+{
+  uint32_t h = seed * 0x9E3779B1u ^ (uint32_t)x * 0x85EBCA77u ^ (uint32_t)y * 0xC2B2AE3Du;
+  h ^= h >> 15;
+  h *= 0x2C1B3C6Du;
+  h ^= h >> 12;
+  h *= 0x297A2D39u;
+  h ^= h >> 15;
+  return h / 4294967296.0;
+}
+
+/**
+ * @brief  Smooth noise in [0, 1): three octaves of interpolated lattice values, the first with cells of scale pixels.
+ */
+static double smooth_noise(uint32_t seed, double line, double col, double scale)
+{
+  double value = 0, weight = 0, amplitude = 1;
+  for (int octave = 0; octave < 3; octave++)
+  {
+    double y = line / scale, x = col / scale;
+    int y0 = (int)floor(y), x0 = (int)floor(x);
+    double fy = y - y0, fx = x - x0;
+    fy = fy * fy * (3 - 2 * fy);
+    fx = fx * fx * (3 - 2 * fx);
+
+    double top = lattice(seed + octave, x0, y0) * (1 - fx) + lattice(seed + octave, x0 + 1, y0) * fx;
+    double bottom = lattice(seed + octave, x0, y0 + 1) * (1 - fx) + lattice(seed + octave, x0 + 1, y0 + 1) * fx;
+    value += amplitude * (top * (1 - fy) + bottom * fy);
+    weight += amplitude;
+
+    amplitude /= 2;
+    scale /= 2;
+  }
+  return value / weight;
+}
+
+/**
+ * @brief  Writes a single band float32 or uint16 striped TIFF, the layout the loader decodes in place.
+ */
+static void save_band(string path, vector<float> &data, int height, int width, bool integer)
+{
+  TIFF *tif = TIFFOpen(path.c_str(), "w");
+  if (tif == NULL)
+  {
+    cerr << "Generate problem! - Could not write " << path << endl;
+    exit(2);
+  }
+
+  TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
+  TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
+  TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+  TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, integer ? 16 : 32);
+  TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, integer ? SAMPLEFORMAT_UINT : SAMPLEFORMAT_IEEEFP);
+  TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, 16);
+  TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+  TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+
+  vector<uint16_t> line(width);
+  for (int i = 0; i < height; i++)
+  {
+    float *row = data.data() + (size_t)i * width;
+    if (integer)
+    {
+      for (int j = 0; j < width; j++)
+        line[j] = (uint16_t)min(max(row[j] + 0.5f, 0.0f), 65535.0f);
+      TIFFWriteScanline(tif, line.data(), i, 0);
+    }
+    else
+      TIFFWriteScanline(tif, row, i, 0);
+  }
+
+  TIFFClose(tif);
+}
+
+/**
+ * @brief  Land cover thresholds on the cover noise, so that each cover takes about its fraction of the pixels.
+ */
+static vector<double> cover_thresholds(SceneOptions &options, double scale)
+{
+  vector<double> samples;
+  for (int k = 0; k < 65536; k++)
+    samples.push_back(smooth_noise(options.seed, lattice(options.seed, k, 1) * options.height, lattice(options.seed, k, 2) * options.width, scale));
+  sort(samples.begin(), samples.end());
+
+  double total = options.covers[0] + options.covers[1] + options.covers[2];
+  vector<double> thresholds;
+  double fraction = 0;
+  for (int c = 0; c < COVERS - 1; c++)
+  {
+    fraction += options.covers[c] / total;
+    thresholds.push_back(samples[min((int)(fraction * samples.size()), (int)samples.size() - 1)]);
+  }
+  return thresholds;
+}
+
+/**
+ * @brief  Generates the 7 bands, the elevation, the MTL and the station data of a synthetic Landsat 8 scene. Each pixel
+ *         is vegetation, bare soil or water, in patches, with a vegetation fraction mixing the soil and vegetation
+ *         spectra and a surface temperature falling as it grows, so the NDVI, albedo and surface temperature quartiles
+ *         leave hot candidates on the sparse soil and cold ones on the dense vegetation. A wedge on the left edge has
+ *         no data, like the edges of a real scene.
+ */
+static void generate(string folder, SceneOptions &options)
+{
+  int width = options.width, height = options.height;
+  size_t size = (size_t)width * height;
+  double sun = sin(SUN_ELEVATION * PI / 180);
+  double scale = max(64.0, max(width, height) / 12.0);
+  vector<double> thresholds = cover_thresholds(options, scale);
+
+  vector<vector<float>> bands(8, vector<float>(size));
+  for (int i = 0; i < height; i++)
+  {
+    for (int j = 0; j < width; j++)
+    {
+      size_t k = (size_t)i * width + j;
+      double cover_noise = smooth_noise(options.seed, i, j, scale);
+      int cover = cover_noise < thresholds[0] ? COVER_VEGETATION : cover_noise < thresholds[1] ? COVER_SOIL : COVER_WATER;
+
+      // Vegetation fraction and pixel scale jitter
+      double detail = smooth_noise(options.seed + 17, i, j, scale / 4);
+      double jitter = lattice(options.seed + 29, j, i) - 0.5;
+      double fraction = cover == COVER_VEGETATION ? 0.65 + 0.35 * detail : cover == COVER_SOIL ? 0.08 + 0.25 * detail : 0;
+      fraction = min(1.0, max(0.0, fraction + 0.05 * jitter));
+      // Brightness and moisture vary on their own, so albedo and temperature are not a function of the fraction
+      double brightness = 1 + 0.5 * (smooth_noise(options.seed + 41, i, j, scale / 2) - 0.5) + 0.1 * jitter;
+      double moisture = smooth_noise(options.seed + 53, i, j, scale / 3) - 0.5;
+
+      // Water lies between the vegetation and the soil, so the coldest quartile stays vegetated
+      double temperature, emissivity;
+      if (cover == COVER_WATER)
+      {
+        temperature = 301 + jitter;
+        emissivity = 0.98;
+      }
+      else
+      {
+        temperature = cover == COVER_VEGETATION ? 304 - 8 * (fraction - 0.65) / 0.35 : 319 - 20 * fraction;
+        temperature += 4 * moisture + 3 * jitter;
+        emissivity = min(0.98, 0.97 + 0.0033 * 3 * fraction);
+      }
+
+      bool nodata = j < options.nodata * width * (0.5 + (double)i / height);
+      for (int b = 0; b < 7; b++)
+      {
+        if (b == PARAM_BAND_TERMAL_INDEX)
+          continue;
+        double reflectance = cover == COVER_WATER ? SPECTRA[COVER_WATER][b]
+                                                  : SPECTRA[COVER_SOIL][b] + (SPECTRA[COVER_VEGETATION][b] - SPECTRA[COVER_SOIL][b]) * fraction;
+        reflectance *= brightness;
+        bands[b][k] = nodata ? 0 : (reflectance * sun - REFLECTANCE_ADD) / REFLECTANCE_MULT;
+      }
+
+      double radiance = emissivity * K1 / (exp(K2 / temperature) - 1);
+      bands[PARAM_BAND_TERMAL_INDEX][k] = nodata ? 0 : (radiance - THERMAL_ADD) / THERMAL_MULT;
+      bands[7][k] = 500 + 100 * sin(i * 0.002) + 50 * cos(j * 0.003);
+    }
+  }
+
+  for (int b = 0; b < 8; b++)
+    save_band(folder + "/" + BAND_NAMES[b], bands[b], height, width, options.integer && b < 7);
+
+  ofstream mtl(folder + "/MTL.txt");
+  mtl << "LANDSAT_SCENE_ID = \"" << SCENE_ID << "\"\n";
+  mtl << "SCENE_CENTER_TIME = \"12:50:15.3Z\"\n";
+  mtl << "SUN_ELEVATION = " << SUN_ELEVATION << "\n";
+  mtl << "EARTH_SUN_DISTANCE = 1.0110\n";
+  int band_numbers[7] = {2, 3, 4, 5, 6, 10, 7};
+  for (int b = 0; b < 7; b++)
+  {
+    bool thermal = b == PARAM_BAND_TERMAL_INDEX;
+    mtl << "RADIANCE_MULT_BAND_" << band_numbers[b] << " = " << (thermal ? THERMAL_MULT : RADIANCE_MULT) << "\n";
+    mtl << "RADIANCE_ADD_BAND_" << band_numbers[b] << " = " << (thermal ? THERMAL_ADD : RADIANCE_ADD) << "\n";
+    mtl << "REFLECTANCE_MULT_BAND_" << band_numbers[b] << " = " << REFLECTANCE_MULT << "\n";
+    mtl << "REFLECTANCE_ADD_BAND_" << band_numbers[b] << " = " << REFLECTANCE_ADD << "\n";
+  }
+
+  // Hourly readings of the day, the temperature rising through the morning
+  ofstream station(folder + "/station.csv");
+  for (int hour = 0; hour < 24; hour++)
+    station << "A001;2017-05-11;" << hour * 100 << ";-7.2;-35.9;60.0;" << 22.0 + hour * 0.3 << "\n";
+}
+
+/**
+ * @brief Generates a synthetic scene, the positional inputs of the main program, in an existing folder.
+ *
+ * @param argc Number of input parameters
+ * @param argv Input parameters
+ *              - OUTPUT_FOLDER                 = 1;
+ *              - WIDTH                         = 2;
+ *              - HEIGHT                        = 3;
+ *              - -cover=VEG,SOIL,WATER         : land cover mix, as relative weights (0.5,0.4,0.1 by default)
+ *              - -nodata=FRACTION              : mean width of the no data wedge on the left edge (0.05 by default)
+ *              - -seed=N                       : seed of the patterns (7 by default)
+ *              - -uint16                       : write Level-1 uint16 DNs instead of float32 bands
+ * @return int
+ */
+int main(int argc, char *argv[])
+{
+  if (argc < 4)
+  {
+    cerr << "Usage: " << argv[0] << " OUTPUT_FOLDER WIDTH HEIGHT [-cover=VEG,SOIL,WATER] [-nodata=FRACTION] [-seed=N] [-uint16]" << endl;
+    exit(1);
+  }
+
+  SceneOptions options;
+  options.width = atoi(argv[2]);
+  options.height = atoi(argv[3]);
+  options.covers[COVER_VEGETATION] = 0.5;
+  options.covers[COVER_SOIL] = 0.4;
+  options.covers[COVER_WATER] = 0.1;
+  options.nodata = 0.05;
+  options.seed = 7;
+  options.integer = false;
+
+  for (int i = 4; i < argc; i++)
+  {
+    string flag = argv[i];
+    if (flag.substr(0, 7) == "-cover=")
+    {
+      stringstream weights(flag.substr(7));
+      string weight;
+      for (int c = 0; c < COVERS && getline(weights, weight, ','); c++)
+        options.covers[c] = max(0.0, atof(weight.c_str()));
+    }
+    else if (flag.substr(0, 8) == "-nodata=")
+      options.nodata = atof(flag.substr(8).c_str());
+    else if (flag.substr(0, 6) == "-seed=")
+      options.seed = atoi(flag.substr(6).c_str());
+    else if (flag == "-uint16")
+      options.integer = true;
+  }
+
+  if (options.width <= 0 || options.height <= 0 || options.covers[0] + options.covers[1] + options.covers[2] <= 0)
+  {
+    cerr << "Generate problem! - Invalid size or land cover mix" << endl;
+    exit(1);
+  }
+
+  generate(argv[1], options);
+  return 0;
+}
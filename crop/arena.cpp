@@ -0,0 +1,73 @@
+#include "arena.h"
+
+#include <sys/mman.h>
+
+size_t arena_size(size_t bytes)
+{
+  return (bytes + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+}
+
+Arena::Arena()
+{
+  this->block = NULL;
+  this->mapped = 0;
+  this->base = NULL;
+  this->capacity = 0;
+  this->used = 0;
+  this->high_water = 0;
+}
+
+void Arena::reserve(size_t bytes)
+{
+  reset();
+  if (bytes <= this->capacity)
+    return;
+
+  close();
+
+  // Mapped one huge page larger, so the base can be moved to a huge page boundary
+  size_t capacity = (bytes + ARENA_HUGEPAGE - 1) / ARENA_HUGEPAGE * ARENA_HUGEPAGE;
+  size_t mapped = capacity + ARENA_HUGEPAGE;
+  void *block = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (block == MAP_FAILED)
+    scene_problem("Arena problem! - Could not map " + std::to_string(mapped) + " bytes", 17);
+
+  this->mapped = mapped;
+  this->block = (char *)block;
+  this->base = (char *)(((uintptr_t)block + ARENA_HUGEPAGE - 1) / ARENA_HUGEPAGE * ARENA_HUGEPAGE);
+  this->capacity = capacity;
+  madvise(this->base, this->capacity, MADV_HUGEPAGE);
+}
+
+void *Arena::allocate(size_t bytes)
+{
+  bytes = arena_size(bytes);
+  if (this->used + bytes > this->capacity)
+  {
+    // A plan carving more than it reserved is a bug, not a scene that can be skipped
+    cerr << "Arena problem! - " << bytes << " bytes do not fit in " << this->capacity - this->used << endl;
+    exit(23);
+  }
+
+  void *buffer = this->base + this->used;
+  this->used += bytes;
+  this->high_water = max(this->high_water, this->used);
+  return buffer;
+}
+
+void Arena::reset()
+{
+  this->used = 0;
+}
+
+void Arena::close()
+{
+  if (this->block != NULL)
+    munmap(this->block, this->mapped);
+
+  this->block = NULL;
+  this->mapped = 0;
+  this->base = NULL;
+  this->capacity = 0;
+  this->used = 0;
+}
@@ -0,0 +1,384 @@
+#include "batch.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+RunOptions::RunOptions()
+{
+  this->method = 0;
+  this->fused = false;
+  this->streaming = false;
+  this->crop_only = false;
+  this->tile_rows = STREAM_TILE_ROWS;
+  this->pyramid_factor = 0;
+  this->math = VMATH_EXACT;
+  this->precision = PRECISION_DEFAULT;
+  this->compact = COMPACT_NONE;
+  this->store_directory = "";
+  this->height_crop = 6502 / 2;
+  this->width_crop = 7295 / 2;
+}
+
+/**
+ * Computes the products of an opened scene, selects the endmembers and saves the crop around the cold pixel.
+ */
+static string compute_scene(Scene &scene, RunOptions &options, Station &station, Landsat &landsat, ThreadPool *pool)
+{
+  int HEIGHT = options.height_crop;
+  int WIDTH = options.width_crop;
+
+  if (!options.store_directory.empty())
+  {
+    string inputs_paths[10];
+    for (int i = 0; i < 8; i++)
+      inputs_paths[i] = scene.bands_paths[i];
+    inputs_paths[8] = scene.mtl_path;
+    inputs_paths[9] = scene.station_path;
+
+    uint64_t fingerprint = store_fingerprint(inputs_paths, 10, station.temperature_image, options.math, options.precision, options.compact);
+    landsat.store = ProductStore(options.store_directory, landsat.mtl.scene_id, fingerprint);
+  }
+
+  // A stored stage replaces loading the bands and the whole Rn/G chain
+  string stage = options.crop_only ? STORE_STAGE_TS : STORE_STAGE_RN_G;
+  if (landsat.store.enabled())
+    landsat.restore_products(stage);
+
+  if (options.crop_only)
+  {
+    if (!landsat.restored)
+      landsat.compute_quartile_inputs(station, options.tile_rows);
+  }
+  else if (!landsat.restored)
+  {
+    if (options.streaming)
+    {
+      landsat.compute_Rn_G_streaming(station, options.tile_rows);
+    }
+    else
+    {
+      landsat.load_bands();
+      landsat.compute_Rn_G(station, options.fused);
+    }
+  }
+
+  if (landsat.store.enabled() && !landsat.restored)
+    landsat.save_products(stage);
+
+  if (options.crop_only)
+    landsat.select_endmembers_streaming(station, options.tile_rows, options.method, HEIGHT, WIDTH);
+  else
+    landsat.select_endmembers(options.method, HEIGHT, WIDTH);
+
+  stringstream report;
+  report << "HOT_COL: " << landsat.hot_pixel.col << std::endl;
+  report << "HOT_LINE: " << landsat.hot_pixel.line << std::endl;
+  report << "COLD_COL: " << landsat.cold_pixel.col << std::endl;
+  report << "COLD_LINE: " << landsat.cold_pixel.line << std::endl;
+  report << "HEIGHT_ORIGINAL: " << landsat.height_band << std::endl;
+  report << "WIDTH_ORIGINAL: " << landsat.width_band << std::endl;
+  report << "HEIGHT_CROP: " << HEIGHT << std::endl;
+  report << "WIDTH_CROP: " << WIDTH << std::endl;
+
+  // The 8 crop planes in one block, released even when reading or saving them fails
+  vector<float> crop(8 * (size_t)HEIGHT * WIDTH);
+  float *bands[8];
+  for (int band = 0; band < 8; band++)
+    bands[band] = crop.data() + band * (size_t)HEIGHT * WIDTH;
+
+  int initial_line = landsat.cold_pixel.line;
+  int initial_col = landsat.cold_pixel.col;
+
+  system_clock::time_point begin = system_clock::now();
+  MetricsSample sample = metrics_sample();
+
+  if (options.streaming || options.crop_only || landsat.restored)
+  {
+    // The bands were never fully loaded, so the crop is read straight from the files
+    landsat.read_windows(initial_line, initial_col, HEIGHT, WIDTH, bands);
+  }
+  else
+  {
+    // Pixels past the scene edges are NaN, as when the crop is read from the files
+    float *sources[8] = {landsat.products.band_blue, landsat.products.band_green, landsat.products.band_red, landsat.products.band_nir,
+                         landsat.products.band_swir1, landsat.products.band_termal, landsat.products.band_swir2, landsat.products.elevation};
+    for (int band = 0; band < 8; band++)
+    {
+      for (int i = 0; i < HEIGHT; i++)
+      {
+        for (int j = 0; j < WIDTH; j++)
+        {
+          int line = i + initial_line;
+          int col = j + initial_col;
+          bool inside = line < landsat.height_band && col < landsat.width_band;
+          bands[band][i * WIDTH + j] = inside ? sources[band][line * landsat.width_band + col] : NAN;
+        }
+      }
+    }
+  }
+
+  // Only recorded in the metrics, the crop has no timing line of its own
+  system_clock::time_point end = system_clock::now();
+  int64_t initial_time = duration_cast<nanoseconds>(begin.time_since_epoch()).count();
+  int64_t final_time = duration_cast<nanoseconds>(end.time_since_epoch()).count();
+  int64_t crop_bytes = 8 * (int64_t)HEIGHT * WIDTH * sizeof(float);
+  metrics_record("SERIAL", "P2_CROP", final_time - initial_time, metrics_since(sample), initial_time, final_time, (int64_t)HEIGHT * WIDTH, crop_bytes, crop_bytes);
+
+  // Save output paths for landsat 8
+  string output_folder = scene.output_folder;
+  string output_paths[8] = {output_folder + "/B2.TIF", output_folder + "/B3.TIF", output_folder + "/B4.TIF", output_folder + "/B5.TIF",
+                            output_folder + "/B6.TIF", output_folder + "/B10.TIF", output_folder + "/B7.TIF", output_folder + "/elevation.tif"};
+  TiffOptions tiff_options = options.tiff_options;
+  tiff_options.geo = landsat.geo.shifted(initial_line, initial_col);
+  saveTiffs(output_paths, bands, 8, HEIGHT, WIDTH, tiff_options, pool);
+
+  return report.str();
+}
+
+/**
+ * Closes the band files of a scene and hands its allocated planes to the next scene, whether it completed or failed.
+ */
+static void release_scene(Landsat &landsat, Products *buffers)
+{
+  // Mapped planes belong to the store, only allocated ones are handed to the next scene
+  if (buffers != NULL && !landsat.restored)
+  {
+    *buffers = landsat.products;
+  }
+  else
+  {
+    landsat.products.close();
+    if (buffers != NULL)
+      *buffers = Products();
+  }
+  landsat.close();
+}
+
+string process_scene(Scene &scene, RunOptions &options, ThreadPool *pool, Products *buffers)
+{
+  metrics_scene(scene.output_folder);
+  counters_attach(pool);
+
+  MTL mtl = MTL(scene.mtl_path);
+  Station station = Station(scene.station_path, mtl.image_hour);
+  Landsat landsat = Landsat(scene.bands_paths, mtl, pool);
+  landsat.pyramid_factor = options.pyramid_factor;
+  if (buffers != NULL)
+    landsat.products = *buffers;
+
+  string report;
+  try
+  {
+    report = compute_scene(scene, options, station, landsat, pool);
+  }
+  catch (SceneError &)
+  {
+    release_scene(landsat, buffers);
+    throw;
+  }
+  release_scene(landsat, buffers);
+
+  return report;
+}
+
+vector<Scene> read_manifest(string manifest_path)
+{
+  ifstream in(manifest_path);
+  if (!in.is_open() || !in)
+  {
+    cerr << "Open manifest problem!" << endl;
+    exit(2);
+  }
+
+  // Every line is checked before any scene starts, so a bad one cannot stop a batch midway
+  vector<Scene> scenes;
+  string line;
+  int line_number = 0, problems = 0;
+  while (getline(in, line))
+  {
+    line_number++;
+    stringstream lineReader(line);
+    vector<string> fields;
+    string token;
+    while (lineReader >> token)
+      fields.push_back(token);
+
+    if (fields.empty() || fields[0][0] == '#')
+      continue;
+
+    if (fields.size() != 11)
+    {
+      cerr << "Manifest problem! - Line " << line_number << " has " << fields.size() << " fields instead of 11" << endl;
+      problems++;
+      continue;
+    }
+
+    for (int i = 0; i < 10; i++)
+    {
+      if (access(fields[i].c_str(), R_OK) != 0)
+      {
+        cerr << "Manifest problem! - Line " << line_number << " input " << fields[i] << " can not be read" << endl;
+        problems++;
+      }
+    }
+    if (access(fields[10].c_str(), W_OK) != 0)
+    {
+      cerr << "Manifest problem! - Line " << line_number << " output folder " << fields[10] << " can not be written" << endl;
+      problems++;
+    }
+
+    Scene scene;
+    for (int i = 0; i < 8; i++)
+      scene.bands_paths[i] = fields[i];
+    scene.mtl_path = fields[8];
+    scene.station_path = fields[9];
+    scene.output_folder = fields[10];
+    scenes.push_back(scene);
+  }
+
+  in.close();
+  if (problems > 0)
+    exit(16);
+  return scenes;
+}
+
+int64_t scene_memory(uint32_t width_band, uint32_t height_band, RunOptions &options)
+{
+  int64_t plane = (int64_t)width_band * height_band * sizeof(float);
+  int64_t strip = (int64_t)width_band * options.tile_rows * sizeof(float);
+  int64_t crop = 8 * (int64_t)options.height_crop * options.width_crop * sizeof(float);
+  int all_planes = Products().planes().size();
+
+  if (options.crop_only)
+    return 3 * plane + all_planes * strip + crop;
+  if (options.streaming)
+    return 5 * plane + all_planes * strip + crop;
+
+  // The staged chain only holds the buffers planned by its stage graph
+  Products planned;
+  float **outputs[13];
+  int count = planned.staged_outputs(outputs);
+  int buffers_count = planned.rn_g_plan(outputs, count, RN_G_STAGES).buffers_count;
+  return buffers_count * plane + mask_words(width_band * height_band) * sizeof(uint64_t) + crop;
+}
+
+/**
+ * Starts reading the band files of a scene into the page cache, without waiting for the reads.
+ */
+static void prefetch_scene(Scene scene)
+{
+  for (int i = 0; i < 8; i++)
+  {
+    int fd = open(scene.bands_paths[i].c_str(), O_RDONLY);
+    if (fd < 0)
+      continue;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+  }
+}
+
+int run_batch(vector<Scene> &scenes, RunOptions &options, int jobs, int threads, int64_t memory_budget)
+{
+  if (threads <= 0)
+    threads = max(1, (int)thread::hardware_concurrency());
+  jobs = max(1, min(jobs, (int)scenes.size()));
+  int job_threads = max(1, threads / jobs);
+
+  GeoTags::register_tags();
+
+  atomic<int> next_scene(0);
+  mutex lock;
+  condition_variable released;
+  int64_t memory_used = 0;
+  int running = 0, failed = 0;
+
+  auto job = [&]()
+  {
+    ThreadPool pool(job_threads);
+    Products buffers;
+    thread prefetcher;
+    int64_t held = 0;
+
+    while (true)
+    {
+      int index = next_scene.fetch_add(1);
+      if (index >= scenes.size())
+        break;
+
+      // The disk reads of the next scene overlap the compute of this one
+      if (prefetcher.joinable())
+        prefetcher.join();
+      if (index + 1 < scenes.size())
+        prefetcher = thread(prefetch_scene, scenes[index + 1]);
+
+      uint32_t width_band = 0, height_band = 0;
+      TIFF *band = TIFFOpen(scenes[index].bands_paths[0].c_str(), "r");
+      if (band != NULL)
+      {
+        TIFFGetField(band, TIFFTAG_IMAGEWIDTH, &width_band);
+        TIFFGetField(band, TIFFTAG_IMAGELENGTH, &height_band);
+        TIFFClose(band);
+      }
+      int64_t memory = scene_memory(width_band, height_band, options);
+
+      // The planes kept from the previous scene are already charged, a scene alone always runs
+      {
+        unique_lock<mutex> guard(lock);
+        released.wait(guard, [&] { return memory_budget <= 0 || running == 0 || memory_used - held + memory <= memory_budget; });
+        memory_used += memory - held;
+        held = memory;
+        running++;
+      }
+
+      // A failed scene is reported and skipped, the other jobs go on
+      string report, problem;
+      try
+      {
+        report = process_scene(scenes[index], options, &pool, &buffers);
+      }
+      catch (SceneError &error)
+      {
+        problem = error.what();
+      }
+
+      {
+        unique_lock<mutex> guard(lock);
+        int64_t kept = buffers.arena.capacity;
+        memory_used += kept - held;
+        held = kept;
+        running--;
+        std::cout << "SCENE: " << scenes[index].output_folder << std::endl;
+        if (problem.empty())
+          std::cout << report << "ARENA_HIGH_WATER: " << buffers.arena.high_water << std::endl;
+        else
+        {
+          std::cout << "SCENE_PROBLEM: " << problem << std::endl;
+          failed++;
+        }
+        std::cout << std::flush;
+      }
+      released.notify_all();
+    }
+
+    if (prefetcher.joinable())
+      prefetcher.join();
+    buffers.close();
+    pool.close();
+
+    {
+      unique_lock<mutex> guard(lock);
+      memory_used -= held;
+    }
+    released.notify_all();
+  };
+
+  vector<thread> workers;
+  for (int i = 1; i < jobs; i++)
+    workers.emplace_back(job);
+  job();
+
+  for (int i = 0; i < workers.size(); i++)
+    workers[i].join();
+
+  return failed;
+}
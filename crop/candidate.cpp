@@ -45,3 +45,60 @@ bool compare_candidate_temperature(Candidate a, Candidate b)
 
   return result;
 }
+
+bool rank_hot_candidate(Candidate a, Candidate b)
+{
+  if (a.temperature != b.temperature || a.ndvi != b.ndvi)
+    return compare_candidate_temperature(b, a);
+
+  return a.line < b.line || (a.line == b.line && a.col < b.col);
+}
+
+bool rank_cold_candidate(Candidate a, Candidate b)
+{
+  if (a.temperature != b.temperature || a.ndvi != b.ndvi)
+    return compare_candidate_temperature(a, b);
+
+  return a.line < b.line || (a.line == b.line && a.col < b.col);
+}
+
+CandidateHeap::CandidateHeap(int capacity, bool (*rank)(Candidate, Candidate))
+{
+  this->capacity = capacity;
+  this->rank = rank;
+}
+
+void CandidateHeap::push(const Candidate &candidate)
+{
+  if (this->capacity <= 0)
+  {
+    this->heap.push_back(candidate);
+    return;
+  }
+
+  if (this->heap.size() < this->capacity)
+  {
+    this->heap.push_back(candidate);
+    push_heap(this->heap.begin(), this->heap.end(), this->rank);
+  }
+  else if (this->rank(candidate, this->heap.front()))
+  {
+    pop_heap(this->heap.begin(), this->heap.end(), this->rank);
+    this->heap.back() = candidate;
+    push_heap(this->heap.begin(), this->heap.end(), this->rank);
+  }
+}
+
+void CandidateHeap::merge(CandidateHeap &other)
+{
+  for (int i = 0; i < other.heap.size(); i++)
+    push(other.heap[i]);
+}
+
+vector<Candidate> CandidateHeap::sorted()
+{
+  vector<Candidate> candidates;
+  candidates.swap(this->heap);
+  sort(candidates.begin(), candidates.end(), this->rank);
+  return candidates;
+}
@@ -0,0 +1,160 @@
+#include "counters.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// One group per thread, led by the cycles counter, -1 for the counters that could not be opened. The scope is the
+// pool the thread works for
+struct CounterGroup
+{
+  int fds[COUNTERS];
+  uint64_t ids[COUNTERS];
+  const void *scope;
+};
+
+static bool selected_counters = false;
+
+static atomic<bool> counters_refused(false);
+
+static mutex groups_lock;
+
+static vector<CounterGroup> groups;
+
+static thread_local bool attached = false;
+
+static thread_local const void *attached_scope = NULL;
+
+static thread_local int attached_group = -1;
+
+static const uint64_t COUNTER_CONFIGS[COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES};
+
+CounterSample::CounterSample()
+{
+  for (int c = 0; c < COUNTERS; c++)
+    this->values[c] = -1;
+}
+
+static int open_counter(uint64_t config, int group_fd)
+{
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  // User space only, which perf_event_paranoid 2 still allows for the own threads
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+void counters_select(bool enabled)
+{
+  selected_counters = enabled;
+  if (enabled)
+    counters_attach(NULL);
+}
+
+bool counters_enabled()
+{
+  return selected_counters && !counters_refused;
+}
+
+void counters_attach(const void *scope)
+{
+  if (!counters_enabled())
+    return;
+
+  // A thread already counting only moves to the new scope
+  attached_scope = scope;
+  if (attached)
+  {
+    unique_lock<mutex> guard(groups_lock);
+    if (attached_group >= 0)
+      groups[attached_group].scope = scope;
+    return;
+  }
+  attached = true;
+
+  CounterGroup group;
+  group.fds[COUNTER_CYCLES] = open_counter(COUNTER_CONFIGS[COUNTER_CYCLES], -1);
+  if (group.fds[COUNTER_CYCLES] < 0)
+  {
+    if (!counters_refused.exchange(true))
+      cerr << "Counters problem! - perf_event_open failed (" << strerror(errno) << "), the stages are reported without counters" << endl;
+    return;
+  }
+
+  for (int c = 1; c < COUNTERS; c++)
+    group.fds[c] = open_counter(COUNTER_CONFIGS[c], group.fds[COUNTER_CYCLES]);
+
+  // The values of a group read come with the id of their counter
+  for (int c = 0; c < COUNTERS; c++)
+    if (group.fds[c] < 0 || ioctl(group.fds[c], PERF_EVENT_IOC_ID, &group.ids[c]) < 0)
+      group.ids[c] = UINT64_MAX;
+
+  group.scope = scope;
+  unique_lock<mutex> guard(groups_lock);
+  attached_group = groups.size();
+  groups.push_back(group);
+}
+
+CounterSample counters_read()
+{
+  CounterSample sample;
+  if (!counters_enabled())
+    return sample;
+
+  unique_lock<mutex> guard(groups_lock);
+  bool counted = false;
+  for (CounterGroup &group : groups)
+    counted |= group.scope == attached_scope;
+  if (!counted)
+    return sample;
+
+  for (int c = 0; c < COUNTERS; c++)
+    sample.values[c] = 0;
+
+  // Only the threads of the scope of the calling one, so the scenes of other batch jobs are left out
+  for (CounterGroup &group : groups)
+  {
+    if (group.scope != attached_scope)
+      continue;
+
+    // nr, time enabled, time running, then a value and an id per counter of the group
+    uint64_t data[3 + 2 * COUNTERS];
+    if (read(group.fds[COUNTER_CYCLES], data, sizeof(data)) < (ssize_t)(3 * sizeof(uint64_t)))
+      continue;
+
+    double scale = data[2] > 0 && data[2] < data[1] ? (double)data[1] / data[2] : 1.0;
+    for (uint64_t i = 0; i < data[0] && i < COUNTERS; i++)
+    {
+      uint64_t value = data[3 + 2 * i], id = data[4 + 2 * i];
+      for (int c = 0; c < COUNTERS; c++)
+        if (group.ids[c] == id)
+          sample.values[c] += (int64_t)(value * scale);
+    }
+  }
+
+  // A counter missing from a group is missing from the sum
+  for (CounterGroup &group : groups)
+    for (int c = 0; c < COUNTERS; c++)
+      if (group.scope == attached_scope && group.fds[c] < 0)
+        sample.values[c] = -1;
+
+  return sample;
+}
+
+CounterSample counters_delta(CounterSample initial, CounterSample final)
+{
+  CounterSample delta;
+  for (int c = 0; c < COUNTERS; c++)
+    if (initial.values[c] >= 0 && final.values[c] >= 0)
+      delta.values[c] = final.values[c] - initial.values[c];
+  return delta;
+}
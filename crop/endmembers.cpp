@@ -1,108 +1,346 @@
 #include "endmembers.h"
+#include "metrics.h"
+
+static int selected_limit = CANDIDATE_TOP_K;
+
+void candidate_limit_select(int limit)
+{
+  selected_limit = limit;
+}
+
+int candidate_limit()
+{
+  return selected_limit;
+}
 
 void get_quartiles(float *target, float *v_quartile, int height_band, int width_band, float first_interval, float middle_interval, float last_interval)
 {
-  const int SIZE = height_band * width_band;
-  float *target_values = (float *)malloc(sizeof(float) * SIZE);
+  float intervals[3] = {first_interval, middle_interval, last_interval};
+  get_quantiles(&target, 1, height_band * width_band, NULL, intervals, 3, v_quartile, NULL);
+}
+
+const float SEBAL::intervals[9] = {0.25, 0.50, 0.75,
+                                   0.25, 0.50, 0.75,
+                                   0.25, 0.50, 0.75};
+
+const float STEEP::intervals[9] = {0.15, 0.97, 0.97,
+                                   0.25, 0.50, 0.75,
+                                   0.20, 0.85, 0.97};
+
+/**
+ * Keeps, in order, the candidates on the requested side of the median temperature of the list.
+ */
+static void filter_by_median_temperature(vector<Candidate> &candidates, bool keep_upper)
+{
+  if (candidates.empty())
+    return;
 
-  if (target_values == NULL)
-    exit(15);
+  vector<float> temperatures(candidates.size());
+  for (int i = 0; i < candidates.size(); i++)
+    temperatures[i] = candidates[i].temperature;
 
-  int pos = 0;
-  for (int i = 0; i < height_band * width_band; i++)
+  int middle = temperatures.size() / 2;
+  nth_element(temperatures.begin(), temperatures.begin() + middle, temperatures.end());
+  float median = temperatures[middle];
+
+  candidates.erase(remove_if(candidates.begin(), candidates.end(), [&](const Candidate &c)
+                             { return keep_upper ? c.temperature < median : c.temperature > median; }),
+                   candidates.end());
+}
+
+void SecondFilter::second_filter(vector<Candidate> &hotCandidates, vector<Candidate> &coldCandidates)
+{
+  filter_by_median_temperature(hotCandidates, true);
+  filter_by_median_temperature(coldCandidates, false);
+}
+
+template <typename Method>
+void get_endmember_quartiles(float *ndvi, float *surface_temperature, float *albedo, int height_band, int width_band, float *ndviQuartile, float *tsQuartile, float *albedoQuartile, const uint64_t *valid_mask, ThreadPool *pool)
+{
+  float *rasters[3] = {ndvi, albedo, surface_temperature};
+  float quartiles[9];
+
+  // The three rasters share the histogram passes
+  get_quantiles(rasters, 3, height_band * width_band, valid_mask, Method::intervals, 3, quartiles, pool);
+
+  for (int i = 0; i < 3; i++)
   {
-    if (!isnan(target[i]) && !isinf(target[i]))
+    ndviQuartile[i] = quartiles[i];
+    albedoQuartile[i] = quartiles[3 + i];
+    tsQuartile[i] = quartiles[6 + i];
+  }
+}
+
+CandidateGrid::CandidateGrid(vector<Candidate> &candidates, int height_limit, int width_limit)
+{
+  // Cells at least as large as the limits keep every match within the 3x3 neighbourhood of a cell
+  this->cell_height = max(height_limit, CANDIDATE_GRID_MIN_CELL);
+  this->cell_width = max(width_limit, CANDIDATE_GRID_MIN_CELL);
+
+  int max_line = 0, max_col = 0;
+  for (int i = 0; i < candidates.size(); i++)
+  {
+    max_line = max(max_line, candidates[i].line);
+    max_col = max(max_col, candidates[i].col);
+  }
+  this->grid_lines = max_line / this->cell_height + 1;
+  this->grid_cols = max_col / this->cell_width + 1;
+
+  // Counting sort by cell, candidates keep their rank order inside each cell
+  this->cell_start.assign(this->grid_lines * this->grid_cols + 1, 0);
+  for (int i = 0; i < candidates.size(); i++)
+    this->cell_start[cell_of(candidates[i].line, candidates[i].col) + 1]++;
+  for (int c = 0; c < this->grid_lines * this->grid_cols; c++)
+    this->cell_start[c + 1] += this->cell_start[c];
+
+  vector<int> fill_pos(this->cell_start.begin(), this->cell_start.end() - 1);
+  this->ranks.resize(candidates.size());
+  for (int i = 0; i < candidates.size(); i++)
+    this->ranks[fill_pos[cell_of(candidates[i].line, candidates[i].col)]++] = i;
+}
+
+int CandidateGrid::cell_of(int line, int col)
+{
+  return (line / this->cell_height) * this->grid_cols + col / this->cell_width;
+}
+
+int CandidateGrid::best_match(vector<Candidate> &candidates, Candidate pixel, int height_limit, int width_limit)
+{
+  int best = -1;
+  int cell_line = pixel.line / this->cell_height;
+  int cell_col = pixel.col / this->cell_width;
+
+  for (int l = max(cell_line - 1, 0); l <= min(cell_line + 1, this->grid_lines - 1); l++)
+  {
+    for (int c = max(cell_col - 1, 0); c <= min(cell_col + 1, this->grid_cols - 1); c++)
     {
-      target_values[pos] = target[i];
-      pos++;
+      int cell = l * this->grid_cols + c;
+      for (int k = this->cell_start[cell]; k < this->cell_start[cell + 1]; k++)
+      {
+        int rank = this->ranks[k];
+        if (best != -1 && rank > best)
+          break;
+
+        if (abs(candidates[rank].line - pixel.line) < height_limit && abs(candidates[rank].col - pixel.col) < width_limit)
+        {
+          best = rank;
+          break;
+        }
+      }
     }
   }
 
-  int first_index = static_cast<int>(floor(first_interval * pos));
-  int middle_index = static_cast<int>(floor(middle_interval * pos));
-  int last_index = static_cast<int>(floor(last_interval * pos));
+  return best;
+}
+
+pair<Candidate, Candidate> pair_endmembers(vector<Candidate> &hotCandidates, vector<Candidate> &coldCandidates, int height_limit, int width_limit)
+{
+  if (hotCandidates.empty() || coldCandidates.empty())
+  {
+    scene_problem("Pixel problem! - There are no final candidates", 15);
+  }
+
+  // Hottest hot and coldest cold candidates first, ties keep the pixel order
+  stable_sort(hotCandidates.begin(), hotCandidates.end(), [](Candidate a, Candidate b) { return compare_candidate_temperature(b, a); });
+  stable_sort(coldCandidates.begin(), coldCandidates.end(), compare_candidate_temperature);
 
-  std::nth_element(target_values, target_values + first_index, target_values + pos);
-  v_quartile[0] = target_values[first_index];
+  CandidateGrid grid(coldCandidates, height_limit, width_limit);
+  for (int i = 0; i < hotCandidates.size(); ++i)
+  {
+    int cold = grid.best_match(coldCandidates, hotCandidates[i], height_limit, width_limit);
+    if (cold != -1)
+      return {hotCandidates[i], coldCandidates[cold]};
+  }
 
-  std::nth_element(target_values, target_values + middle_index, target_values + pos);
-  v_quartile[1] = target_values[middle_index];
+  scene_problem("Pixel problem! - There are no limit macthes", 15);
+}
 
-  std::nth_element(target_values, target_values + last_index, target_values + pos);
-  v_quartile[2] = target_values[last_index];
+/**
+ * Records one step of the selection, started at begin, under the backend of the pool running it.
+ */
+static void record_selection_step(string step, system_clock::time_point begin, MetricsSample sample, int64_t pixels, int64_t bytes_read, ThreadPool *pool)
+{
+  if (!metrics_enabled())
+    return;
 
-  free(target_values);
+  system_clock::time_point end = system_clock::now();
+  int64_t initial_time = duration_cast<nanoseconds>(begin.time_since_epoch()).count();
+  int64_t final_time = duration_cast<nanoseconds>(end.time_since_epoch()).count();
+  metrics_record(pool == NULL ? "SERIAL" : pool->backend(), step, final_time - initial_time, metrics_since(sample), initial_time, final_time,
+                 pixels, bytes_read, 0);
 }
 
-pair<Candidate, Candidate> getEndmembers(float *ndvi, float *surface_temperature, float *albedo, float *net_radiation, float *soil_heat, int height_band, int width_band, int height_limit, int width_limit)
+template <typename Method, typename Policy>
+pair<Candidate, Candidate> getEndmembers(float *ndvi, float *surface_temperature, float *albedo, float *net_radiation, float *soil_heat, int height_band, int width_band, int height_limit, int width_limit, const uint64_t *valid_mask, ThreadPool *pool)
 {
-  vector<Candidate> hotCandidates;
-  vector<Candidate> coldCandidates;
+  typedef typename Policy::accumulate A;
 
   vector<float> tsQuartile(3);
   vector<float> ndviQuartile(3);
   vector<float> albedoQuartile(3);
 
-  // STEEP
-  get_quartiles(ndvi, ndviQuartile.data(), height_band, width_band, 0.15, 0.97, 0.97);
-  get_quartiles(albedo, albedoQuartile.data(), height_band, width_band, 0.25, 0.50, 0.75);
-  get_quartiles(surface_temperature, tsQuartile.data(), height_band, width_band, 0.20, 0.85, 0.97);
+  int size = height_band * width_band;
+  system_clock::time_point begin = system_clock::now();
+  MetricsSample sample = metrics_sample();
 
-  // SEBAL
-  // get_quartiles(ndvi, ndviQuartile.data(), height_band, width_band, 0.25, 0.50, 0.75);
-  // get_quartiles(albedo, albedoQuartile.data(), height_band, width_band, 0.25, 0.50, 0.75);
-  // get_quartiles(surface_temperature, tsQuartile.data(), height_band, width_band, 0.25, 0.50, 0.75);
+  get_endmember_quartiles<Method>(ndvi, surface_temperature, albedo, height_band, width_band, ndviQuartile.data(), tsQuartile.data(), albedoQuartile.data(), valid_mask, pool);
+  record_selection_step("P2_QUANTILES", begin, sample, size, 3 * (int64_t)size * sizeof(float), pool);
 
-  float *ho = (float *)malloc(sizeof(float) * height_band * width_band);
-  for (int i = 0; i < height_band * width_band; i++)
+  begin = system_clock::now();
+  sample = metrics_sample();
+
+  CandidateHeap hotHeap(candidate_limit(), rank_hot_candidate);
+  CandidateHeap coldHeap(candidate_limit(), rank_cold_candidate);
+  mutex merge_lock;
+
+  auto collect = [&](int start, int end)
   {
-    int line = i / width_band;
-    int col = i % width_band;
+    CandidateHeap hot(candidate_limit(), rank_hot_candidate);
+    CandidateHeap cold(candidate_limit(), rank_cold_candidate);
 
-    ho[i] = net_radiation[i] - soil_heat[i];
+    valid_runs(valid_mask, start, end, [&](int first, int last)
+    {
+      for (int i = first; i < last; i++)
+      {
+        int line = i / width_band;
+        int col = i % width_band;
 
-    // STEEP
-    bool hotNDVI = !std::isnan(ndvi[i]) && ndvi[i] > 0.10 && ndvi[i] < ndviQuartile[0];
-    bool hotAlbedo = !std::isnan(albedo[i]) && albedo[i] > albedoQuartile[1] && albedo[i] < albedoQuartile[2];
-    bool hotTS = !std::isnan(surface_temperature[i]) && surface_temperature[i] > tsQuartile[1] && surface_temperature[i] < tsQuartile[2];
+        A ho = A(net_radiation[i]) - soil_heat[i];
 
-    bool coldNDVI = !std::isnan(ndvi[i]) && ndvi[i] > ndviQuartile[2];
-    bool coldAlbedo = !std::isnan(surface_temperature[i]) && albedo[i] > albedoQuartile[0] && albedo[i] < albedoQuartile[1];
-    bool coldTS = !std::isnan(albedo[i]) && surface_temperature[i] < tsQuartile[0];
+        if (Method::template is_hot<Policy>(ndvi[i], surface_temperature[i], albedo[i], ndviQuartile.data(), tsQuartile.data(), albedoQuartile.data()))
+          hot.push(Candidate(ndvi[i], surface_temperature[i], net_radiation[i], soil_heat[i], ho, line, col));
+        if (Method::template is_cold<Policy>(ndvi[i], surface_temperature[i], albedo[i], ndviQuartile.data(), tsQuartile.data(), albedoQuartile.data()))
+          cold.push(Candidate(ndvi[i], surface_temperature[i], net_radiation[i], soil_heat[i], ho, line, col));
+      }
+    });
 
-    // SEBAL
-    // bool hotNDVI = !isnan(ndvi[i]) && ndvi[i] > 0.10 && ndvi[i] < ndviQuartile[0];
-    // bool hotAlbedo = !isnan(albedo[i]) && albedo[i] > albedoQuartile[1];
-    // bool hotTS = !isnan(surface_temperature[i]) && surface_temperature[i] > tsQuartile[1];
+    unique_lock<mutex> guard(merge_lock);
+    hotHeap.merge(hot);
+    coldHeap.merge(cold);
+  };
 
-    // bool coldNDVI = !isnan(ndvi[i]) && ndvi[i] > ndviQuartile[2];
-    // bool coldAlbedo = !isnan(surface_temperature[i]) && albedo[i] < albedoQuartile[1];
-    // bool coldTS = !isnan(albedo[i]) && surface_temperature[i] < tsQuartile[0];
+  // A few chunks per thread, so that few collectors have to be merged
+  if (pool == NULL)
+    collect(0, size);
+  else
+    pool->parallel_for(0, size, max(size / (pool->threads * 4), width_band), collect);
 
-    if (hotAlbedo && hotNDVI && hotTS)
-      hotCandidates.emplace_back(ndvi[i], surface_temperature[i], net_radiation[i], soil_heat[i], ho[i], line, col);
-    if (coldNDVI && coldAlbedo && coldTS)
-      coldCandidates.emplace_back(ndvi[i], surface_temperature[i], net_radiation[i], soil_heat[i], ho[i], line, col);
-  }
+  vector<Candidate> hotCandidates = hotHeap.sorted();
+  vector<Candidate> coldCandidates = coldHeap.sorted();
+  record_selection_step("P2_CANDIDATES", begin, sample, size, 5 * (int64_t)size * sizeof(float), pool);
 
-  if (hotCandidates.empty() || coldCandidates.empty())
-  {
-    cerr << "Pixel problem! - There are no final candidates";
-    exit(15);
-  }
+  begin = system_clock::now();
+  sample = metrics_sample();
 
-  for (int i = 0; i < hotCandidates.size(); ++i)
+  Method::second_filter(hotCandidates, coldCandidates);
+  pair<Candidate, Candidate> pixels = pair_endmembers(hotCandidates, coldCandidates, height_limit, width_limit);
+  record_selection_step("P2_PAIRING", begin, sample, hotCandidates.size() + coldCandidates.size(), 0, pool);
+  return pixels;
+}
+
+pair<Candidate, Candidate> endmembersSeconfFilter(float *ndvi, float *surface_temperature, float *albedo, float *net_radiation, float *soil_heat, int height_band, int width_band, int height_limit, int width_limit)
+{
+  return getEndmembers(METHOD_SECOND_FILTER, ndvi, surface_temperature, albedo, net_radiation, soil_heat, height_band, width_band, height_limit, width_limit, NULL, NULL);
+}
+
+pair<Candidate, Candidate> getEndmembers(int method, float *ndvi, float *surface_temperature, float *albedo, float *net_radiation, float *soil_heat, int height_band, int width_band, int height_limit, int width_limit, const uint64_t *valid_mask, ThreadPool *pool)
+{
+  pair<Candidate, Candidate> pixels;
+  precision_dispatch([&](auto policy) {
+    typedef decltype(policy) Policy;
+
+    switch (method)
+    {
+    case METHOD_SEBAL:
+      pixels = getEndmembers<SEBAL, Policy>(ndvi, surface_temperature, albedo, net_radiation, soil_heat, height_band, width_band, height_limit, width_limit, valid_mask, pool);
+      break;
+    case METHOD_STEEP:
+      pixels = getEndmembers<STEEP, Policy>(ndvi, surface_temperature, albedo, net_radiation, soil_heat, height_band, width_band, height_limit, width_limit, valid_mask, pool);
+      break;
+    case METHOD_SECOND_FILTER:
+      pixels = getEndmembers<SecondFilter, Policy>(ndvi, surface_temperature, albedo, net_radiation, soil_heat, height_band, width_band, height_limit, width_limit, valid_mask, pool);
+      break;
+    default:
+      scene_problem("Method problem! - Unknown endmembers method " + std::to_string(method), 15);
+    }
+  });
+  return pixels;
+}
+
+template <typename Method, typename Policy>
+pair<Candidate, Candidate> getEndmembersPyramid(Pyramid &pyramid, float *ndvi, float *surface_temperature, float *albedo, float *net_radiation, float *soil_heat, int height_band, int width_band, int height_limit, int width_limit, ThreadPool *pool)
+{
+  typedef typename Policy::accumulate A;
+
+  CandidateHeap hotHeap(candidate_limit(), rank_hot_candidate);
+  CandidateHeap coldHeap(candidate_limit(), rank_cold_candidate);
+
+  vector<float> tsQuartile(3);
+  vector<float> ndviQuartile(3);
+  vector<float> albedoQuartile(3);
+
+  get_endmember_quartiles<Method>(pyramid.ndvi.data(), pyramid.surface_temperature.data(), pyramid.albedo.data(), pyramid.height, pyramid.width,
+                                  ndviQuartile.data(), tsQuartile.data(), albedoQuartile.data(), NULL, pool);
+
+  for (int cell = 0; cell < pyramid.height * pyramid.width; cell++)
   {
-    for (int j = 0; j < coldCandidates.size(); ++j)
+    bool hot_cell = Method::template is_hot<Policy>(pyramid.ndvi[cell], pyramid.surface_temperature[cell], pyramid.albedo[cell], ndviQuartile.data(), tsQuartile.data(), albedoQuartile.data());
+    bool cold_cell = Method::template is_cold<Policy>(pyramid.ndvi[cell], pyramid.surface_temperature[cell], pyramid.albedo[cell], ndviQuartile.data(), tsQuartile.data(), albedoQuartile.data());
+    if (!hot_cell && !cold_cell)
+      continue;
+
+    // Refine the cell at full resolution
+    int first_line = (cell / pyramid.width) * pyramid.factor;
+    int first_col = (cell % pyramid.width) * pyramid.factor;
+    for (int line = first_line; line < min(first_line + pyramid.factor, height_band); line++)
     {
-      if (max(hotCandidates[i].line, coldCandidates[j].line) - min(hotCandidates[i].line, coldCandidates[j].line) < height_limit &&
-          max(hotCandidates[i].col, coldCandidates[j].col) - min(hotCandidates[i].col, coldCandidates[j].col) < width_limit)
+      for (int col = first_col; col < min(first_col + pyramid.factor, width_band); col++)
       {
-        return {hotCandidates[i], coldCandidates[j]};
+        int i = line * width_band + col;
+        A ho = A(net_radiation[i]) - soil_heat[i];
+
+        if (hot_cell && Method::template is_hot<Policy>(ndvi[i], surface_temperature[i], albedo[i], ndviQuartile.data(), tsQuartile.data(), albedoQuartile.data()))
+          hotHeap.push(Candidate(ndvi[i], surface_temperature[i], net_radiation[i], soil_heat[i], ho, line, col));
+        if (cold_cell && Method::template is_cold<Policy>(ndvi[i], surface_temperature[i], albedo[i], ndviQuartile.data(), tsQuartile.data(), albedoQuartile.data()))
+          coldHeap.push(Candidate(ndvi[i], surface_temperature[i], net_radiation[i], soil_heat[i], ho, line, col));
       }
     }
   }
 
-  cerr << "Pixel problem! - There are no limit macthes";
-  exit(15);
+  vector<Candidate> hotCandidates = hotHeap.sorted();
+  vector<Candidate> coldCandidates = coldHeap.sorted();
+
+  if (hotCandidates.empty() || coldCandidates.empty())
+    return getEndmembers<Method, Policy>(ndvi, surface_temperature, albedo, net_radiation, soil_heat, height_band, width_band, height_limit, width_limit, NULL, pool);
+
+  Method::second_filter(hotCandidates, coldCandidates);
+  return pair_endmembers(hotCandidates, coldCandidates, height_limit, width_limit);
 }
+
+pair<Candidate, Candidate> getEndmembersPyramid(int method, Pyramid &pyramid, float *ndvi, float *surface_temperature, float *albedo, float *net_radiation, float *soil_heat, int height_band, int width_band, int height_limit, int width_limit, ThreadPool *pool)
+{
+  pair<Candidate, Candidate> pixels;
+  precision_dispatch([&](auto policy) {
+    typedef decltype(policy) Policy;
+
+    switch (method)
+    {
+    case METHOD_SEBAL:
+      pixels = getEndmembersPyramid<SEBAL, Policy>(pyramid, ndvi, surface_temperature, albedo, net_radiation, soil_heat, height_band, width_band, height_limit, width_limit, pool);
+      break;
+    case METHOD_STEEP:
+      pixels = getEndmembersPyramid<STEEP, Policy>(pyramid, ndvi, surface_temperature, albedo, net_radiation, soil_heat, height_band, width_band, height_limit, width_limit, pool);
+      break;
+    case METHOD_SECOND_FILTER:
+      pixels = getEndmembersPyramid<SecondFilter, Policy>(pyramid, ndvi, surface_temperature, albedo, net_radiation, soil_heat, height_band, width_band, height_limit, width_limit, pool);
+      break;
+    default:
+      scene_problem("Method problem! - Unknown endmembers method " + std::to_string(method), 15);
+    }
+  });
+  return pixels;
+}
+
+template void get_endmember_quartiles<SEBAL>(float *, float *, float *, int, int, float *, float *, float *, const uint64_t *, ThreadPool *);
+template void get_endmember_quartiles<STEEP>(float *, float *, float *, int, int, float *, float *, float *, const uint64_t *, ThreadPool *);
+template void get_endmember_quartiles<SecondFilter>(float *, float *, float *, int, int, float *, float *, float *, const uint64_t *, ThreadPool *);
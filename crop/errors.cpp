@@ -0,0 +1,11 @@
+#include "errors.h"
+
+SceneError::SceneError(string message, int code) : runtime_error(message)
+{
+  this->code = code;
+}
+
+void scene_problem(string message, int code)
+{
+  throw SceneError(message, code);
+}
@@ -0,0 +1,127 @@
+#include "graph.h"
+
+StageGraph::StageGraph()
+{
+  this->planes_count = 0;
+  this->buffers_count = 0;
+}
+
+StageGraph::StageGraph(int planes_count) : StageGraph()
+{
+  this->planes_count = planes_count;
+}
+
+void StageGraph::add(string name, vector<int> inputs, vector<int> outputs)
+{
+  StageNode stage;
+  stage.name = name;
+  stage.inputs = inputs;
+  stage.outputs = outputs;
+  this->stages.push_back(stage);
+}
+
+int StageGraph::find(string name)
+{
+  for (int s = 0; s < this->stages.size(); s++)
+    if (this->stages[s].name == name)
+      return s;
+  return -1;
+}
+
+void StageGraph::plan(vector<int> sources, vector<int> requested, int stages_count, bool compact)
+{
+  int count = min(stages_count, (int)this->stages.size());
+
+  // Walking the chain backwards, a stage runs when a later stage or the caller consumes one of its outputs
+  vector<bool> consumed(this->planes_count, false);
+  for (int p : requested)
+    consumed[p] = true;
+
+  this->active.assign(this->stages.size(), false);
+  for (int s = count - 1; s >= 0; s--)
+  {
+    for (int p : this->stages[s].outputs)
+      if (consumed[p])
+        this->active[s] = true;
+
+    if (this->active[s])
+      for (int p : this->stages[s].inputs)
+        consumed[p] = true;
+  }
+
+  // A slot is live until the last stage reading it, or past the chain when it was requested
+  vector<int> last_use(this->planes_count, -1);
+  for (int s = 0; s < count; s++)
+    if (this->active[s])
+      for (int p : this->stages[s].inputs)
+        last_use[p] = s;
+  for (int p : requested)
+    last_use[p] = count;
+
+  // Only the intermediates, read by the chain alone, are narrowed
+  vector<bool> narrow(this->planes_count, compact);
+  for (int p : sources)
+    narrow[p] = false;
+  for (int p : requested)
+    narrow[p] = false;
+
+  this->buffer.assign(this->planes_count, -1);
+  this->half.assign(this->planes_count, -1);
+  this->buffers_count = 0;
+  vector<bool> released(this->planes_count, false);
+  vector<bool> taken;
+
+  // The lowest buffer with room is taken, and a narrow slot first fills the free half of a buffer already in use
+  auto take = [&](int p) {
+    int chosen = -1, chosen_half = -1;
+    for (int b = 0; b < this->buffers_count && chosen < 0; b++)
+      if (narrow[p] && taken[2 * b] != taken[2 * b + 1])
+        chosen = b, chosen_half = taken[2 * b] ? 1 : 0;
+    for (int b = 0; b < this->buffers_count && chosen < 0; b++)
+      if (!taken[2 * b] && !taken[2 * b + 1])
+        chosen = b, chosen_half = narrow[p] ? 0 : -1;
+    if (chosen < 0)
+    {
+      chosen = this->buffers_count++;
+      chosen_half = narrow[p] ? 0 : -1;
+      taken.push_back(false);
+      taken.push_back(false);
+    }
+
+    this->buffer[p] = chosen;
+    this->half[p] = chosen_half;
+    for (int h = 0; h < 2; h++)
+      if (chosen_half < 0 || chosen_half == h)
+        taken[2 * chosen + h] = true;
+  };
+
+  for (int p : sources)
+    take(p);
+
+  for (int s = 0; s < count; s++)
+  {
+    if (!this->active[s])
+      continue;
+
+    // The outputs of a stage never share a buffer with its own inputs
+    for (int p = 0; p < this->planes_count; p++)
+    {
+      if (this->buffer[p] >= 0 && !released[p] && last_use[p] < s)
+      {
+        for (int h = 0; h < 2; h++)
+          if (this->half[p] < 0 || this->half[p] == h)
+            taken[2 * this->buffer[p] + h] = false;
+        released[p] = true;
+      }
+    }
+
+    for (int p : this->stages[s].outputs)
+      if (consumed[p] && this->buffer[p] < 0)
+        take(p);
+  }
+}
+
+bool StageGraph::runs(int stage)
+{
+  return this->active.empty() || this->active[stage];
+}
@@ -1,24 +1,29 @@
 #include "landsat.h"
 
-Landsat::Landsat(string bands_paths[], MTL mtl)
+Landsat::Landsat(string bands_paths[], MTL mtl, ThreadPool *pool)
 {
   this->mtl = mtl;
+  this->pool = pool;
+  this->pyramid_factor = 0;
+  this->restored = false;
 
   // Load the bands
-  this->bands_resampled[0] = TIFFOpen(bands_paths[0].c_str(), "r");
-  this->bands_resampled[1] = TIFFOpen(bands_paths[1].c_str(), "r");
-  this->bands_resampled[2] = TIFFOpen(bands_paths[2].c_str(), "r");
-  this->bands_resampled[3] = TIFFOpen(bands_paths[3].c_str(), "r");
-  this->bands_resampled[4] = TIFFOpen(bands_paths[4].c_str(), "r");
-  this->bands_resampled[5] = TIFFOpen(bands_paths[5].c_str(), "r");
-  this->bands_resampled[6] = TIFFOpen(bands_paths[6].c_str(), "r");
-  this->bands_resampled[7] = TIFFOpen(bands_paths[7].c_str(), "r");
+  GeoTags::register_tags();
+  for (int i = 0; i < 8; i++)
+    this->bands_resampled[i] = TIFFOpen(bands_paths[i].c_str(), "r");
+  for (int i = 0; i < 8; i++)
+  {
+    if (this->bands_resampled[i] == NULL)
+    {
+      close_bands();
+      scene_problem("Open band problem! - Could not open " + bands_paths[i], 3);
+    }
+  }
 
   // Get the dimensions
   TIFFGetField(this->bands_resampled[0], TIFFTAG_IMAGEWIDTH, &this->width_band);
   TIFFGetField(this->bands_resampled[0], TIFFTAG_IMAGELENGTH, &this->height_band);
-
-  this->products = Products(this->width_band, this->height_band);
+  this->geo.read(this->bands_resampled[0]);
 
   // Get bands metadata
   uint16_t sample_format;
@@ -26,73 +31,295 @@ Landsat::Landsat(string bands_paths[], MTL mtl)
 
   this->sample_bands = sample_format;
 
-  // Get bands data
-  for (int i = 0; i < 7; i++)
+  for (int i = 0; i < 8; i++)
   {
-    for (int line = 0; line < this->height_band; line++)
+    TIFFGetFieldDefaulted(this->bands_resampled[i], TIFFTAG_SAMPLEFORMAT, &this->band_formats[i]);
+    TIFFGetFieldDefaulted(this->bands_resampled[i], TIFFTAG_BITSPERSAMPLE, &this->band_bits[i]);
+
+    // Level-1 DNs (uint16), signed elevation models (int16) and preprocessed float bands
+    bool integer_16 = this->band_bits[i] == 16 && (this->band_formats[i] == SAMPLEFORMAT_UINT || this->band_formats[i] == SAMPLEFORMAT_INT);
+    if (!is_float32(i) && !integer_16)
     {
-      TIFF *curr_band = this->bands_resampled[i];
-      tdata_t band_line_buff = _TIFFmalloc(TIFFScanlineSize(curr_band));
-      unsigned short curr_band_line_size = TIFFScanlineSize(curr_band) / this->width_band;
-      TIFFReadScanline(curr_band, band_line_buff, line);
-
-      for (int col = 0; col < this->width_band; col++)
-      {
-        float value = 0;
-        memcpy(&value, static_cast<unsigned char *>(band_line_buff) + col * curr_band_line_size, curr_band_line_size);
-
-        switch (i)
-        {
-        case 0:
-          this->products.band_blue[line * this->width_band + col] = value;
-          break;
-        case 1:
-          this->products.band_green[line * this->width_band + col] = value;
-          break;
-        case 2:
-          this->products.band_red[line * this->width_band + col] = value;
-          break;
-        case 3:
-          this->products.band_nir[line * this->width_band + col] = value;
-          break;
-        case 4:
-          this->products.band_swir1[line * this->width_band + col] = value;
-          break;
-        case 5:
-          this->products.band_termal[line * this->width_band + col] = value;
-          break;
-        case 6:
-          this->products.band_swir2[line * this->width_band + col] = value;
-          break;
-        default:
-          break;
-        }
-      }
-      _TIFFfree(band_line_buff);
+      close_bands();
+      scene_problem("Unsupported sample format! - " + bands_paths[i], 3);
     }
   }
+};
+
+bool Landsat::is_float32(int band)
+{
+  return this->band_formats[band] == SAMPLEFORMAT_IEEEFP && this->band_bits[band] == 32;
+}
+
+int64_t Landsat::band_bytes(int64_t pixels)
+{
+  int64_t bytes = 0;
+  for (int i = 0; i < 8; i++)
+    bytes += pixels * (this->band_bits[i] / 8);
+  return bytes;
+}
+
+void Landsat::convert_samples(int band, const void *src, float *dest, int count)
+{
+  if (is_float32(band))
+    memcpy(dest, src, count * sizeof(float));
+  else if (this->band_formats[band] == SAMPLEFORMAT_INT)
+    simd_widen_i16(static_cast<const int16_t *>(src), dest, count);
+  else
+    simd_widen_u16(static_cast<const uint16_t *>(src), dest, count);
+}
+
+void Landsat::read_problem(int band, const char *unit, uint32_t index)
+{
+  scene_problem("Read band problem! - Could not read " + string(unit) + " " + std::to_string(index) + " of " + TIFFFileName(this->bands_resampled[band]), 20);
+}
+
+void Landsat::read_strips(int band, int line, int col, int height, int width, float *dest)
+{
+  TIFF *curr_band = this->bands_resampled[band];
+  uint32_t rows_per_strip;
+  TIFFGetFieldDefaulted(curr_band, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+  rows_per_strip = min(rows_per_strip, this->height_band);
 
-  // Get tal data
-  TIFF *elevation_band = this->bands_resampled[7];
-  for (int line = 0; line < this->height_band; line++)
+  int first_line = max(line, 0);
+  int last_line = min(line + height, (int)this->height_band);
+  int first_col = max(col, 0);
+  int last_col = min(col + width, (int)this->width_band);
+  bool full_width = col == 0 && width == this->width_band;
+
+  // Pixels outside the scene: only whole rows for full-width windows, which are otherwise entirely overwritten
+  if (full_width)
   {
-    tdata_t band_line_buff = _TIFFmalloc(TIFFScanlineSize(elevation_band));
-    unsigned short curr_band_line_size = TIFFScanlineSize(elevation_band) / this->width_band;
-    TIFFReadScanline(elevation_band, band_line_buff, line);
+    for (int i = line; i < min(first_line, line + height); i++)
+      fill(dest + (i - line) * this->width_band, dest + (i - line + 1) * this->width_band, NAN);
+    for (int i = max(last_line, line); i < line + height; i++)
+      fill(dest + (i - line) * this->width_band, dest + (i - line + 1) * this->width_band, NAN);
+  }
+  else
+    fill(dest, dest + (int64_t)height * width, NAN);
+  if (first_col >= last_col)
+    return;
 
-    for (int col = 0; col < this->width_band; col++)
+  int sample_size = this->band_bits[band] / 8;
+  vector<unsigned char> strip_buff;
+  for (int strip_line = first_line - first_line % rows_per_strip; strip_line < last_line; strip_line += rows_per_strip)
+  {
+    uint32_t strip = TIFFComputeStrip(curr_band, strip_line, 0);
+    int strip_rows = min((int)rows_per_strip, (int)this->height_band - strip_line);
+
+    // Float strips lying entirely inside a full-width window are decoded in place, the others go through a buffer
+    if (full_width && is_float32(band) && strip_line >= first_line && strip_line + strip_rows <= last_line)
+    {
+      if (TIFFReadEncodedStrip(curr_band, strip, dest + (strip_line - line) * this->width_band, strip_rows * this->width_band * sizeof(float)) < 0)
+        read_problem(band, "strip", strip);
+      continue;
+    }
+
+    strip_buff.resize((size_t)rows_per_strip * this->width_band * sample_size);
+    if (TIFFReadEncodedStrip(curr_band, strip, strip_buff.data(), strip_rows * this->width_band * sample_size) < 0)
+      read_problem(band, "strip", strip);
+
+    int copy_first = max(strip_line, first_line);
+    int copy_last = min(strip_line + strip_rows, last_line);
+    if (full_width)
+      convert_samples(band, strip_buff.data() + (copy_first - strip_line) * this->width_band * sample_size, dest + (copy_first - line) * this->width_band,
+                      (copy_last - copy_first) * this->width_band);
+    else
+      for (int i = copy_first; i < copy_last; i++)
+        convert_samples(band, strip_buff.data() + ((int64_t)(i - strip_line) * this->width_band + first_col) * sample_size,
+                        dest + (int64_t)(i - line) * width + (first_col - col), last_col - first_col);
+  }
+}
+
+void Landsat::read_tiles(int band, int line, int col, int height, int width, float *dest)
+{
+  TIFF *curr_band = this->bands_resampled[band];
+  uint32_t tile_width, tile_length;
+  TIFFGetField(curr_band, TIFFTAG_TILEWIDTH, &tile_width);
+  TIFFGetField(curr_band, TIFFTAG_TILELENGTH, &tile_length);
+
+  fill(dest, dest + (int64_t)height * width, NAN);
+
+  int first_line = max(line, 0);
+  int last_line = min(line + height, (int)this->height_band);
+  int first_col = max(col, 0);
+  int last_col = min(col + width, (int)this->width_band);
+  if (first_line >= last_line || first_col >= last_col)
+    return;
+
+  // Only the tiles the window overlaps are decoded, each one whole, then its rows inside the window are widened
+  int sample_size = this->band_bits[band] / 8;
+  vector<unsigned char> tile_buff(TIFFTileSize(curr_band));
+  for (int tile_line = first_line - first_line % tile_length; tile_line < last_line; tile_line += tile_length)
+  {
+    for (int tile_col = first_col - first_col % tile_width; tile_col < last_col; tile_col += tile_width)
     {
-      float value = 0;
-      memcpy(&value, static_cast<unsigned char *>(band_line_buff) + col * curr_band_line_size, curr_band_line_size);
+      uint32_t tile = TIFFComputeTile(curr_band, tile_col, tile_line, 0, 0);
+      if (TIFFReadEncodedTile(curr_band, tile, tile_buff.data(), tile_buff.size()) < 0)
+        read_problem(band, "tile", tile);
 
-      this->products.elevation[line * this->width_band + col] = value;
-      this->products.tal[line * this->width_band + col] = 0.75 + 2 * pow(10, -5) * value;
+      int copy_first_line = max(tile_line, first_line), copy_last_line = min(tile_line + (int)tile_length, last_line);
+      int copy_first_col = max(tile_col, first_col), copy_last_col = min(tile_col + (int)tile_width, last_col);
+      for (int i = copy_first_line; i < copy_last_line; i++)
+        convert_samples(band, tile_buff.data() + ((int64_t)(i - tile_line) * tile_width + copy_first_col - tile_col) * sample_size,
+                        dest + (int64_t)(i - line) * width + (copy_first_col - col), copy_last_col - copy_first_col);
     }
-    _TIFFfree(band_line_buff);
   }
-};
+}
+
+void Landsat::read_window(int band, int line, int col, int height, int width, float *dest)
+{
+  if (TIFFIsTiled(this->bands_resampled[band]))
+    read_tiles(band, line, col, height, width, dest);
+  else
+    read_strips(band, line, col, height, width, dest);
+}
+
+void Landsat::read_windows(int line, int col, int height, int width, float *dests[])
+{
+  // Each band has its own TIFF handle, so the 8 files are decoded concurrently
+  auto read = [&](int first, int last)
+  {
+    for (int band = first; band < last; band++)
+      read_window(band, line, col, height, width, dests[band]);
+  };
+
+  if (this->pool == NULL)
+    read(0, 8);
+  else
+    this->pool->parallel_for(0, 8, 1, read);
+}
+
+string Landsat::load_bands()
+{
+  system_clock::time_point begin, end;
+  int64_t general_time, initial_time, final_time;
+
+  begin = system_clock::now();
+  initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
+
+  // Only the planes leading to the endmembers inputs and the crop are carved, dead ones are reused
+  float **outputs[13];
+  int count = this->products.staged_outputs(outputs);
+  this->products.plan(this->width_band, this->height_band, outputs, count, RN_G_STAGES);
+  this->products.pool = this->pool;
+
+  // Get bands and elevation data
+  float *bands[8] = {this->products.band_blue, this->products.band_green, this->products.band_red, this->products.band_nir,
+                     this->products.band_swir1, this->products.band_termal, this->products.band_swir2, this->products.elevation};
+
+  read_windows(0, 0, this->height_band, this->width_band, bands);
+
+  // Get tal data, before the valid mask fills the planes that may share the elevation buffer
+  for (int i = 0; i < this->height_band * this->width_band; i++)
+    this->products.tal[i] = 0.75 + 2 * pow(10, -5) * this->products.elevation[i];
+
+  this->products.update_valid_mask();
+
+  end = system_clock::now();
+  general_time = duration_cast<nanoseconds>(end - begin).count();
+  final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  int64_t size = (int64_t)this->height_band * this->width_band;
+  metrics_record(products.backend(), "P0_LOAD_BANDS", general_time, metrics_since(sample), initial_time, final_time, size, band_bytes(size), 9 * size * sizeof(float));
+  return products.backend() + ",P0_LOAD_BANDS," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+}
+
+string Landsat::compute_Rn_G(Station station, bool fused)
+{
+  string result = "";
+  system_clock::time_point begin, end;
+  int64_t general_time, initial_time, final_time;
+
+  begin = system_clock::now();
+  initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
+
+  if (fused)
+  {
+    result += products.rn_g_fused_function(mtl, station.temperature_image);
+  }
+  else
+  {
+    function<string()> stages[RN_G_STAGES] = {
+        [&]() { return products.radiance_function(mtl); },
+        [&]() { return products.reflectance_function(mtl); },
+        [&]() { return products.albedo_function(mtl); },
+
+        // Vegetation indices
+        [&]() { return products.ndvi_function(); },
+        [&]() { return products.pai_function(); },
+        [&]() { return products.lai_function(); },
+        [&]() { return products.evi_function(); },
+
+        // Emissivity indices
+        [&]() { return products.enb_emissivity_function(); },
+        [&]() { return products.eo_emissivity_function(); },
+        [&]() { return products.ea_emissivity_function(); },
+        [&]() { return products.surface_temperature_function(mtl); },
+
+        // Radiation waves
+        [&]() { return products.short_wave_radiation_function(mtl); },
+        [&]() { return products.large_wave_radiation_surface_function(); },
+        [&]() { return products.large_wave_radiation_atmosphere_function(station.temperature_image); },
+
+        // Main products
+        [&]() { return products.net_radiation_function(); },
+        [&]() { return products.soil_heat_flux_function(); }};
+
+    // Stages whose outputs nobody consumes were left out when the planes were planned
+    for (int s = 0; s < RN_G_STAGES; s++)
+      if (products.graph.runs(s))
+        result += stages[s]();
+  }
+
+  if (this->pyramid_factor > 0)
+    result += build_pyramid();
+
+  end = system_clock::now();
+  general_time = duration_cast<nanoseconds>(end - begin).count();
+  final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  int64_t size = (int64_t)this->height_band * this->width_band;
+  metrics_record(products.backend(), "P1_INITIAL_PROD", general_time, metrics_since(sample), initial_time, final_time, size, 0, 0);
+  result += products.backend() + ",P1_INITIAL_PROD," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  return result;
+}
+
+string Landsat::build_pyramid()
+{
+  system_clock::time_point begin, end;
+  int64_t general_time, initial_time, final_time;
+
+  begin = system_clock::now();
+  initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
+
+  this->pyramid = Pyramid(this->width_band, this->height_band, this->pyramid_factor);
+  this->pyramid.accumulate(products.ndvi, products.surface_temperature, products.albedo, 0, this->height_band, this->pool);
+  this->pyramid.finish();
+
+  end = system_clock::now();
+  general_time = duration_cast<nanoseconds>(end - begin).count();
+  final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  int64_t size = (int64_t)this->height_band * this->width_band;
+  metrics_record(products.backend(), "P1_PYRAMID", general_time, metrics_since(sample), initial_time, final_time, size, 3 * size * sizeof(float), 3 * this->pyramid.ndvi.size() * sizeof(float));
+  return products.backend() + ",P1_PYRAMID," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+}
+
+int Landsat::store_planes(string stage, float **planes[])
+{
+  planes[0] = &this->products.ndvi;
+  planes[1] = &this->products.albedo;
+  planes[2] = &this->products.surface_temperature;
+  if (stage == STORE_STAGE_TS)
+    return 3;
+
+  planes[3] = &this->products.net_radiation;
+  planes[4] = &this->products.soil_heat;
+  return 5;
+}
 
-string Landsat::compute_Rn_G(Station station)
+string Landsat::restore_products(string stage)
 {
   string result = "";
   system_clock::time_point begin, end;
@@ -100,39 +327,313 @@ string Landsat::compute_Rn_G(Station station)
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
 
-  result += products.radiance_function(mtl);
-  result += products.reflectance_function(mtl);
-  result += products.albedo_function(mtl);
+  float **slots[5];
+  float *planes[5];
+  int count = store_planes(stage, slots);
+  uint64_t *valid_mask = NULL;
+  size_t size = 0;
 
-  // Vegetation indices
-  result += products.ndvi_function();
-  result += products.pai_function();
-  result += products.lai_function();
-  result += products.evi_function();
+  void *mapping = this->store.map(stage, this->width_band, this->height_band, planes, count, &valid_mask, &size);
+  if (mapping == NULL)
+    return result;
 
-  // Emissivity indices
-  result += products.enb_emissivity_function();
-  result += products.eo_emissivity_function();
-  result += products.ea_emissivity_function();
-  result += products.surface_temperature_function(mtl);
+  // Buffers handed over from a previous scene are not needed anymore
+  this->products.close();
+  this->products = Products();
+  this->products.width_band = this->width_band;
+  this->products.height_band = this->height_band;
+  this->products.nBytes_band = this->height_band * this->width_band * sizeof(float);
+  this->products.pool = this->pool;
+  this->products.mapping = mapping;
+  this->products.mapping_size = size;
+  this->products.valid_mask = valid_mask;
+  for (int i = 0; i < count; i++)
+    *slots[i] = planes[i];
+  this->restored = true;
 
-  // Radiation waves
-  result += products.short_wave_radiation_function(mtl);
-  result += products.large_wave_radiation_surface_function();
-  result += products.large_wave_radiation_atmosphere_function(station.temperature_image);
+  if (this->pyramid_factor > 0 && stage == STORE_STAGE_RN_G)
+    result += build_pyramid();
 
-  // Main products
-  result += products.net_radiation_function();
-  result += products.soil_heat_flux_function();
+  end = system_clock::now();
+  general_time = duration_cast<nanoseconds>(end - begin).count();
+  final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  int64_t scene_size = (int64_t)this->height_band * this->width_band;
+  metrics_record(products.backend(), "P0_STORE_LOAD", general_time, metrics_since(sample), initial_time, final_time, scene_size, count * scene_size * sizeof(float), 0);
+  result += products.backend() + ",P0_STORE_LOAD," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  return result;
+}
+
+string Landsat::save_products(string stage)
+{
+  system_clock::time_point begin, end;
+  int64_t general_time, initial_time, final_time;
+
+  begin = system_clock::now();
+  initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
+
+  float **slots[5];
+  float *planes[5];
+  int count = store_planes(stage, slots);
+  for (int i = 0; i < count; i++)
+    planes[i] = *slots[i];
+  this->store.save(stage, this->width_band, this->height_band, planes, count, this->products.valid_mask);
+
+  end = system_clock::now();
+  general_time = duration_cast<nanoseconds>(end - begin).count();
+  final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  int64_t size = (int64_t)this->height_band * this->width_band;
+  metrics_record(products.backend(), "P1_STORE_SAVE", general_time, metrics_since(sample), initial_time, final_time, size, count * size * sizeof(float), count * size * sizeof(float));
+  return products.backend() + ",P1_STORE_SAVE," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+}
+
+string Landsat::compute_Rn_G_streaming(Station station, int tile_rows)
+{
+  string result = "";
+  system_clock::time_point begin, end;
+  int64_t general_time, initial_time, final_time, read_time = 0, pyramid_time = 0;
+  int64_t stage_time[RN_G_STAGES] = {0};
+  int64_t calibrated_pixels = 0, pixels = 0;
+
+  begin = system_clock::now();
+  initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
+
+  if (this->pyramid_factor > 0)
+    this->pyramid = Pyramid(this->width_band, this->height_band, this->pyramid_factor);
+
+  // Only the planes consumed by the endmembers selection are kept for the whole scene
+  float **scene_planes[] = {&this->products.ndvi, &this->products.albedo, &this->products.surface_temperature,
+                            &this->products.net_radiation, &this->products.soil_heat};
+  this->products.reserve(this->width_band, this->height_band, scene_planes, 5);
+  this->products.pool = this->pool;
+
+  // Every other plane only lives for one strip of rows
+  Products tile;
+  float **tile_planes[] = {&tile.ndvi, &tile.albedo, &tile.surface_temperature, &tile.net_radiation, &tile.soil_heat};
+  tile.plan(this->width_band, tile_rows, tile_planes, 5, RN_G_STAGES);
+  tile.pool = this->pool;
+
+  for (int first_line = 0; first_line < this->height_band; first_line += tile_rows)
+  {
+    int lines = min(tile_rows, (int)this->height_band - first_line);
+    int tile_size = lines * this->width_band;
+    int offset = first_line * this->width_band;
+
+    calibrated_pixels += compute_strip(tile, station, first_line, lines, RN_G_STAGES, stage_time, &read_time);
+    pixels += tile.processed_pixels();
+
+    if (this->pyramid_factor > 0)
+    {
+      system_clock::time_point pyramid_begin = system_clock::now();
+      this->pyramid.accumulate(tile.ndvi, tile.surface_temperature, tile.albedo, first_line, lines, this->pool);
+      pyramid_time += duration_cast<nanoseconds>(system_clock::now() - pyramid_begin).count();
+    }
+
+    memcpy(this->products.ndvi + offset, tile.ndvi, tile_size * sizeof(float));
+    memcpy(this->products.albedo + offset, tile.albedo, tile_size * sizeof(float));
+    memcpy(this->products.surface_temperature + offset, tile.surface_temperature, tile_size * sizeof(float));
+    memcpy(this->products.net_radiation + offset, tile.net_radiation, tile_size * sizeof(float));
+    memcpy(this->products.soil_heat + offset, tile.soil_heat, tile_size * sizeof(float));
+  }
+
+  tile.close();
+
+  if (this->pyramid_factor > 0)
+  {
+    system_clock::time_point pyramid_begin = system_clock::now();
+    this->pyramid.finish();
+    pyramid_time += duration_cast<nanoseconds>(system_clock::now() - pyramid_begin).count();
+  }
+
+  end = system_clock::now();
+  general_time = duration_cast<nanoseconds>(end - begin).count();
+  final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  int64_t size = (int64_t)this->height_band * this->width_band;
+  if (this->pyramid_factor > 0)
+    metrics_record(products.backend(), "P1_PYRAMID", pyramid_time, MetricsSample(), initial_time, final_time, size, 3 * size * sizeof(float), 3 * this->pyramid.ndvi.size() * sizeof(float), true);
+  metrics_record(products.backend(), "P0_STREAM_READ", read_time, MetricsSample(), initial_time, final_time, size, band_bytes(size), 9 * size * sizeof(float), true);
+  metrics_record(products.backend(), "P1_INITIAL_PROD", general_time, metrics_since(sample), initial_time, final_time, size, 0, 0);
+  if (this->pyramid_factor > 0)
+    result += products.backend() + ",P1_PYRAMID," + std::to_string(pyramid_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  result += products.backend() + ",P0_STREAM_READ," + std::to_string(read_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  result += tile.rn_g_stage_timing(stage_time, RN_G_STAGES, initial_time, final_time, calibrated_pixels, pixels);
+  result += products.backend() + ",P1_INITIAL_PROD," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  return result;
+}
+
+int64_t Landsat::compute_strip(Products &tile, Station station, int first_line, int lines, int stages_count, int64_t *stage_time, int64_t *read_time)
+{
+  system_clock::time_point read_begin = system_clock::now();
+
+  float *tile_bands[8] = {tile.band_blue, tile.band_green, tile.band_red, tile.band_nir,
+                          tile.band_swir1, tile.band_termal, tile.band_swir2, tile.elevation};
+  read_windows(first_line, 0, lines, this->width_band, tile_bands);
+
+  for (int i = 0; i < lines * this->width_band; i++)
+    tile.tal[i] = 0.75 + 2 * pow(10, -5) * tile.elevation[i];
+  *read_time += duration_cast<nanoseconds>(system_clock::now() - read_begin).count();
+
+  tile.height_band = lines;
+  tile.update_valid_mask();
+  int64_t calibrated_pixels = tile.processed_pixels();
+  tile.rn_g_fused_sweep(mtl, station.temperature_image, stages_count, stage_time);
+  return calibrated_pixels;
+}
+
+string Landsat::compute_quartile_inputs(Station station, int tile_rows)
+{
+  string result = "";
+  system_clock::time_point begin, end;
+  int64_t general_time, initial_time, final_time, read_time = 0;
+  int64_t stage_time[RN_G_STAGES] = {0};
+  int64_t calibrated_pixels = 0, pixels = 0;
+
+  begin = system_clock::now();
+  initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
+
+  // The quartiles are the only whole-scene reductions, so only their inputs are kept
+  float **scene_planes[] = {&this->products.ndvi, &this->products.albedo, &this->products.surface_temperature};
+  this->products.reserve(this->width_band, this->height_band, scene_planes, 3);
+  this->products.pool = this->pool;
+
+  Products tile;
+  float **tile_planes[] = {&tile.ndvi, &tile.albedo, &tile.surface_temperature};
+  tile.plan(this->width_band, tile_rows, tile_planes, 3, TS_STAGES);
+  tile.pool = this->pool;
+
+  for (int first_line = 0; first_line < this->height_band; first_line += tile_rows)
+  {
+    int lines = min(tile_rows, (int)this->height_band - first_line);
+    int tile_size = lines * this->width_band;
+    int offset = first_line * this->width_band;
+
+    calibrated_pixels += compute_strip(tile, station, first_line, lines, TS_STAGES, stage_time, &read_time);
+    pixels += tile.processed_pixels();
+
+    memcpy(this->products.ndvi + offset, tile.ndvi, tile_size * sizeof(float));
+    memcpy(this->products.albedo + offset, tile.albedo, tile_size * sizeof(float));
+    memcpy(this->products.surface_temperature + offset, tile.surface_temperature, tile_size * sizeof(float));
+  }
+
+  tile.close();
 
   end = system_clock::now();
   general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-  result += "SERIAL,P1_INITIAL_PROD," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  int64_t size = (int64_t)this->height_band * this->width_band;
+  metrics_record(products.backend(), "P0_STREAM_READ", read_time, MetricsSample(), initial_time, final_time, size, band_bytes(size), 9 * size * sizeof(float), true);
+  metrics_record(products.backend(), "P1_INITIAL_PROD", general_time, metrics_since(sample), initial_time, final_time, size, 0, 0);
+  result += products.backend() + ",P0_STREAM_READ," + std::to_string(read_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  result += tile.rn_g_stage_timing(stage_time, TS_STAGES, initial_time, final_time, calibrated_pixels, pixels);
+  result += products.backend() + ",P1_INITIAL_PROD," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
   return result;
 }
 
+template <typename Method, typename Policy>
+pair<Candidate, Candidate> Landsat::stream_endmembers(Station station, int tile_rows, int height_limit, int width_limit)
+{
+  typedef typename Policy::accumulate A;
+
+  int64_t read_time = 0;
+  int64_t stage_time[RN_G_STAGES] = {0};
+
+  vector<float> tsQuartile(3);
+  vector<float> ndviQuartile(3);
+  vector<float> albedoQuartile(3);
+  get_endmember_quartiles<Method>(products.ndvi, products.surface_temperature, products.albedo, this->height_band, this->width_band,
+                                  ndviQuartile.data(), tsQuartile.data(), albedoQuartile.data(), NULL, this->pool);
+
+  CandidateHeap hotHeap(candidate_limit(), rank_hot_candidate);
+  CandidateHeap coldHeap(candidate_limit(), rank_cold_candidate);
+  Products tile;
+  float **tile_planes[] = {&tile.ndvi, &tile.albedo, &tile.surface_temperature, &tile.net_radiation, &tile.soil_heat};
+  tile.plan(this->width_band, tile_rows, tile_planes, 5, RN_G_STAGES);
+  tile.pool = this->pool;
+
+  for (int first_line = 0; first_line < this->height_band; first_line += tile_rows)
+  {
+    int lines = min(tile_rows, (int)this->height_band - first_line);
+    int tile_size = lines * this->width_band;
+    int offset = first_line * this->width_band;
+
+    // Net radiation and soil heat flux are only recomputed for strips holding a candidate
+    bool has_candidate = false;
+    for (int i = offset; i < offset + tile_size && !has_candidate; i++)
+      has_candidate = Method::template is_hot<Policy>(products.ndvi[i], products.surface_temperature[i], products.albedo[i], ndviQuartile.data(), tsQuartile.data(), albedoQuartile.data()) ||
+                      Method::template is_cold<Policy>(products.ndvi[i], products.surface_temperature[i], products.albedo[i], ndviQuartile.data(), tsQuartile.data(), albedoQuartile.data());
+
+    if (!has_candidate)
+      continue;
+
+    compute_strip(tile, station, first_line, lines, RN_G_STAGES, stage_time, &read_time);
+
+    for (int j = 0; j < tile_size; j++)
+    {
+      int i = offset + j;
+      int line = i / this->width_band;
+      int col = i % this->width_band;
+
+      A ho = A(tile.net_radiation[j]) - tile.soil_heat[j];
+
+      if (Method::template is_hot<Policy>(tile.ndvi[j], tile.surface_temperature[j], tile.albedo[j], ndviQuartile.data(), tsQuartile.data(), albedoQuartile.data()))
+        hotHeap.push(Candidate(tile.ndvi[j], tile.surface_temperature[j], tile.net_radiation[j], tile.soil_heat[j], ho, line, col));
+      if (Method::template is_cold<Policy>(tile.ndvi[j], tile.surface_temperature[j], tile.albedo[j], ndviQuartile.data(), tsQuartile.data(), albedoQuartile.data()))
+        coldHeap.push(Candidate(tile.ndvi[j], tile.surface_temperature[j], tile.net_radiation[j], tile.soil_heat[j], ho, line, col));
+    }
+  }
+
+  tile.close();
+
+  vector<Candidate> hotCandidates = hotHeap.sorted();
+  vector<Candidate> coldCandidates = coldHeap.sorted();
+  Method::second_filter(hotCandidates, coldCandidates);
+  return pair_endmembers(hotCandidates, coldCandidates, height_limit, width_limit);
+}
+
+string Landsat::select_endmembers_streaming(Station station, int tile_rows, int method, int height_limit, int width_limit)
+{
+  system_clock::time_point begin, end;
+  int64_t general_time, initial_time, final_time;
+
+  begin = system_clock::now();
+  initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
+
+  pair<Candidate, Candidate> pixels;
+  precision_dispatch([&](auto policy) {
+    typedef decltype(policy) Policy;
+
+    switch (method)
+    {
+    case METHOD_SEBAL:
+      pixels = stream_endmembers<SEBAL, Policy>(station, tile_rows, height_limit, width_limit);
+      break;
+    case METHOD_STEEP:
+      pixels = stream_endmembers<STEEP, Policy>(station, tile_rows, height_limit, width_limit);
+      break;
+    case METHOD_SECOND_FILTER:
+      pixels = stream_endmembers<SecondFilter, Policy>(station, tile_rows, height_limit, width_limit);
+      break;
+    default:
+      scene_problem("Method problem! - Unknown endmembers method " + std::to_string(method), 15);
+    }
+  });
+  hot_pixel = pixels.first;
+  cold_pixel = pixels.second;
+
+  end = system_clock::now();
+  general_time = duration_cast<nanoseconds>(end - begin).count();
+  final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  int64_t size = (int64_t)this->height_band * this->width_band;
+  metrics_record(products.backend(), "P2_PIXEL_SEL", general_time, metrics_since(sample), initial_time, final_time, size, 3 * size * sizeof(float), 0);
+
+  return products.backend() + ",P2_PIXEL_SEL," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+}
+
 string Landsat::select_endmembers(int method, int height_limit, int width_limit)
 {
   system_clock::time_point begin, end;
@@ -140,22 +641,37 @@ string Landsat::select_endmembers(int method, int height_limit, int width_limit)
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
 
-  pair<Candidate, Candidate> pixels = getEndmembers(products.ndvi, products.surface_temperature, products.albedo, products.net_radiation, products.soil_heat, this->height_band, this->width_band, height_limit, width_limit);
+  pair<Candidate, Candidate> pixels;
+  if (this->pyramid.factor > 0)
+    pixels = getEndmembersPyramid(method, this->pyramid, products.ndvi, products.surface_temperature, products.albedo, products.net_radiation, products.soil_heat, this->height_band, this->width_band, height_limit, width_limit, this->pool);
+  else
+    pixels = getEndmembers(method, products.ndvi, products.surface_temperature, products.albedo, products.net_radiation, products.soil_heat, this->height_band, this->width_band, height_limit, width_limit, products.valid_mask, this->pool);
   hot_pixel = pixels.first;
   cold_pixel = pixels.second;
 
   end = system_clock::now();
   general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  int64_t size = (int64_t)this->height_band * this->width_band;
+  metrics_record(products.backend(), "P2_PIXEL_SEL", general_time, metrics_since(sample), initial_time, final_time, size, 3 * size * sizeof(float), 0);
 
-  return "SERIAL,P2_PIXEL_SEL," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  return products.backend() + ",P2_PIXEL_SEL," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
 }
 
-void Landsat::close()
+void Landsat::close_bands()
 {
   for (int i = 0; i < 8; i++)
   {
-    TIFFClose(this->bands_resampled[i]);
+    if (this->bands_resampled[i] != NULL)
+      TIFFClose(this->bands_resampled[i]);
+    this->bands_resampled[i] = NULL;
   }
+}
+
+void Landsat::close()
+{
+  close_bands();
+  this->pyramid.close();
 };
\ No newline at end of file
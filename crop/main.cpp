@@ -2,13 +2,28 @@
 #include <iostream>
 
 #include "utils.h"
+#include "batch.h"
 #include "landsat.h"
 #include "constants.h"
 #include "parameters.h"
+#include "metrics.h"
+
+/**
+ * @brief Reports a flag whose value is not one of the accepted ones and exits, before any scene starts.
+ *
+ * @param flag Flag as given
+ * @param accepted Values accepted by the flag
+ */
+static void usage_problem(string flag, string accepted)
+{
+  cerr << "Usage problem! - Unknown value in " << flag << ", expected " << accepted << endl;
+  exit(22);
+}
 
 /**
  * @brief Main function
- * This function is responsible for reading the input parameters and calling the Landsat class to process the products.
+ * This function is responsible for reading the input parameters and calling the Landsat class to process the products,
+ * for the scene of the positional arguments or for every scene of a batch manifest.
  *
  * @param argc Number of input parameters
  * @param argv Input parameters
@@ -24,6 +39,28 @@
  *              - INPUT_STATION_DATA_INDEX      = 10;
  *              - INPUT_LAND_COVER_INDEX        = 11;
  *              - OUTPUT_FOLDER                 = 12;
+ *              - -meth=N                       : SEB model (0: SEBAL, 1: STEEP, 2: STEEP with second filter)
+ *              - -fused                        : compute the Rn/G chain in a single blocked sweep
+ *              - -stream[=ROWS]                : compute the Rn/G chain strip by strip, without loading the whole bands
+ *              - -crop-only[=ROWS]             : keep only the endmembers inputs, strip by strip, and read the crop from the files
+ *              - -threads=N                    : threads running the product kernels (0: every core)
+ *              - -simd=ISA                     : vector kernels (auto, scalar, avx2 or avx512)
+ *              - -math=TIER                    : log/exp/pow accuracy (exact: libm, fast: vector polynomials)
+ *              - -precision=POLICY             : arithmetic of the kernels (mixed, float, accumulate or double)
+ *              - -compact=FORMAT               : storage of the intermediate planes of the chain (none, fp16 or bf16)
+ *              - -quantiles=MODE               : endmembers quartiles (exact: two histogram passes, approx: one)
+ *              - -pyramid[=FACTOR]             : search the endmembers on a reduced pyramid first, then refine them
+ *              - -top-k=N                      : hot and cold candidates kept by the endmembers search (0: every one, the default of -meth=2)
+ *              - -compress=MODE                : codec of the output tiles (none, deflate, zstd or lzw)
+ *              - -compress-level=N             : level of the deflate or zstd codec
+ *              - -cog                          : write Cloud-Optimized GeoTIFFs, with internal overviews
+ *              - -store=DIR                    : map the endmembers inputs from the product store in DIR, or save them there
+ *              - -batch=MANIFEST               : process every scene of a manifest instead of the positional arguments
+ *              - -batch-jobs=N                 : scenes processed at once in batch mode, sharing the threads
+ *              - -batch-memory=MB              : estimated memory shared by the scenes running at once (0: no limit)
+ *              - -metrics=PATH                 : write the per-stage metrics to PATH, as JSON when it ends in .json and CSV otherwise
+ *              - -trace=PATH                   : write the stages and the pool threads activity to PATH as a Chrome trace
+ *              - -counters                     : add the cycles, instructions and LLC misses of every stage to the metrics
  * @return int
  */
 int main(int argc, char *argv[])
@@ -34,97 +71,186 @@ int main(int argc, char *argv[])
   int OUTPUT_FOLDER = 11;
   int METHOD_INDEX = 12;
 
-  // Load the meteorologic stations data
-  string path_meta_file = argv[INPUT_MTL_DATA_INDEX];
-  string station_data_path = argv[INPUT_STATION_DATA_INDEX];
-
-  // Load the landsat images bands
-  string bands_paths[INPUT_BAND_ELEV_INDEX];
-  for (int i = 0; i < INPUT_BAND_ELEV_INDEX; i++)
+  // In batch mode every argument is a flag, the scenes come from the manifest
+  string manifest_path = "";
+  for (int i = 1; i < argc; i++)
   {
-    bands_paths[i] = argv[i + 1];
+    string flag = argv[i];
+    if (flag.substr(0, 7) == "-batch=")
+      manifest_path = flag.substr(7);
   }
+  if (!manifest_path.empty())
+    METHOD_INDEX = 1;
 
-  // Load the SEB model (SEBAL or STEEP)
-  int method = 0;
-  if (argc >= METHOD_INDEX)
+  // Load the SEB model (SEBAL or STEEP) and the execution flags
+  RunOptions options;
+  int threads = 1;
+  int simd = SIMD_AUTO;
+  int quantiles = QUANTILE_EXACT;
+  int top_k = -1;
+  int batch_jobs = 1;
+  int64_t batch_memory = 0;
+  string metrics_path = "";
+  string trace_path = "";
+  bool counters = false;
+  for (int i = METHOD_INDEX; i < argc; i++)
   {
-    string flag = argv[METHOD_INDEX];
+    string flag = argv[i];
     if (flag.substr(0, 6) == "-meth=")
-      method = flag[6] - '0';
+    {
+      string method = flag.substr(6);
+      if (method != "0" && method != "1" && method != "2")
+        usage_problem(flag, "0, 1 or 2");
+      options.method = method[0] - '0';
+    }
+    else if (flag == "-fused")
+      options.fused = true;
+    else if (flag.substr(0, 9) == "-threads=")
+      threads = atoi(flag.substr(9).c_str());
+    else if (flag.substr(0, 6) == "-simd=")
+    {
+      string isa = flag.substr(6);
+      if (isa == "auto")
+        simd = SIMD_AUTO;
+      else if (isa == "scalar")
+        simd = SIMD_SCALAR;
+      else if (isa == "avx2")
+        simd = SIMD_AVX2;
+      else if (isa == "avx512")
+        simd = SIMD_AVX512;
+      else
+        usage_problem(flag, "auto, scalar, avx2 or avx512");
+    }
+    else if (flag.substr(0, 6) == "-math=")
+    {
+      string tier = flag.substr(6);
+      if (tier == "exact")
+        options.math = VMATH_EXACT;
+      else if (tier == "fast")
+        options.math = VMATH_FAST;
+      else
+        usage_problem(flag, "exact or fast");
+    }
+    else if (flag.substr(0, 11) == "-precision=")
+    {
+      int precision = precision_parse(flag.substr(11));
+      if (precision < 0)
+        usage_problem(flag, "mixed, float, accumulate or double");
+      options.precision = precision;
+    }
+    else if (flag.substr(0, 9) == "-compact=")
+    {
+      int compact = compact_parse(flag.substr(9));
+      if (compact < 0)
+        usage_problem(flag, "none, fp16 or bf16");
+      options.compact = compact;
+    }
+    else if (flag.substr(0, 11) == "-quantiles=")
+    {
+      string mode = flag.substr(11);
+      if (mode == "exact")
+        quantiles = QUANTILE_EXACT;
+      else if (mode == "approx")
+        quantiles = QUANTILE_APPROX;
+      else
+        usage_problem(flag, "exact or approx");
+    }
+    else if (flag.substr(0, 7) == "-stream")
+    {
+      options.streaming = true;
+      if (flag.size() > 8)
+        options.tile_rows = atoi(flag.substr(8).c_str());
+    }
+    else if (flag.substr(0, 16) == "-compress-level=")
+      options.tiff_options.level = atoi(flag.substr(16).c_str());
+    else if (flag.substr(0, 10) == "-compress=")
+    {
+      int compression = tiff_compression(flag.substr(10));
+      if (compression < 0)
+        usage_problem(flag, "none, deflate, zstd or lzw");
+      options.tiff_options.compression = compression;
+    }
+    else if (flag.substr(0, 7) == "-store=")
+      options.store_directory = flag.substr(7);
+    else if (flag == "-cog")
+      options.tiff_options.overviews = true;
+    else if (flag.substr(0, 7) == "-top-k=")
+      top_k = atoi(flag.substr(7).c_str());
+    else if (flag.substr(0, 12) == "-batch-jobs=")
+      batch_jobs = atoi(flag.substr(12).c_str());
+    else if (flag.substr(0, 14) == "-batch-memory=")
+      batch_memory = atoll(flag.substr(14).c_str()) << 20;
+    else if (flag.substr(0, 9) == "-metrics=")
+      metrics_path = flag.substr(9);
+    else if (flag.substr(0, 7) == "-trace=")
+      trace_path = flag.substr(7);
+    else if (flag == "-counters")
+      counters = true;
+    else if (flag.substr(0, 8) == "-pyramid")
+    {
+      options.pyramid_factor = PYRAMID_FACTOR;
+      if (flag.size() > 9)
+        options.pyramid_factor = atoi(flag.substr(9).c_str());
+    }
+    else if (flag.substr(0, 10) == "-crop-only")
+    {
+      options.crop_only = true;
+      if (flag.size() > 11)
+        options.tile_rows = atoi(flag.substr(11).c_str());
+    }
   }
 
-  int WIDTH = (7295 / 2);
-  int HEIGHT = (6502 / 2);
+  options.width_crop = (7295 / 2);
+  options.height_crop = (6502 / 2);
 
   // =====  START + TIME OUTPUT =====
-  MTL mtl = MTL(path_meta_file);
-  Station station = Station(station_data_path, mtl.image_hour);
-  Landsat landsat = Landsat(bands_paths, mtl); // serial implementation
-
-  landsat.compute_Rn_G(station);
-  landsat.select_endmembers(method, HEIGHT, WIDTH);
-
-  std::cout << "HOT_COL: " << landsat.hot_pixel.col << std::endl;
-  std::cout << "HOT_LINE: " << landsat.hot_pixel.line << std::endl;
-  std::cout << "COLD_COL: " << landsat.cold_pixel.col << std::endl;
-  std::cout << "COLD_LINE: " << landsat.cold_pixel.line << std::endl;
-  std::cout << "HEIGHT_ORIGINAL: " << landsat.height_band << std::endl;
-  std::cout << "WIDTH_ORIGINAL: " << landsat.width_band << std::endl;
-  std::cout << "HEIGHT_CROP: " << HEIGHT << std::endl;
-  std::cout << "WIDTH_CROP: " << WIDTH << std::endl;
-
-  float *band_blue;
-  float *band_green;
-  float *band_red;
-  float *band_nir;
-  float *band_swir1;
-  float *band_termal;
-  float *band_swir2;
-  float *elevation;
+  simd_select(simd);
+  vmath_select(options.math);
+  precision_select(options.precision);
+  compact_select(options.compact);
+  quantile_select(quantiles);
+  // The second filter takes the median temperature of the candidate lists, which must not be truncated for it
+  if (top_k < 0)
+    top_k = options.method == METHOD_SECOND_FILTER ? 0 : CANDIDATE_TOP_K;
+  candidate_limit_select(top_k);
+  metrics_select(metrics_path, trace_path);
+  counters_select(counters);
 
-  band_blue = (float *)malloc(HEIGHT * WIDTH * sizeof(float));
-  band_green = (float *)malloc(HEIGHT * WIDTH * sizeof(float));
-  band_red = (float *)malloc(HEIGHT * WIDTH * sizeof(float));
-  band_nir = (float *)malloc(HEIGHT * WIDTH * sizeof(float));
-  band_swir1 = (float *)malloc(HEIGHT * WIDTH * sizeof(float));
-  band_termal = (float *)malloc(HEIGHT * WIDTH * sizeof(float));
-  band_swir2 = (float *)malloc(HEIGHT * WIDTH * sizeof(float));
-  elevation = (float *)malloc(HEIGHT * WIDTH * sizeof(float));
-
-  int initial_line = landsat.cold_pixel.line;
-  int final_line = initial_line + WIDTH;
-
-  int initial_col = landsat.cold_pixel.col;
-  int final_col = initial_col + HEIGHT;
-
-  for (int i = 0; i < HEIGHT; i++)
+  if (!manifest_path.empty())
   {
-    for (int j = 0; j < WIDTH; j++)
+    vector<Scene> scenes = read_manifest(manifest_path);
+    int failed = run_batch(scenes, options, batch_jobs, threads, batch_memory);
+    metrics_write();
+    if (failed > 0)
     {
-      band_blue[i * WIDTH + j] = landsat.products.band_blue[(i + initial_line) * landsat.width_band + (j + initial_col)];
-      band_green[i * WIDTH + j] = landsat.products.band_green[(i + initial_line) * landsat.width_band + (j + initial_col)];
-      band_red[i * WIDTH + j] = landsat.products.band_red[(i + initial_line) * landsat.width_band + (j + initial_col)];
-      band_nir[i * WIDTH + j] = landsat.products.band_nir[(i + initial_line) * landsat.width_band + (j + initial_col)];
-      band_swir1[i * WIDTH + j] = landsat.products.band_swir1[(i + initial_line) * landsat.width_band + (j + initial_col)];
-      band_termal[i * WIDTH + j] = landsat.products.band_termal[(i + initial_line) * landsat.width_band + (j + initial_col)];
-      band_swir2[i * WIDTH + j] = landsat.products.band_swir2[(i + initial_line) * landsat.width_band + (j + initial_col)];
-      elevation[i * WIDTH + j] = landsat.products.elevation[(i + initial_line) * landsat.width_band + (j + initial_col)];
+      cerr << "Batch problem! - " << failed << " of " << scenes.size() << " scenes failed" << endl;
+      return 21;
     }
+    return 0;
   }
 
-  // Save output paths for landsat 8
-  string output_folder = argv[OUTPUT_FOLDER];
-  saveTiff(output_folder + "/B2.TIF", band_blue, HEIGHT, WIDTH);
-  saveTiff(output_folder + "/B3.TIF", band_green, HEIGHT, WIDTH);
-  saveTiff(output_folder + "/B4.TIF", band_red, HEIGHT, WIDTH);
-  saveTiff(output_folder + "/B5.TIF", band_nir, HEIGHT, WIDTH);
-  saveTiff(output_folder + "/B6.TIF", band_swir1, HEIGHT, WIDTH);
-  saveTiff(output_folder + "/B10.TIF", band_termal, HEIGHT, WIDTH);
-  saveTiff(output_folder + "/B7.TIF", band_swir2, HEIGHT, WIDTH);
-  saveTiff(output_folder + "/elevation.tif", elevation, HEIGHT, WIDTH);
+  // Load the landsat images bands, the metadata and the meteorologic stations data
+  Scene scene;
+  for (int i = 0; i < INPUT_BAND_ELEV_INDEX; i++)
+  {
+    scene.bands_paths[i] = argv[i + 1];
+  }
+  scene.mtl_path = argv[INPUT_MTL_DATA_INDEX];
+  scene.station_path = argv[INPUT_STATION_DATA_INDEX];
+  scene.output_folder = argv[OUTPUT_FOLDER];
 
-  landsat.close();
+  ThreadPool pool(threads);
+  try
+  {
+    std::cout << process_scene(scene, options, &pool, NULL);
+  }
+  catch (SceneError &error)
+  {
+    cerr << error.what() << endl;
+    exit(error.code);
+  }
+  pool.close();
+  metrics_write();
 
   return 0;
 }
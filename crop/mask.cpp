@@ -0,0 +1,59 @@
+#include "mask.h"
+
+// Words per chunk of the mask build, 64 pixels each
+static const int MASK_CHUNK_WORDS = 1 << 12;
+
+int mask_words(int size)
+{
+  return (size + 63) / 64;
+}
+
+void build_valid_mask(float **bands, int bands_count, int size, uint64_t *mask, ThreadPool *pool)
+{
+  auto words = [&](int first, int last)
+  {
+    for (int w = first; w < last; w++)
+    {
+      uint64_t bits = 0;
+      int word_end = min(w * 64 + 64, size);
+      for (int i = w * 64; i < word_end; i++)
+      {
+        // NaN fails the comparison too
+        bool valid = false;
+        for (int b = 0; b < bands_count && !valid; b++)
+          valid = bands[b][i] > 0;
+        bits |= (uint64_t)valid << (i - w * 64);
+      }
+      mask[w] = bits;
+    }
+  };
+
+  if (pool == NULL)
+    words(0, mask_words(size));
+  else
+    pool->parallel_for(0, mask_words(size), MASK_CHUNK_WORDS, words);
+}
+
+void valid_runs(const uint64_t *mask, int start, int end, function<void(int, int)> body)
+{
+  if (mask == NULL)
+  {
+    if (start < end)
+      body(start, end);
+    return;
+  }
+
+  int pos = start;
+  while (pos < end)
+  {
+    while (pos < end && mask[pos / 64] == 0)
+      pos = (pos / 64 + 1) * 64;
+    if (pos >= end)
+      break;
+
+    int run_start = pos;
+    while (pos < end && mask[pos / 64] != 0)
+      pos = (pos / 64 + 1) * 64;
+    body(run_start, min(pos, end));
+  }
+}
@@ -0,0 +1,317 @@
+#include "metrics.h"
+
+#include <sys/resource.h>
+
+static string selected_metrics_path = "";
+
+static string selected_trace_path = "";
+
+static mutex registry_lock;
+
+static vector<StageMetric> registry;
+
+// Span of a pool thread running the chunks of one loop
+struct WorkerSpan
+{
+  int thread;
+  int64_t initial_time;
+  int64_t final_time;
+  int chunks;
+};
+
+static vector<WorkerSpan> worker_spans;
+
+static map<thread::id, int> thread_indexes;
+
+static thread_local string current_scene = "";
+
+/**
+ * Small index of the calling thread, in order of first record, as the tid of the trace. Called with the registry lock held.
+ */
+static int thread_index()
+{
+  thread::id id = this_thread::get_id();
+  auto found = thread_indexes.find(id);
+  if (found != thread_indexes.end())
+    return found->second;
+
+  int index = thread_indexes.size();
+  thread_indexes[id] = index;
+  return index;
+}
+
+static string csv_field(string value)
+{
+  if (value.find_first_of(",\"\n") == string::npos)
+    return value;
+
+  string quoted = "\"";
+  for (char c : value)
+    quoted += c == '"' ? string("\"\"") : string(1, c);
+  return quoted + "\"";
+}
+
+static string json_string(string value)
+{
+  string escaped = "\"";
+  for (char c : value)
+  {
+    if (c == '"' || c == '\\')
+      escaped += string("\\") + c;
+    else if ((unsigned char)c < 0x20)
+    {
+      char code[8];
+      snprintf(code, sizeof(code), "\\u%04x", c);
+      escaped += code;
+    }
+    else
+      escaped += c;
+  }
+  return escaped + "\"";
+}
+
+/**
+ * Nanoseconds as the microseconds of the trace event format, keeping the nanosecond digits.
+ */
+static string trace_microseconds(int64_t nanoseconds)
+{
+  char value[32];
+  snprintf(value, sizeof(value), "%lld.%03lld", (long long)(nanoseconds / 1000), (long long)(nanoseconds % 1000));
+  return value;
+}
+
+// Values that were not measured are left empty in the CSV and null in the JSON
+static string optional_value(int64_t value, string missing)
+{
+  return value < 0 ? missing : std::to_string(value);
+}
+
+static string optional_ratio(double numerator, double denominator, string missing)
+{
+  if (numerator < 0 || denominator <= 0)
+    return missing;
+
+  char value[32];
+  snprintf(value, sizeof(value), "%.3f", numerator / denominator);
+  return value;
+}
+
+/**
+ * Derived rates of a stage: instructions per cycle, the GB/s of the planes it reads and writes, and the GB/s between
+ * the last level cache and memory estimated from the misses (bytes per nanosecond are GB/s).
+ */
+static vector<string> derived_rates(StageMetric &metric, string missing)
+{
+  CounterSample &counters = metric.counters;
+  int64_t misses = counters.values[COUNTER_LLC_MISSES];
+  return {optional_ratio(counters.values[COUNTER_INSTRUCTIONS], counters.values[COUNTER_CYCLES], missing),
+          optional_ratio(metric.bytes_read + metric.bytes_written, metric.wall_time, missing),
+          optional_ratio(misses < 0 ? -1 : misses * COUNTER_LINE_BYTES, metric.wall_time, missing)};
+}
+
+static const string RATE_NAMES[3] = {"ipc", "plane_gbps", "llc_gbps"};
+void metrics_select(string metrics_path, string trace_path)
+{
+  selected_metrics_path = metrics_path;
+  selected_trace_path = trace_path;
+}
+
+bool metrics_enabled()
+{
+  return !selected_metrics_path.empty() || !selected_trace_path.empty();
+}
+
+bool metrics_tracing()
+{
+  return !selected_trace_path.empty();
+}
+
+MetricsSample::MetricsSample()
+{
+  this->cpu_time = -1;
+}
+
+MetricsSample::MetricsSample(int64_t cpu_time)
+{
+  this->cpu_time = cpu_time;
+}
+
+MetricsSample metrics_sample()
+{
+  MetricsSample sample;
+  if (!metrics_enabled())
+    return sample;
+
+  timespec time;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+  sample.cpu_time = (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+  sample.counters = counters_read();
+  return sample;
+}
+
+MetricsSample metrics_since(MetricsSample initial)
+{
+  MetricsSample final = metrics_sample();
+
+  MetricsSample spent;
+  if (initial.cpu_time >= 0 && final.cpu_time >= 0)
+    spent.cpu_time = final.cpu_time - initial.cpu_time;
+  spent.counters = counters_delta(initial.counters, final.counters);
+  return spent;
+}
+
+void metrics_scene(string scene)
+{
+  current_scene = scene;
+}
+
+void metrics_record(string backend, string stage, int64_t wall_time, MetricsSample usage, int64_t initial_time, int64_t final_time,
+                    int64_t pixels, int64_t bytes_read, int64_t bytes_written, bool summed)
+{
+  if (!metrics_enabled())
+    return;
+
+  // ru_maxrss is in kilobytes on Linux
+  rusage resources;
+  getrusage(RUSAGE_SELF, &resources);
+
+  StageMetric metric;
+  metric.scene = current_scene;
+  metric.backend = backend;
+  metric.stage = stage;
+  metric.wall_time = wall_time;
+  metric.cpu_time = usage.cpu_time;
+  metric.counters = usage.counters;
+  metric.initial_time = initial_time;
+  metric.final_time = final_time;
+  metric.pixels = pixels;
+  metric.bytes_read = bytes_read;
+  metric.bytes_written = bytes_written;
+  metric.peak_rss = (int64_t)resources.ru_maxrss * 1024;
+  metric.summed = summed;
+
+  unique_lock<mutex> guard(registry_lock);
+  metric.thread = thread_index();
+  registry.push_back(metric);
+}
+
+void metrics_worker(int64_t initial_time, int64_t final_time, int chunks)
+{
+  WorkerSpan span;
+  span.initial_time = initial_time;
+  span.final_time = final_time;
+  span.chunks = chunks;
+
+  unique_lock<mutex> guard(registry_lock);
+  span.thread = thread_index();
+  worker_spans.push_back(span);
+}
+
+static void write_csv(ofstream &out)
+{
+  out << "scene,backend,stage,thread,wall_ns,cpu_ns,start_ns,end_ns,pixels,bytes_read,bytes_written,peak_rss_bytes,summed,"
+      << "cycles,instructions,llc_misses,ipc,plane_gbps,llc_gbps\n";
+  for (StageMetric &metric : registry)
+  {
+    out << csv_field(metric.scene) << "," << metric.backend << "," << metric.stage << "," << metric.thread << ","
+        << metric.wall_time << "," << optional_value(metric.cpu_time, "") << "," << metric.initial_time << "," << metric.final_time << ","
+        << metric.pixels << "," << metric.bytes_read << "," << metric.bytes_written << "," << metric.peak_rss << ","
+        << (metric.summed ? 1 : 0) << "," << optional_value(metric.counters.values[COUNTER_CYCLES], "") << ","
+        << optional_value(metric.counters.values[COUNTER_INSTRUCTIONS], "") << "," << optional_value(metric.counters.values[COUNTER_LLC_MISSES], "")
+        << ",";
+    vector<string> rates = derived_rates(metric, "");
+    out << rates[0] << "," << rates[1] << "," << rates[2] << "\n";
+  }
+}
+
+static void write_json(ofstream &out)
+{
+  out << "{\"stages\": [";
+  for (int i = 0; i < registry.size(); i++)
+  {
+    StageMetric &metric = registry[i];
+    out << (i == 0 ? "\n" : ",\n") << "  {\"scene\": " << json_string(metric.scene) << ", \"backend\": " << json_string(metric.backend)
+        << ", \"stage\": " << json_string(metric.stage) << ", \"thread\": " << metric.thread << ", \"wall_ns\": " << metric.wall_time
+        << ", \"cpu_ns\": " << optional_value(metric.cpu_time, "null") << ", \"start_ns\": " << metric.initial_time
+        << ", \"end_ns\": " << metric.final_time << ", \"pixels\": " << metric.pixels << ", \"bytes_read\": " << metric.bytes_read
+        << ", \"bytes_written\": " << metric.bytes_written << ", \"peak_rss_bytes\": " << metric.peak_rss
+        << ", \"summed\": " << (metric.summed ? "true" : "false") << ", \"cycles\": " << optional_value(metric.counters.values[COUNTER_CYCLES], "null")
+        << ", \"instructions\": " << optional_value(metric.counters.values[COUNTER_INSTRUCTIONS], "null")
+        << ", \"llc_misses\": " << optional_value(metric.counters.values[COUNTER_LLC_MISSES], "null") << ", ";
+    vector<string> rates = derived_rates(metric, "null");
+    for (int r = 0; r < 3; r++)
+      out << (r == 0 ? "" : ", ") << "\"" << RATE_NAMES[r] << "\": " << rates[r];
+    out << "}";
+  }
+  out << "\n]}\n";
+}
+
+/**
+ * Complete ("X") events relative to the first start. The stages whose time is summed over a sweep have no span of
+ * their own and are left out; the sweep shows as the span of its enclosing stage.
+ */
+static void write_trace(ofstream &out)
+{
+  int64_t origin = INT64_MAX;
+  for (StageMetric &metric : registry)
+    origin = min(origin, metric.initial_time);
+  for (WorkerSpan &span : worker_spans)
+    origin = min(origin, span.initial_time);
+
+  out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+  bool first = true;
+  for (StageMetric &metric : registry)
+  {
+    if (metric.summed)
+      continue;
+
+    out << (first ? "\n" : ",\n") << "  {\"name\": " << json_string(metric.stage) << ", \"cat\": \"stage\", \"ph\": \"X\""
+        << ", \"ts\": " << trace_microseconds(metric.initial_time - origin) << ", \"dur\": " << trace_microseconds(metric.final_time - metric.initial_time)
+        << ", \"pid\": 1, \"tid\": " << metric.thread << ", \"args\": {\"scene\": " << json_string(metric.scene)
+        << ", \"pixels\": " << metric.pixels << ", \"bytes_read\": " << metric.bytes_read << ", \"bytes_written\": " << metric.bytes_written
+        << ", \"peak_rss_bytes\": " << metric.peak_rss << "}}";
+    first = false;
+  }
+  for (WorkerSpan &span : worker_spans)
+  {
+    out << (first ? "\n" : ",\n") << "  {\"name\": \"WORKER\", \"cat\": \"pool\", \"ph\": \"X\""
+        << ", \"ts\": " << trace_microseconds(span.initial_time - origin) << ", \"dur\": " << trace_microseconds(span.final_time - span.initial_time)
+        << ", \"pid\": 1, \"tid\": " << span.thread << ", \"args\": {\"chunks\": " << span.chunks << "}}";
+    first = false;
+  }
+  out << "\n]}\n";
+}
+
+void metrics_write()
+{
+  unique_lock<mutex> guard(registry_lock);
+
+  if (!selected_metrics_path.empty())
+  {
+    ofstream out(selected_metrics_path);
+    if (!out.is_open())
+    {
+      cerr << "Metrics problem! - Could not write " << selected_metrics_path << endl;
+      exit(18);
+    }
+
+    string extension = ".json";
+    bool json = selected_metrics_path.size() >= extension.size() &&
+                selected_metrics_path.compare(selected_metrics_path.size() - extension.size(), extension.size(), extension) == 0;
+    if (json)
+      write_json(out);
+    else
+      write_csv(out);
+  }
+
+  if (!selected_trace_path.empty())
+  {
+    ofstream out(selected_trace_path);
+    if (!out.is_open())
+    {
+      cerr << "Metrics problem! - Could not write " << selected_trace_path << endl;
+      exit(18);
+    }
+    write_trace(out);
+  }
+}
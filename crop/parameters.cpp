@@ -20,8 +20,7 @@ MTL::MTL(string metadata_path)
   ifstream in(metadata_path);
   if (!in.is_open() || !in)
   {
-    cerr << "Open metadata problem!" << endl;
-    exit(2);
+    scene_problem("Open metadata problem! - Could not open " + metadata_path, 2);
   }
 
   string line;
@@ -41,23 +40,14 @@ MTL::MTL(string metadata_path)
 
   in.close();
 
-  char julian_day[3];
-  julian_day[0] = mtl["LANDSAT_SCENE_ID"][14];
-  julian_day[1] = mtl["LANDSAT_SCENE_ID"][15];
-  julian_day[2] = mtl["LANDSAT_SCENE_ID"][16];
-
-  char year[4];
-  year[0] = mtl["LANDSAT_SCENE_ID"][10];
-  year[1] = mtl["LANDSAT_SCENE_ID"][11];
-  year[2] = mtl["LANDSAT_SCENE_ID"][12];
-  year[3] = mtl["LANDSAT_SCENE_ID"][13];
-
   int hours = atoi(mtl["SCENE_CENTER_TIME"].substr(1, 2).c_str());
   int minutes = atoi(mtl["SCENE_CENTER_TIME"].substr(4, 2).c_str());
 
-  this->number_sensor = atoi(new char(mtl["LANDSAT_SCENE_ID"][3]));
-  this->julian_day = atoi(julian_day);
-  this->year = atoi(year);
+  this->scene_id = mtl["LANDSAT_SCENE_ID"];
+  this->scene_id.erase(remove(this->scene_id.begin(), this->scene_id.end(), '"'), this->scene_id.end());
+  this->number_sensor = atoi(mtl["LANDSAT_SCENE_ID"].substr(3, 1).c_str());
+  this->julian_day = atoi(mtl["LANDSAT_SCENE_ID"].substr(14, 3).c_str());
+  this->year = atoi(mtl["LANDSAT_SCENE_ID"].substr(10, 4).c_str());
   this->sun_elevation = atof(mtl["SUN_ELEVATION"].c_str());
   this->distance_earth_sun = atof(mtl["EARTH_SUN_DISTANCE"].c_str());
   this->image_hour = (hours + minutes / 60.0) * 100;
@@ -164,8 +154,7 @@ Station::Station(string station_data_path, float image_hour)
   ifstream in(station_data_path);
   if (!in.is_open() || !in)
   {
-    cerr << "Open station data problem!" << endl;
-    exit(2);
+    scene_problem("Open station data problem! - Could not open " + station_data_path, 2);
   }
 
   string line;
@@ -185,8 +174,7 @@ Station::Station(string station_data_path, float image_hour)
 
   if (this->info.size() < 1)
   {
-    cerr << "Station data empty!" << endl;
-    exit(12);
+    scene_problem("Station data empty! - " + station_data_path, 12);
   }
 
   float diff = fabs(atof(this->info[0][2].c_str()) - image_hour);
@@ -0,0 +1,55 @@
+#include "precision.h"
+
+static int selected_policy = PRECISION_DEFAULT;
+
+static int selected_compact = COMPACT_NONE;
+
+static const string PRECISION_NAMES[4] = {"mixed", "float", "accumulate", "double"};
+
+static const string COMPACT_NAMES[3] = {"none", "fp16", "bf16"};
+
+void precision_select(int policy)
+{
+  selected_policy = policy;
+}
+
+int precision_policy()
+{
+  return selected_policy;
+}
+
+string precision_name(int policy)
+{
+  return PRECISION_NAMES[policy];
+}
+
+int precision_parse(string name)
+{
+  for (int policy = 0; policy < 4; policy++)
+    if (PRECISION_NAMES[policy] == name)
+      return policy;
+  return -1;
+}
+
+void compact_select(int format)
+{
+  selected_compact = format;
+}
+
+int compact_format()
+{
+  return selected_compact;
+}
+
+string compact_name(int format)
+{
+  return COMPACT_NAMES[format];
+}
+
+int compact_parse(string name)
+{
+  for (int format = 0; format < 3; format++)
+    if (COMPACT_NAMES[format] == name)
+      return format;
+  return -1;
+}
@@ -1,183 +1,916 @@
 #include "products.h"
 
-Products::Products() {}
+#include <sys/mman.h>
 
-Products::Products(uint32_t width_band, uint32_t height_band)
+Products::Products()
 {
-  this->width_band = width_band;
-  this->height_band = height_band;
-  this->nBytes_band = height_band * width_band * sizeof(float);
-
-  this->band_blue = (float *)malloc(nBytes_band);
-  this->band_green = (float *)malloc(nBytes_band);
-  this->band_red = (float *)malloc(nBytes_band);
-  this->band_nir = (float *)malloc(nBytes_band);
-  this->band_swir1 = (float *)malloc(nBytes_band);
-  this->band_termal = (float *)malloc(nBytes_band);
-  this->band_swir2 = (float *)malloc(nBytes_band);
-  this->tal = (float *)malloc(nBytes_band);
-  this->elevation = (float *)malloc(nBytes_band);
-
-  this->radiance_blue = (float *)malloc(nBytes_band);
-  this->radiance_green = (float *)malloc(nBytes_band);
-  this->radiance_red = (float *)malloc(nBytes_band);
-  this->radiance_nir = (float *)malloc(nBytes_band);
-  this->radiance_swir1 = (float *)malloc(nBytes_band);
-  this->radiance_termal = (float *)malloc(nBytes_band);
-  this->radiance_swir2 = (float *)malloc(nBytes_band);
-
-  this->reflectance_blue = (float *)malloc(nBytes_band);
-  this->reflectance_green = (float *)malloc(nBytes_band);
-  this->reflectance_red = (float *)malloc(nBytes_band);
-  this->reflectance_nir = (float *)malloc(nBytes_band);
-  this->reflectance_swir1 = (float *)malloc(nBytes_band);
-  this->reflectance_termal = (float *)malloc(nBytes_band);
-  this->reflectance_swir2 = (float *)malloc(nBytes_band);
-
-  this->albedo = (float *)malloc(nBytes_band);
-  this->ndvi = (float *)malloc(nBytes_band);
-  this->soil_heat = (float *)malloc(nBytes_band);
-  this->surface_temperature = (float *)malloc(nBytes_band);
-  this->net_radiation = (float *)malloc(nBytes_band);
-  this->lai = (float *)malloc(nBytes_band);
-  this->savi = (float *)malloc(nBytes_band);
-  this->evi = (float *)malloc(nBytes_band);
-  this->pai = (float *)malloc(nBytes_band);
-  this->enb_emissivity = (float *)malloc(nBytes_band);
-  this->eo_emissivity = (float *)malloc(nBytes_band);
-  this->ea_emissivity = (float *)malloc(nBytes_band);
-  this->short_wave_radiation = (float *)malloc(nBytes_band);
-  this->large_wave_radiation_surface = (float *)malloc(nBytes_band);
-  this->large_wave_radiation_atmosphere = (float *)malloc(nBytes_band);
-  this->surface_temperature = (float *)malloc(nBytes_band);
+  this->width_band = 0;
+  this->height_band = 0;
+  this->nBytes_band = 0;
+  this->capacity = 0;
+  this->pool = NULL;
+  this->valid_mask = NULL;
+  this->mapping = NULL;
+  this->mapping_size = 0;
+
+  this->band_blue = this->band_green = this->band_red = this->band_nir = NULL;
+  this->band_swir1 = this->band_termal = this->band_swir2 = NULL;
+  this->elevation = this->tal = NULL;
+
+  this->radiance_blue = this->radiance_green = this->radiance_red = this->radiance_nir = NULL;
+  this->radiance_swir1 = this->radiance_termal = this->radiance_swir2 = NULL;
+
+  this->reflectance_blue = this->reflectance_green = this->reflectance_red = this->reflectance_nir = NULL;
+  this->reflectance_swir1 = this->reflectance_termal = this->reflectance_swir2 = NULL;
+
+  this->albedo = this->ndvi = this->soil_heat = this->surface_temperature = this->net_radiation = NULL;
+  this->savi = this->lai = this->evi = this->pai = NULL;
+  this->enb_emissivity = this->eo_emissivity = this->ea_emissivity = NULL;
+  this->short_wave_radiation = this->large_wave_radiation_surface = this->large_wave_radiation_atmosphere = NULL;
+
+  this->layout.assign(this->planes().size(), -1);
+  this->halves.assign(this->planes().size(), -1);
+  this->compact = COMPACT_NONE;
+  this->packed.assign(this->planes().size(), NULL);
+}
+
+Products::Products(uint32_t width_band, uint32_t height_band) : Products()
+{
+  reserve_all(width_band, height_band);
 };
 
 void Products::close()
 {
-  free(this->band_blue);
-  free(this->band_green);
-  free(this->band_red);
-  free(this->band_nir);
-  free(this->band_swir1);
-  free(this->band_termal);
-  free(this->band_swir2);
-  free(this->tal);
-
-  free(this->radiance_blue);
-  free(this->radiance_green);
-  free(this->radiance_red);
-  free(this->radiance_nir);
-  free(this->radiance_swir1);
-  free(this->radiance_termal);
-  free(this->radiance_swir2);
-
-  free(this->reflectance_blue);
-  free(this->reflectance_green);
-  free(this->reflectance_red);
-  free(this->reflectance_nir);
-  free(this->reflectance_swir1);
-  free(this->reflectance_termal);
-  free(this->reflectance_swir2);
-
-  free(this->albedo);
-  free(this->ndvi);
-  free(this->lai);
-  free(this->evi);
-  free(this->pai);
-
-  free(this->enb_emissivity);
-  free(this->eo_emissivity);
-  free(this->ea_emissivity);
-  free(this->short_wave_radiation);
-  free(this->large_wave_radiation_surface);
-  free(this->large_wave_radiation_atmosphere);
-  free(this->surface_temperature);
-  free(this->net_radiation);
-  free(this->soil_heat);
+  if (this->mapping != NULL)
+  {
+    munmap(this->mapping, this->mapping_size);
+    return;
+  }
+
+  this->arena.close();
 };
 
-string Products::radiance_function(MTL mtl)
+vector<float **> Products::planes()
+{
+  return {&this->band_blue, &this->band_green, &this->band_red, &this->band_nir, &this->band_swir1, &this->band_termal,
+          &this->band_swir2, &this->tal, &this->elevation,
+          &this->radiance_blue, &this->radiance_green, &this->radiance_red, &this->radiance_nir,
+          &this->radiance_swir1, &this->radiance_termal, &this->radiance_swir2,
+          &this->reflectance_blue, &this->reflectance_green, &this->reflectance_red, &this->reflectance_nir,
+          &this->reflectance_swir1, &this->reflectance_termal, &this->reflectance_swir2,
+          &this->albedo, &this->ndvi, &this->savi, &this->lai, &this->evi, &this->pai,
+          &this->enb_emissivity, &this->eo_emissivity, &this->ea_emissivity, &this->short_wave_radiation,
+          &this->large_wave_radiation_surface, &this->large_wave_radiation_atmosphere,
+          &this->surface_temperature, &this->net_radiation, &this->soil_heat};
+}
+
+void Products::carve(uint32_t width_band, uint32_t height_band, vector<int> layout, vector<int> halves, bool with_mask)
+{
+  uint64_t size = (uint64_t)height_band * width_band;
+  this->width_band = width_band;
+  this->height_band = height_band;
+  this->nBytes_band = size * sizeof(float);
+
+  bool missing = (with_mask && this->valid_mask == NULL) || layout != this->layout || halves != this->halves;
+  if (size <= this->capacity && !missing)
+    return;
+
+  // The buffers are carved again from the start of the arena, before the scene writes any of them
+  this->capacity = max(size, this->capacity);
+  size_t plane_bytes = arena_size(this->capacity * sizeof(float));
+  if (*max_element(halves.begin(), halves.end()) >= 0)
+    plane_bytes = arena_size(mask_words(this->capacity) * 64 * sizeof(float));
+  size_t mask_bytes = with_mask ? arena_size(mask_words(this->capacity) * sizeof(uint64_t)) : 0;
+  int buffers_count = *max_element(layout.begin(), layout.end()) + 1;
+  this->arena.reserve(buffers_count * plane_bytes + mask_bytes);
+
+  vector<float *> buffers(buffers_count);
+  for (int b = 0; b < buffers_count; b++)
+    buffers[b] = (float *)this->arena.allocate(plane_bytes);
+
+  // A packed plane holds 16-bit values in one half of its buffer (see packed_run), and has no float plane
+  vector<float **> all = this->planes();
+  for (int i = 0; i < all.size(); i++)
+  {
+    bool packed = layout[i] >= 0 && halves[i] >= 0;
+    *all[i] = layout[i] >= 0 && !packed ? buffers[layout[i]] : NULL;
+    this->packed[i] = packed ? (uint16_t *)buffers[layout[i]] : NULL;
+  }
+  this->valid_mask = with_mask ? (uint64_t *)this->arena.allocate(mask_bytes) : NULL;
+  this->layout = layout;
+  this->halves = halves;
+}
+
+void Products::reserve(uint32_t width_band, uint32_t height_band, float **planes[], int count)
+{
+  // The planes held keep their buffers, missing ones get new buffers of their own
+  vector<float **> all = this->planes();
+  vector<int> layout = this->layout;
+  int buffers_count = *max_element(layout.begin(), layout.end()) + 1;
+  for (int i = 0; i < count; i++)
+  {
+    int k = find(all.begin(), all.end(), planes[i]) - all.begin();
+    if (k < all.size() && layout[k] < 0)
+      layout[k] = buffers_count++;
+  }
+
+  carve(width_band, height_band, layout, this->halves, this->valid_mask != NULL);
+}
+
+void Products::reserve_all(uint32_t width_band, uint32_t height_band)
+{
+  vector<int> layout(this->planes().size());
+  for (int i = 0; i < layout.size(); i++)
+    layout[i] = i;
+
+  this->graph = StageGraph();
+  carve(width_band, height_band, layout, vector<int>(layout.size(), -1), true);
+}
+
+void Products::plan(uint32_t width_band, uint32_t height_band, float **requested[], int count, int stages_count)
+{
+  this->graph = rn_g_plan(requested, count, stages_count);
+  this->compact = compact_format();
+  carve(width_band, height_band, this->graph.buffer, this->graph.half, true);
+}
+
+StageGraph Products::rn_g_plan(float **requested[], int count, int stages_count)
+{
+  vector<float **> all = this->planes();
+  auto slot = [&](float **plane) { return (int)(find(all.begin(), all.end(), plane) - all.begin()); };
+
+  vector<int> sources, requested_slots;
+  float **inputs[] = {&this->band_blue, &this->band_green, &this->band_red, &this->band_nir, &this->band_swir1,
+                      &this->band_termal, &this->band_swir2, &this->elevation, &this->tal};
+  for (float **plane : inputs)
+    sources.push_back(slot(plane));
+  for (int i = 0; i < count; i++)
+    requested_slots.push_back(slot(requested[i]));
+
+  StageGraph graph = rn_g_graph();
+  graph.plan(sources, requested_slots, stages_count, compact_format() != COMPACT_NONE);
+  return graph;
+}
+
+StageGraph Products::rn_g_graph()
+{
+  vector<float **> all = this->planes();
+  auto slots = [&](vector<float **> planes) {
+    vector<int> result;
+    for (float **plane : planes)
+      result.push_back(find(all.begin(), all.end(), plane) - all.begin());
+    return result;
+  };
+
+  StageGraph graph(all.size());
+  graph.add("RADIANCE",
+            slots({&band_blue, &band_green, &band_red, &band_nir, &band_swir1, &band_termal, &band_swir2}),
+            slots({&radiance_blue, &radiance_green, &radiance_red, &radiance_nir, &radiance_swir1, &radiance_termal, &radiance_swir2}));
+  graph.add("REFLECTANCE",
+            slots({&band_blue, &band_green, &band_red, &band_nir, &band_swir1, &band_termal, &band_swir2}),
+            slots({&reflectance_blue, &reflectance_green, &reflectance_red, &reflectance_nir, &reflectance_swir1, &reflectance_termal, &reflectance_swir2}));
+  graph.add("ALBEDO",
+            slots({&reflectance_blue, &reflectance_green, &reflectance_red, &reflectance_nir, &reflectance_swir1, &reflectance_swir2, &tal}),
+            slots({&albedo}));
+  graph.add("NDVI", slots({&reflectance_nir, &reflectance_red}), slots({&ndvi}));
+  graph.add("PAI", slots({&reflectance_nir, &reflectance_red}), slots({&pai}));
+  graph.add("LAI", slots({&reflectance_nir, &reflectance_red}), slots({&savi, &lai}));
+  graph.add("EVI", slots({&reflectance_nir, &reflectance_red, &reflectance_blue}), slots({&evi}));
+  graph.add("ENB_EMISSIVITY", slots({&lai, &ndvi}), slots({&enb_emissivity}));
+  graph.add("EO_EMISSIVITY", slots({&lai, &ndvi}), slots({&eo_emissivity}));
+  graph.add("EA_EMISSIVITY", slots({&tal}), slots({&ea_emissivity}));
+  graph.add("SURFACE_TEMPERATURE", slots({&enb_emissivity, &radiance_termal}), slots({&surface_temperature}));
+  graph.add("SHORT_WAVE_RADIATION", slots({&tal}), slots({&short_wave_radiation}));
+  graph.add("LARGE_WAVE_RADIATION_SURFACE", slots({&surface_temperature, &eo_emissivity}), slots({&large_wave_radiation_surface}));
+  graph.add("LARGE_WAVE_RADIATION_ATMOSPHERE", slots({&ea_emissivity}), slots({&large_wave_radiation_atmosphere}));
+  graph.add("NET_RADIATION",
+            slots({&short_wave_radiation, &albedo, &large_wave_radiation_atmosphere, &large_wave_radiation_surface, &eo_emissivity}),
+            slots({&net_radiation}));
+  graph.add("SOIL_HEAT_FLUX", slots({&ndvi, &surface_temperature, &albedo, &net_radiation}), slots({&soil_heat}));
+  return graph;
+}
+
+int Products::staged_outputs(float **planes[])
+{
+  float **outputs[] = {&this->ndvi, &this->albedo, &this->surface_temperature, &this->net_radiation, &this->soil_heat,
+                       &this->band_blue, &this->band_green, &this->band_red, &this->band_nir, &this->band_swir1,
+                       &this->band_termal, &this->band_swir2, &this->elevation};
+  int count = sizeof(outputs) / sizeof(outputs[0]);
+  for (int i = 0; i < count; i++)
+    planes[i] = outputs[i];
+  return count;
+}
+
+void Products::update_valid_mask()
+{
+  int size = this->height_band * this->width_band;
+  float *bands[7] = {this->band_blue, this->band_green, this->band_red, this->band_nir,
+                     this->band_swir1, this->band_termal, this->band_swir2};
+  build_valid_mask(bands, 7, size, this->valid_mask, this->pool);
+
+  // Packed planes are only read by the chain itself, which skips the same words
+
+  float *planes[] = {this->radiance_blue, this->radiance_green, this->radiance_red, this->radiance_nir,
+                     this->radiance_swir1, this->radiance_termal, this->radiance_swir2,
+                     this->reflectance_blue, this->reflectance_green, this->reflectance_red, this->reflectance_nir,
+                     this->reflectance_swir1, this->reflectance_termal, this->reflectance_swir2,
+                     this->albedo, this->ndvi, this->pai, this->savi, this->lai, this->evi,
+                     this->enb_emissivity, this->eo_emissivity, this->ea_emissivity, this->surface_temperature,
+                     this->short_wave_radiation, this->large_wave_radiation_surface, this->large_wave_radiation_atmosphere,
+                     this->net_radiation, this->soil_heat};
+
+  for (int w = 0; w < mask_words(size); w++)
+  {
+    if (this->valid_mask[w] != 0)
+      continue;
+
+    int word_end = min(w * 64 + 64, size);
+    for (float *plane : planes)
+      if (plane != NULL)
+        fill(plane + w * 64, plane + word_end, NAN);
+  }
+}
+
+void Products::parallel_kernel(function<void(int, int)> kernel)
+{
+  int size = this->height_band * this->width_band;
+  auto runs = [&](int start, int end) { valid_runs(this->valid_mask, start, end, kernel); };
+
+  if (this->pool == NULL)
+    runs(0, size);
+  else
+    this->pool->parallel_for(0, size, PARALLEL_BLOCK_ROWS * this->width_band, runs);
+}
+
+int64_t Products::processed_pixels()
+{
+  int64_t size = (int64_t)this->height_band * this->width_band;
+  if (this->valid_mask == NULL)
+    return size;
+
+  int64_t pixels = 0;
+  for (int w = 0; w < mask_words(size); w++)
+    if (this->valid_mask[w] != 0)
+      pixels += min((int64_t)64, size - w * 64);
+  return pixels;
+}
+
+int64_t Products::stage_pixel_bytes(int stage, bool written)
+{
+  // Before the chain is planned, every plane is a float plane with a buffer
+  StageGraph graph = this->graph.stages.empty() ? rn_g_graph() : this->graph;
+  vector<int> &slots = written ? graph.stages[stage].outputs : graph.stages[stage].inputs;
+
+  int64_t bytes = 0;
+  for (int p : slots)
+  {
+    if (!graph.buffer.empty() && graph.buffer[p] < 0)
+      continue;
+    bool packed = !graph.half.empty() && graph.half[p] >= 0 && this->compact != COMPACT_NONE;
+    bytes += packed ? sizeof(uint16_t) : sizeof(float);
+  }
+  return bytes;
+}
+
+void Products::record_stage(string name, int64_t general_time, MetricsSample usage, int64_t initial_time, int64_t final_time, int64_t pixels, bool summed)
+{
+  if (!metrics_enabled())
+    return;
+
+  int stage = rn_g_graph().find(name);
+  metrics_record(backend(), name, general_time, usage, initial_time, final_time, pixels,
+                 pixels * stage_pixel_bytes(stage, false), pixels * stage_pixel_bytes(stage, true), summed);
+}
+
+/**
+ * Address of pixel i of a packed plane. The two halves of a buffer alternate by runs of 64 pixels, so the 16-bit
+ * values of a run take the bytes of the same run of a float plane: the fused chain, which runs every stage on a block
+ * of whole runs before the next block, can alias packed and float planes as it aliases float planes.
+ */
+static uint16_t *packed_run(uint16_t *buffer, int half, int i)
+{
+  return buffer + (int64_t)(i / 64) * 128 + half * 64 + i % 64;
+}
+
+template <typename Body>
+void Products::packed_kernel(int stage, int start, int end, Body body)
+{
+  vector<int> slots;
+  vector<bool> written;
+  if (stage >= 0 && stage < this->graph.stages.size())
+  {
+    for (int p : this->graph.stages[stage].inputs)
+      if (this->packed[p] != NULL)
+        slots.push_back(p), written.push_back(false);
+    for (int p : this->graph.stages[stage].outputs)
+      if (this->packed[p] != NULL)
+        slots.push_back(p), written.push_back(true);
+  }
+
+  if (slots.empty())
+  {
+    body(*this, start, end);
+    return;
+  }
+
+  // The view points every float plane at the block, and every packed plane at a float buffer of its own
+  Products view;
+  vector<float **> all = this->planes();
+  vector<float **> view_planes = view.planes();
+  vector<float> scratch(slots.size() * FUSED_BLOCK_SIZE);
+
+  for (int block = start; block < end; block += FUSED_BLOCK_SIZE)
+  {
+    int n = min(FUSED_BLOCK_SIZE, end - block);
+
+    for (int k = 0; k < all.size(); k++)
+      *view_planes[k] = *all[k] != NULL ? *all[k] + block : NULL;
+
+    for (int j = 0; j < slots.size(); j++)
+    {
+      float *plane = scratch.data() + j * FUSED_BLOCK_SIZE;
+      *view_planes[slots[j]] = plane;
+      if (written[j])
+        continue;
+
+      for (int i = block; i < block + n; i += 64 - i % 64)
+      {
+        uint16_t *run = packed_run(this->packed[slots[j]], this->halves[slots[j]], i);
+        int length = min(64 - i % 64, block + n - i);
+        if (this->compact == COMPACT_BF16)
+          simd_unpack_bf16(run, plane + i - block, length);
+        else
+          simd_unpack_fp16(run, plane + i - block, length);
+      }
+    }
+
+    body(view, 0, n);
+
+    for (int j = 0; j < slots.size(); j++)
+    {
+      if (!written[j])
+        continue;
+
+      float *plane = scratch.data() + j * FUSED_BLOCK_SIZE;
+      for (int i = block; i < block + n; i += 64 - i % 64)
+      {
+        uint16_t *run = packed_run(this->packed[slots[j]], this->halves[slots[j]], i);
+        int length = min(64 - i % 64, block + n - i);
+        if (this->compact == COMPACT_BF16)
+          simd_pack_bf16(plane + i - block, run, length);
+        else
+          simd_pack_fp16(plane + i - block, run, length);
+      }
+    }
+  }
+}
+
+void Products::refresh_valid_mask(int first_word, int last_word)
+{
+  if (this->valid_mask == NULL)
+    return;
+
+  // Every later product comes from the reflectances, the surface temperature through the emissivity, so the words
+  // without a reflectance are left without any product. The thermal radiance alone does not keep a word valid
+  StageGraph graph = this->graph.stages.empty() ? rn_g_graph() : this->graph;
+  int reflectance = graph.find("REFLECTANCE");
+  vector<int> &calibrated = graph.stages[reflectance].outputs;
+
+  vector<float **> all = this->planes();
+  int size = this->height_band * this->width_band;
+  float unpacked[64];
+
+  for (int w = first_word; w < last_word; w++)
+  {
+    if (this->valid_mask[w] == 0)
+      continue;
+
+    // Slots without a buffer are not consumed later, they do not keep a word valid
+    int word_start = w * 64, length = min(64, size - word_start);
+    bool empty = true, checked = false;
+    for (int k = 0; k < calibrated.size() && empty; k++)
+    {
+      int p = calibrated[k];
+      const float *values = *all[p] != NULL ? *all[p] + word_start : NULL;
+      if (values == NULL && this->packed[p] != NULL)
+      {
+        uint16_t *run = packed_run(this->packed[p], this->halves[p], word_start);
+        if (this->compact == COMPACT_BF16)
+          simd_unpack_bf16(run, unpacked, length);
+        else
+          simd_unpack_fp16(run, unpacked, length);
+        values = unpacked;
+      }
+      if (values == NULL)
+        continue;
+
+      checked = true;
+      for (int i = 0; i < length && empty; i++)
+        empty = isnan(values[i]);
+    }
+    if (!empty || !checked)
+      continue;
+
+    this->valid_mask[w] = 0;
+    for (int s = reflectance + 1; s < graph.stages.size(); s++)
+      for (int p : graph.stages[s].outputs)
+        if (*all[p] != NULL)
+          fill(*all[p] + word_start, *all[p] + word_start + length, NAN);
+  }
+}
+
+string Products::backend()
+{
+  return this->pool == NULL ? "SERIAL" : this->pool->backend();
+}
+
+/**
+ * Radiometric calibration of one band in the compute type of a policy. Float arithmetic goes through the vector
+ * kernel, which rounds exactly like the scalar loop.
+ */
+template <typename Policy>
+static void calibrate(const float *band, float *out, float mult, float add, typename Policy::compute divisor, int start, int end)
+{
+  typedef typename Policy::compute C;
+
+  if (is_same<C, float>::value)
+  {
+    simd_calibrate(band, out, mult, add, divisor, start, end);
+    return;
+  }
+
+  for (int i = start; i < end; i++)
+  {
+    C value = (C(band[i]) * C(mult) + C(add)) / divisor;
+    out[i] = value <= 0 ? NAN : value;
+  }
+}
+
+template <typename Policy>
+void Products::radiance_kernel(MTL mtl, int start, int end)
+{
+  // https://www.usgs.gov/landsat-missions/using-usgs-landsat-level-1-data-product
+  // Bands without a plane are not consumed by any later stage
+  if (this->radiance_blue != NULL)
+    calibrate<Policy>(this->band_blue, this->radiance_blue, mtl.rad_mult[PARAM_BAND_BLUE_INDEX], mtl.rad_add[PARAM_BAND_BLUE_INDEX], 1, start, end);
+  if (this->radiance_green != NULL)
+    calibrate<Policy>(this->band_green, this->radiance_green, mtl.rad_mult[PARAM_BAND_GREEN_INDEX], mtl.rad_add[PARAM_BAND_GREEN_INDEX], 1, start, end);
+  if (this->radiance_red != NULL)
+    calibrate<Policy>(this->band_red, this->radiance_red, mtl.rad_mult[PARAM_BAND_RED_INDEX], mtl.rad_add[PARAM_BAND_RED_INDEX], 1, start, end);
+  if (this->radiance_nir != NULL)
+    calibrate<Policy>(this->band_nir, this->radiance_nir, mtl.rad_mult[PARAM_BAND_NIR_INDEX], mtl.rad_add[PARAM_BAND_NIR_INDEX], 1, start, end);
+  if (this->radiance_swir1 != NULL)
+    calibrate<Policy>(this->band_swir1, this->radiance_swir1, mtl.rad_mult[PARAM_BAND_SWIR1_INDEX], mtl.rad_add[PARAM_BAND_SWIR1_INDEX], 1, start, end);
+  if (this->radiance_termal != NULL)
+    calibrate<Policy>(this->band_termal, this->radiance_termal, mtl.rad_mult[PARAM_BAND_TERMAL_INDEX], mtl.rad_add[PARAM_BAND_TERMAL_INDEX], 1, start, end);
+  if (this->radiance_swir2 != NULL)
+    calibrate<Policy>(this->band_swir2, this->radiance_swir2, mtl.rad_mult[PARAM_BAND_SWIR2_INDEX], mtl.rad_add[PARAM_BAND_SWIR2_INDEX], 1, start, end);
+}
+
+template <typename Policy>
+void Products::reflectance_kernel(MTL mtl, int start, int end)
 {
+  typedef typename Policy::compute C;
+
   // https://www.usgs.gov/landsat-missions/using-usgs-landsat-level-1-data-product
+  const C sin_sun = sin(C(mtl.sun_elevation) * C(acos(-1.0)) / 180);
+
+  if (this->reflectance_blue != NULL)
+    calibrate<Policy>(this->band_blue, this->reflectance_blue, mtl.ref_mult[PARAM_BAND_BLUE_INDEX], mtl.ref_add[PARAM_BAND_BLUE_INDEX], sin_sun, start, end);
+  if (this->reflectance_green != NULL)
+    calibrate<Policy>(this->band_green, this->reflectance_green, mtl.ref_mult[PARAM_BAND_GREEN_INDEX], mtl.ref_add[PARAM_BAND_GREEN_INDEX], sin_sun, start, end);
+  if (this->reflectance_red != NULL)
+    calibrate<Policy>(this->band_red, this->reflectance_red, mtl.ref_mult[PARAM_BAND_RED_INDEX], mtl.ref_add[PARAM_BAND_RED_INDEX], sin_sun, start, end);
+  if (this->reflectance_nir != NULL)
+    calibrate<Policy>(this->band_nir, this->reflectance_nir, mtl.ref_mult[PARAM_BAND_NIR_INDEX], mtl.ref_add[PARAM_BAND_NIR_INDEX], sin_sun, start, end);
+  if (this->reflectance_swir1 != NULL)
+    calibrate<Policy>(this->band_swir1, this->reflectance_swir1, mtl.ref_mult[PARAM_BAND_SWIR1_INDEX], mtl.ref_add[PARAM_BAND_SWIR1_INDEX], sin_sun, start, end);
+  if (this->reflectance_termal != NULL)
+    calibrate<Policy>(this->band_termal, this->reflectance_termal, mtl.ref_mult[PARAM_BAND_TERMAL_INDEX], mtl.ref_add[PARAM_BAND_TERMAL_INDEX], sin_sun, start, end);
+  if (this->reflectance_swir2 != NULL)
+    calibrate<Policy>(this->band_swir2, this->reflectance_swir2, mtl.ref_mult[PARAM_BAND_SWIR2_INDEX], mtl.ref_add[PARAM_BAND_SWIR2_INDEX], sin_sun, start, end);
+}
+
+template <typename Policy>
+void Products::albedo_kernel(MTL mtl, int start, int end)
+{
+  typedef typename Policy::compute C;
+  typedef typename Policy::constant K;
+  typedef typename Policy::accumulate A;
+
+  // https://doi.org/10.1016/j.rse.2017.10.031
+  const float *reflectances[6] = {this->reflectance_blue, this->reflectance_green, this->reflectance_red,
+                                  this->reflectance_nir, this->reflectance_swir1, this->reflectance_swir2};
+  const float weights[6] = {mtl.ref_w_coeff[PARAM_BAND_BLUE_INDEX], mtl.ref_w_coeff[PARAM_BAND_GREEN_INDEX], mtl.ref_w_coeff[PARAM_BAND_RED_INDEX],
+                            mtl.ref_w_coeff[PARAM_BAND_NIR_INDEX], mtl.ref_w_coeff[PARAM_BAND_SWIR1_INDEX], mtl.ref_w_coeff[PARAM_BAND_SWIR2_INDEX]};
+
+  // The vector kernel rounds as the mixed policy does
+  if (is_same<Policy, MixedPrecision>::value)
+  {
+    simd_albedo(reflectances, weights, this->tal, this->albedo, start, end);
+    return;
+  }
+
+  for (int i = start; i < end; i++)
+  {
+    A alb = A(reflectances[0][i]) * A(weights[0]);
+    for (int b = 1; b < 6; b++)
+      alb = alb + A(reflectances[b][i]) * A(weights[b]);
+
+    C value = (alb - K(0.03)) / (C(this->tal[i]) * C(this->tal[i]));
+    this->albedo[i] = value <= 0 ? NAN : value;
+  }
+}
+
+template <typename Policy>
+void Products::ndvi_kernel(int start, int end)
+{
+  typedef typename Policy::compute C;
+
+  for (int i = start; i < end; i++)
+  {
+    C ndvi_value = (C(this->reflectance_nir[i]) - C(this->reflectance_red[i])) / (C(this->reflectance_nir[i]) + C(this->reflectance_red[i]));
+
+    if (ndvi_value <= -1 || ndvi_value >= 1)
+      ndvi_value = NAN;
+
+    this->ndvi[i] = ndvi_value;
+  }
+}
+
+template <typename Policy>
+void Products::pai_kernel(int start, int end)
+{
+  typedef typename Policy::compute C;
+  typedef typename Policy::constant K;
+
+  for (int i = start; i < end; i++)
+  {
+    C pai_value = K(10.1) * (C(this->reflectance_nir[i]) - sqrt(C(this->reflectance_red[i]))) + K(3.1);
+
+    if (pai_value < 0)
+      pai_value = 0;
+
+    this->pai[i] = pai_value;
+  }
+}
+
+template <typename Policy>
+void Products::lai_kernel(int start, int end)
+{
+  typedef typename Policy::compute C;
+  typedef typename Policy::constant K;
+
+  // The vector logarithm is float only
+  if (vmath_tier() == VMATH_FAST && is_same<C, float>::value)
+  {
+    float logs[VMATH_BLOCK_SIZE];
+    float savis[VMATH_BLOCK_SIZE];
+    for (int block = start; block < end; block += VMATH_BLOCK_SIZE)
+    {
+      int n = min(VMATH_BLOCK_SIZE, end - block);
+
+      for (int j = 0; j < n; j++)
+      {
+        int i = block + j;
+        float savi = ((1 + K(0.5)) * (this->reflectance_nir[i] - this->reflectance_red[i])) / (K(0.5) + (this->reflectance_nir[i] + this->reflectance_red[i]));
+        savis[j] = savi;
+        logs[j] = (0.69f - savi) / 0.59f;
+      }
+
+      vmath_log(logs, logs, n);
+
+      // SAVI only gets a plane when a later stage consumes it
+      if (this->savi != NULL)
+        memcpy(this->savi + block, savis, n * sizeof(float));
+
+      for (int j = 0; j < n; j++)
+      {
+        int i = block + j;
+        float savi = savis[j];
+
+        float lai_value = -logs[j] / 0.91f;
+        if (isnan(savi) || savi < K(0.1))
+          lai_value = 0;
+        else if (savi > K(0.687))
+          lai_value = 6;
+
+        this->lai[i] = lai_value < 0 ? 0 : lai_value;
+      }
+    }
+    return;
+  }
+
+  for (int i = start; i < end; i++)
+  {
+    C savi = ((1 + K(0.5)) * (C(this->reflectance_nir[i]) - C(this->reflectance_red[i]))) / (K(0.5) + (C(this->reflectance_nir[i]) + C(this->reflectance_red[i])));
+    if (this->savi != NULL)
+      this->savi[i] = savi;
+
+    // Pixels without SAVI get 0, which is what a freshly allocated plane held before
+    C lai_value = 0;
+    if (!isnan(savi) && savi > K(0.687))
+      lai_value = 6;
+    if (!isnan(savi) && savi <= K(0.687))
+      lai_value = -log((K(0.69) - savi) / K(0.59)) / K(0.91);
+    if (!isnan(savi) && savi < K(0.1))
+      lai_value = 0;
+
+    if (lai_value < 0)
+      lai_value = 0;
+
+    this->lai[i] = lai_value;
+  }
+}
+
+template <typename Policy>
+void Products::evi_kernel(int start, int end)
+{
+  typedef typename Policy::compute C;
+  typedef typename Policy::constant K;
+
+  for (int i = start; i < end; i++)
+  {
+    C nir = this->reflectance_nir[i], red = this->reflectance_red[i], blue = this->reflectance_blue[i];
+    C evi_value = K(2.5) * ((nir - red) / (nir + (6 * red) - (K(7.5) * blue) + 1));
+
+    if (evi_value < 0)
+      evi_value = 0;
+
+    this->evi[i] = evi_value;
+  }
+}
+
+template <typename Policy>
+void Products::enb_emissivity_kernel(int start, int end)
+{
+  typedef typename Policy::compute C;
+  typedef typename Policy::constant K;
+
+  for (int i = start; i < end; i++)
+  {
+    C lai_value = this->lai[i];
+    C enb_value;
+
+    if (lai_value == 0)
+      enb_value = NAN;
+    else
+      enb_value = K(0.97) + K(0.0033) * lai_value;
+
+    if ((this->ndvi[i] < 0) || (lai_value > K(2.99)))
+      enb_value = K(0.98);
+
+    this->enb_emissivity[i] = enb_value;
+  }
+}
+
+template <typename Policy>
+void Products::eo_emissivity_kernel(int start, int end)
+{
+  typedef typename Policy::compute C;
+  typedef typename Policy::constant K;
+
+  for (int i = start; i < end; i++)
+  {
+    C lai_value = this->lai[i];
+    C eo_value;
+
+    if (lai_value == 0)
+      eo_value = NAN;
+    else
+      eo_value = K(0.95) + K(0.01) * lai_value;
+
+    if ((this->ndvi[i] < 0) || (lai_value > K(2.99)))
+      eo_value = K(0.98);
+
+    this->eo_emissivity[i] = eo_value;
+  }
+}
+
+template <typename Policy>
+void Products::ea_emissivity_kernel(int start, int end)
+{
+  typedef typename Policy::compute C;
+  typedef typename Policy::constant K;
+
+  if (vmath_tier() == VMATH_FAST && is_same<C, float>::value)
+  {
+    float values[VMATH_BLOCK_SIZE];
+    for (int block = start; block < end; block += VMATH_BLOCK_SIZE)
+    {
+      int n = min(VMATH_BLOCK_SIZE, end - block);
+
+      vmath_log(this->tal + block, values, n);
+      for (int j = 0; j < n; j++)
+        values[j] = -values[j];
+      vmath_pow(values, 0.09f, values, n);
+
+      for (int j = 0; j < n; j++)
+        this->ea_emissivity[block + j] = 0.85f * values[j];
+    }
+    return;
+  }
+
+  for (int i = start; i < end; i++)
+    this->ea_emissivity[i] = K(0.85) * pow((-1 * log(C(this->tal[i]))), K(0.09));
+}
+
+template <typename Policy>
+void Products::surface_temperature_kernel(MTL mtl, int start, int end)
+{
+  typedef typename Policy::compute C;
+
+  C k1, k2;
+  switch (mtl.number_sensor)
+  {
+  case 5:
+    k1 = 607.76;
+    k2 = 1260.56;
+    break;
+
+  case 7:
+    k1 = 666.09;
+    k2 = 1282.71;
+    break;
+
+  case 8:
+    k1 = 774.8853;
+    k2 = 1321.0789;
+    break;
+
+  default:
+    scene_problem("Sensor problem! - Unknown sensor " + std::to_string(mtl.number_sensor), 6);
+  }
+
+  if (vmath_tier() == VMATH_FAST && is_same<C, float>::value)
+  {
+    float logs[VMATH_BLOCK_SIZE];
+    for (int block = start; block < end; block += VMATH_BLOCK_SIZE)
+    {
+      int n = min(VMATH_BLOCK_SIZE, end - block);
+
+      for (int j = 0; j < n; j++)
+        logs[j] = (this->enb_emissivity[block + j] * k1 / this->radiance_termal[block + j]) + 1;
+      vmath_log(logs, logs, n);
+
+      for (int j = 0; j < n; j++)
+      {
+        float surface_temperature_value = k2 / logs[j];
+        this->surface_temperature[block + j] = surface_temperature_value < 0 ? 0 : surface_temperature_value;
+      }
+    }
+    return;
+  }
+
+  C surface_temperature_value;
+  for (int i = start; i < end; i++)
+  {
+    surface_temperature_value = k2 / (log((C(this->enb_emissivity[i]) * k1 / C(this->radiance_termal[i])) + 1));
+
+    if (surface_temperature_value < 0)
+      surface_temperature_value = 0;
+
+    this->surface_temperature[i] = surface_temperature_value;
+  }
+}
+
+template <typename Policy>
+void Products::short_wave_radiation_kernel(MTL mtl, int start, int end)
+{
+  typedef typename Policy::compute C;
+
+  C costheta = sin(C(mtl.sun_elevation) * C(acos(-1.0)) / 180);
+  C distance = mtl.distance_earth_sun;
+
+  for (int i = start; i < end; i++)
+    this->short_wave_radiation[i] = (1367 * costheta * C(this->tal[i])) / (distance * distance);
+}
+
+template <typename Policy>
+void Products::large_wave_radiation_surface_kernel(int start, int end)
+{
+  typedef typename Policy::compute C;
+  typedef typename Policy::constant K;
+
+  for (int i = start; i < end; i++)
+  {
+    C temperature_pixel = this->surface_temperature[i];
+    C surface_temperature_pow_4 = temperature_pixel * temperature_pixel * temperature_pixel * temperature_pixel;
+    this->large_wave_radiation_surface[i] = C(this->eo_emissivity[i]) * K(5.67) * K(1e-8) * surface_temperature_pow_4;
+  }
+}
+
+template <typename Policy>
+void Products::large_wave_radiation_atmosphere_kernel(float temperature, int start, int end)
+{
+  typedef typename Policy::compute C;
+  typedef typename Policy::constant K;
+
+  C temperature_kelvin = C(temperature) + K(273.15);
+  C temperature_kelvin_pow_4 = temperature_kelvin * temperature_kelvin * temperature_kelvin * temperature_kelvin;
+
+  for (int i = start; i < end; i++)
+    this->large_wave_radiation_atmosphere[i] = C(this->ea_emissivity[i]) * K(5.67) * K(1e-8) * temperature_kelvin_pow_4;
+}
+
+template <typename Policy>
+void Products::net_radiation_kernel(int start, int end)
+{
+  typedef typename Policy::accumulate A;
+
+  for (int i = start; i < end; i++)
+  {
+    A short_wave = this->short_wave_radiation[i];
+    A atmosphere = this->large_wave_radiation_atmosphere[i];
+    A net_radiation_value = short_wave - (short_wave * A(this->albedo[i])) + atmosphere - A(this->large_wave_radiation_surface[i]) -
+                            (1 - A(this->eo_emissivity[i])) * atmosphere;
+
+    if (net_radiation_value < 0)
+      net_radiation_value = 0;
+
+    this->net_radiation[i] = net_radiation_value;
+  }
+}
+
+template <typename Policy>
+void Products::soil_heat_flux_kernel(int start, int end)
+{
+  typedef typename Policy::compute C;
+  typedef typename Policy::constant K;
+
+  for (int i = start; i < end; i++)
+  {
+    C ndvi_pixel = this->ndvi[i];
+    C soil_heat_value;
+
+    if ((ndvi_pixel < 0) || ndvi_pixel > 0)
+    {
+      C ndvi_pixel_pow_4 = ndvi_pixel * ndvi_pixel * ndvi_pixel * ndvi_pixel;
+      soil_heat_value = (C(this->surface_temperature[i]) - K(273.15)) * (K(0.0038) + K(0.0074) * C(this->albedo[i])) *
+                        (1 - K(0.98) * ndvi_pixel_pow_4) * C(this->net_radiation[i]);
+    }
+    else
+      soil_heat_value = K(0.5) * C(this->net_radiation[i]);
+
+    if (soil_heat_value < 0)
+      soil_heat_value = 0;
+
+    this->soil_heat[i] = soil_heat_value;
+  }
+}
+
+string Products::radiance_function(MTL mtl)
+{
   system_clock::time_point begin, end;
   int64_t general_time, initial_time, final_time;
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
 
-  for (int i = 0; i < this->height_band * this->width_band; i++)
-  {
-    this->radiance_blue[i] = this->band_blue[i] * mtl.rad_mult[PARAM_BAND_BLUE_INDEX] + mtl.rad_add[PARAM_BAND_BLUE_INDEX];
-    this->radiance_green[i] = this->band_green[i] * mtl.rad_mult[PARAM_BAND_GREEN_INDEX] + mtl.rad_add[PARAM_BAND_GREEN_INDEX];
-    this->radiance_red[i] = this->band_red[i] * mtl.rad_mult[PARAM_BAND_RED_INDEX] + mtl.rad_add[PARAM_BAND_RED_INDEX];
-    this->radiance_nir[i] = this->band_nir[i] * mtl.rad_mult[PARAM_BAND_NIR_INDEX] + mtl.rad_add[PARAM_BAND_NIR_INDEX];
-    this->radiance_swir1[i] = this->band_swir1[i] * mtl.rad_mult[PARAM_BAND_SWIR1_INDEX] + mtl.rad_add[PARAM_BAND_SWIR1_INDEX];
-    this->radiance_termal[i] = this->band_termal[i] * mtl.rad_mult[PARAM_BAND_TERMAL_INDEX] + mtl.rad_add[PARAM_BAND_TERMAL_INDEX];
-    this->radiance_swir2[i] = this->band_swir2[i] * mtl.rad_mult[PARAM_BAND_SWIR2_INDEX] + mtl.rad_add[PARAM_BAND_SWIR2_INDEX];
-
-    if (radiance_blue[i] <= 0)
-      this->radiance_blue[i] = NAN;
-    if (radiance_green[i] <= 0)
-      this->radiance_green[i] = NAN;
-    if (radiance_red[i] <= 0)
-      this->radiance_red[i] = NAN;
-    if (radiance_nir[i] <= 0)
-      this->radiance_nir[i] = NAN;
-    if (radiance_swir1[i] <= 0)
-      this->radiance_swir1[i] = NAN;
-    if (radiance_termal[i] <= 0)
-      this->radiance_termal[i] = NAN;
-    if (radiance_swir2[i] <= 0)
-      this->radiance_swir2[i] = NAN;
-  }
+  int stage = this->graph.find("RADIANCE");
+  precision_dispatch([&](auto policy) {
+    parallel_kernel([&](int start, int end) {
+      packed_kernel(stage, start, end, [&](Products &view, int first, int last) { view.radiance_kernel<decltype(policy)>(mtl, first, last); });
+    });
+  });
 
   end = system_clock::now();
   general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-  return "SERIAL,RADIANCE," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  record_stage("RADIANCE", general_time, metrics_since(sample), initial_time, final_time, processed_pixels(), false);
+  return backend() + ",RADIANCE," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
 }
 
 string Products::reflectance_function(MTL mtl)
 {
-  // https://www.usgs.gov/landsat-missions/using-usgs-landsat-level-1-data-product
-  const float sin_sun = sin(mtl.sun_elevation * PI / 180);
-
   system_clock::time_point begin, end;
   int64_t general_time, initial_time, final_time;
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-
-  for (int i = 0; i < this->height_band * this->width_band; i++)
-  {
-    this->reflectance_blue[i] = (this->band_blue[i] * mtl.ref_mult[PARAM_BAND_BLUE_INDEX] + mtl.ref_add[PARAM_BAND_BLUE_INDEX]) / sin_sun;
-    this->reflectance_green[i] = (this->band_green[i] * mtl.ref_mult[PARAM_BAND_GREEN_INDEX] + mtl.ref_add[PARAM_BAND_GREEN_INDEX]) / sin_sun;
-    this->reflectance_red[i] = (this->band_red[i] * mtl.ref_mult[PARAM_BAND_RED_INDEX] + mtl.ref_add[PARAM_BAND_RED_INDEX]) / sin_sun;
-    this->reflectance_nir[i] = (this->band_nir[i] * mtl.ref_mult[PARAM_BAND_NIR_INDEX] + mtl.ref_add[PARAM_BAND_NIR_INDEX]) / sin_sun;
-    this->reflectance_swir1[i] = (this->band_swir1[i] * mtl.ref_mult[PARAM_BAND_SWIR1_INDEX] + mtl.ref_add[PARAM_BAND_SWIR1_INDEX]) / sin_sun;
-    this->reflectance_termal[i] = (this->band_termal[i] * mtl.ref_mult[PARAM_BAND_TERMAL_INDEX] + mtl.ref_add[PARAM_BAND_TERMAL_INDEX]) / sin_sun;
-    this->reflectance_swir2[i] = (this->band_swir2[i] * mtl.ref_mult[PARAM_BAND_SWIR2_INDEX] + mtl.ref_add[PARAM_BAND_SWIR2_INDEX]) / sin_sun;
-
-    if (reflectance_blue[i] <= 0)
-      this->reflectance_blue[i] = NAN;
-    if (reflectance_green[i] <= 0)
-      this->reflectance_green[i] = NAN;
-    if (reflectance_red[i] <= 0)
-      this->reflectance_red[i] = NAN;
-    if (reflectance_nir[i] <= 0)
-      this->reflectance_nir[i] = NAN;
-    if (reflectance_swir1[i] <= 0)
-      this->reflectance_swir1[i] = NAN;
-    if (reflectance_termal[i] <= 0)
-      this->reflectance_termal[i] = NAN;
-    if (reflectance_swir2[i] <= 0)
-      this->reflectance_swir2[i] = NAN;
-  }
+  MetricsSample sample = metrics_sample();
+
+  int stage = this->graph.find("REFLECTANCE");
+  precision_dispatch([&](auto policy) {
+    parallel_kernel([&](int start, int end) {
+      packed_kernel(stage, start, end, [&](Products &view, int first, int last) { view.reflectance_kernel<decltype(policy)>(mtl, first, last); });
+    });
+  });
+
+  // Both calibrations are done, the words they left without a value are skipped from now on
+  int64_t pixels = processed_pixels();
+  int words = mask_words(this->height_band * this->width_band);
+  if (this->pool == NULL)
+    refresh_valid_mask(0, words);
+  else
+    this->pool->parallel_for(0, words, max(PARALLEL_BLOCK_ROWS * (int)this->width_band / 64, 1), [&](int first, int last) { refresh_valid_mask(first, last); });
 
   end = system_clock::now();
   general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-  return "SERIAL,REFLECTANCE," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  record_stage("REFLECTANCE", general_time, metrics_since(sample), initial_time, final_time, pixels, false);
+  return backend() + ",REFLECTANCE," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
 }
 
 string Products::albedo_function(MTL mtl)
@@ -187,27 +920,20 @@ string Products::albedo_function(MTL mtl)
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
 
-  // https://doi.org/10.1016/j.rse.2017.10.031
-  for (int i = 0; i < this->height_band * this->width_band; i++)
-  {
-    float alb = this->reflectance_blue[i] * mtl.ref_w_coeff[PARAM_BAND_BLUE_INDEX] +
-                this->reflectance_green[i] * mtl.ref_w_coeff[PARAM_BAND_GREEN_INDEX] +
-                this->reflectance_red[i] * mtl.ref_w_coeff[PARAM_BAND_RED_INDEX] +
-                this->reflectance_nir[i] * mtl.ref_w_coeff[PARAM_BAND_NIR_INDEX] +
-                this->reflectance_swir1[i] * mtl.ref_w_coeff[PARAM_BAND_SWIR1_INDEX] +
-                this->reflectance_swir2[i] * mtl.ref_w_coeff[PARAM_BAND_SWIR2_INDEX];
-
-    this->albedo[i] = (alb - 0.03) / (this->tal[i] * this->tal[i]);
-
-    if (albedo[i] <= 0)
-      this->albedo[i] = NAN;
-  }
+  int stage = this->graph.find("ALBEDO");
+  precision_dispatch([&](auto policy) {
+    parallel_kernel([&](int start, int end) {
+      packed_kernel(stage, start, end, [&](Products &view, int first, int last) { view.albedo_kernel<decltype(policy)>(mtl, first, last); });
+    });
+  });
 
   end = system_clock::now();
   general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-  return "SERIAL,ALBEDO," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  record_stage("ALBEDO", general_time, metrics_since(sample), initial_time, final_time, processed_pixels(), false);
+  return backend() + ",ALBEDO," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
 }
 
 string Products::ndvi_function()
@@ -217,19 +943,20 @@ string Products::ndvi_function()
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
 
-  for (int i = 0; i < this->height_band * this->width_band; i++)
-  {
-    this->ndvi[i] = (this->reflectance_nir[i] - this->reflectance_red[i]) / (this->reflectance_nir[i] + this->reflectance_red[i]);
-
-    if (ndvi[i] <= -1 || ndvi[i] >= 1)
-      ndvi[i] = NAN;
-  }
+  int stage = this->graph.find("NDVI");
+  precision_dispatch([&](auto policy) {
+    parallel_kernel([&](int start, int end) {
+      packed_kernel(stage, start, end, [&](Products &view, int first, int last) { view.ndvi_kernel<decltype(policy)>(first, last); });
+    });
+  });
 
   end = system_clock::now();
   general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-  return "SERIAL,NDVI," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  record_stage("NDVI", general_time, metrics_since(sample), initial_time, final_time, processed_pixels(), false);
+  return backend() + ",NDVI," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
 };
 
 string Products::pai_function()
@@ -239,21 +966,20 @@ string Products::pai_function()
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
 
-  for (int i = 0; i < this->height_band * this->width_band; i++)
-  {
-    float pai_value = 10.1 * (this->reflectance_nir[i] - sqrt(this->reflectance_red[i])) + 3.1;
-
-    if (pai_value < 0)
-      pai_value = 0;
-
-    this->pai[i] = pai_value;
-  }
+  int stage = this->graph.find("PAI");
+  precision_dispatch([&](auto policy) {
+    parallel_kernel([&](int start, int end) {
+      packed_kernel(stage, start, end, [&](Products &view, int first, int last) { view.pai_kernel<decltype(policy)>(first, last); });
+    });
+  });
 
   end = system_clock::now();
   general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-  return "SERIAL,PAI," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  record_stage("PAI", general_time, metrics_since(sample), initial_time, final_time, processed_pixels(), false);
+  return backend() + ",PAI," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
 };
 
 string Products::lai_function()
@@ -263,27 +989,20 @@ string Products::lai_function()
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
 
-  for (int i = 0; i < this->height_band * this->width_band; i++)
-  {
-    float savi = ((1 + 0.5) * (this->reflectance_nir[i] - this->reflectance_red[i])) / (0.5 + (this->reflectance_nir[i] + this->reflectance_red[i]));
-    this->savi[i] = savi;
-
-    if (!isnan(savi) && savi > 0.687)
-      this->lai[i] = 6;
-    if (!isnan(savi) && savi <= 0.687)
-      this->lai[i] = -log((0.69 - savi) / 0.59) / 0.91;
-    if (!isnan(savi) && savi < 0.1)
-      this->lai[i] = 0;
-
-    if (lai[i] < 0)
-      lai[i] = 0;
-  }
+  int stage = this->graph.find("LAI");
+  precision_dispatch([&](auto policy) {
+    parallel_kernel([&](int start, int end) {
+      packed_kernel(stage, start, end, [&](Products &view, int first, int last) { view.lai_kernel<decltype(policy)>(first, last); });
+    });
+  });
 
   end = system_clock::now();
   general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-  return "SERIAL,LAI," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  record_stage("LAI", general_time, metrics_since(sample), initial_time, final_time, processed_pixels(), false);
+  return backend() + ",LAI," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
 };
 
 string Products::evi_function()
@@ -293,21 +1012,20 @@ string Products::evi_function()
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
 
-  for (int i = 0; i < this->height_band * this->width_band; i++)
-  {
-    float evi_value = 2.5 * ((this->reflectance_nir[i] - this->reflectance_red[i]) / (this->reflectance_nir[i] + (6 * this->reflectance_red[i]) - (7.5 * this->reflectance_blue[i]) + 1));
-
-    if (evi_value < 0)
-      evi_value = 0;
-
-    this->evi[i] = evi_value;
-  }
+  int stage = this->graph.find("EVI");
+  precision_dispatch([&](auto policy) {
+    parallel_kernel([&](int start, int end) {
+      packed_kernel(stage, start, end, [&](Products &view, int first, int last) { view.evi_kernel<decltype(policy)>(first, last); });
+    });
+  });
 
   end = system_clock::now();
   general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-  return "SERIAL,EVI," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  record_stage("EVI", general_time, metrics_since(sample), initial_time, final_time, processed_pixels(), false);
+  return backend() + ",EVI," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
 };
 
 string Products::enb_emissivity_function()
@@ -317,22 +1035,20 @@ string Products::enb_emissivity_function()
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
 
-  for (int i = 0; i < this->height_band * this->width_band; i++)
-  {
-    if (this->lai[i] == 0)
-      this->enb_emissivity[i] = NAN;
-    else
-      this->enb_emissivity[i] = 0.97 + 0.0033 * this->lai[i];
-
-    if ((ndvi[i] < 0) || (lai[i] > 2.99))
-      this->enb_emissivity[i] = 0.98;
-  }
+  int stage = this->graph.find("ENB_EMISSIVITY");
+  precision_dispatch([&](auto policy) {
+    parallel_kernel([&](int start, int end) {
+      packed_kernel(stage, start, end, [&](Products &view, int first, int last) { view.enb_emissivity_kernel<decltype(policy)>(first, last); });
+    });
+  });
 
   end = system_clock::now();
   general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-  return "SERIAL,ENB_EMISSIVITY," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  record_stage("ENB_EMISSIVITY", general_time, metrics_since(sample), initial_time, final_time, processed_pixels(), false);
+  return backend() + ",ENB_EMISSIVITY," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
 };
 
 string Products::eo_emissivity_function()
@@ -342,23 +1058,20 @@ string Products::eo_emissivity_function()
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
 
-  for (int i = 0; i < this->height_band * this->width_band; i++)
-  {
-
-    if (this->lai[i] == 0)
-      this->eo_emissivity[i] = NAN;
-    else
-      this->eo_emissivity[i] = 0.95 + 0.01 * this->lai[i];
-
-    if ((this->ndvi[i] < 0) || (this->lai[i] > 2.99))
-      this->eo_emissivity[i] = 0.98;
-  }
+  int stage = this->graph.find("EO_EMISSIVITY");
+  precision_dispatch([&](auto policy) {
+    parallel_kernel([&](int start, int end) {
+      packed_kernel(stage, start, end, [&](Products &view, int first, int last) { view.eo_emissivity_kernel<decltype(policy)>(first, last); });
+    });
+  });
 
   end = system_clock::now();
   general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-  return "SERIAL,EO_EMISSIVITY," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  record_stage("EO_EMISSIVITY", general_time, metrics_since(sample), initial_time, final_time, processed_pixels(), false);
+  return backend() + ",EO_EMISSIVITY," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
 };
 
 string Products::ea_emissivity_function()
@@ -368,81 +1081,66 @@ string Products::ea_emissivity_function()
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
 
-  for (int i = 0; i < this->height_band * this->width_band; i++)
-    this->ea_emissivity[i] = 0.85 * pow((-1 * log(this->tal[i])), 0.09);
+  int stage = this->graph.find("EA_EMISSIVITY");
+  precision_dispatch([&](auto policy) {
+    parallel_kernel([&](int start, int end) {
+      packed_kernel(stage, start, end, [&](Products &view, int first, int last) { view.ea_emissivity_kernel<decltype(policy)>(first, last); });
+    });
+  });
 
   end = system_clock::now();
   general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-  return "SERIAL,EA_EMISSIVITY," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  record_stage("EA_EMISSIVITY", general_time, metrics_since(sample), initial_time, final_time, processed_pixels(), false);
+  return backend() + ",EA_EMISSIVITY," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
 };
 
 string Products::surface_temperature_function(MTL mtl)
 {
-  float k1, k2;
-  switch (mtl.number_sensor)
-  {
-  case 5:
-    k1 = 607.76;
-    k2 = 1260.56;
-    break;
-
-  case 7:
-    k1 = 666.09;
-    k2 = 1282.71;
-    break;
-
-  case 8:
-    k1 = 774.8853;
-    k2 = 1321.0789;
-    break;
-
-  default:
-    cerr << "Sensor problem!";
-    exit(6);
-  }
-
   system_clock::time_point begin, end;
   int64_t general_time, initial_time, final_time;
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
 
-  float surface_temperature_value;
-  for (int i = 0; i < this->height_band * this->width_band; i++)
-  {
-    surface_temperature_value = k2 / (log((this->enb_emissivity[i] * k1 / this->radiance_termal[i]) + 1));
-
-    if (surface_temperature_value < 0)
-      surface_temperature_value = 0;
-
-    this->surface_temperature[i] = surface_temperature_value;
-  }
+  int stage = this->graph.find("SURFACE_TEMPERATURE");
+  precision_dispatch([&](auto policy) {
+    parallel_kernel([&](int start, int end) {
+      packed_kernel(stage, start, end, [&](Products &view, int first, int last) { view.surface_temperature_kernel<decltype(policy)>(mtl, first, last); });
+    });
+  });
 
   end = system_clock::now();
   general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-  return "SERIAL,SURFACE_TEMPERATURE," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  record_stage("SURFACE_TEMPERATURE", general_time, metrics_since(sample), initial_time, final_time, processed_pixels(), false);
+  return backend() + ",SURFACE_TEMPERATURE," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
 };
 
 string Products::short_wave_radiation_function(MTL mtl)
 {
-  float costheta = sin(mtl.sun_elevation * PI / 180);
-
   system_clock::time_point begin, end;
   int64_t general_time, initial_time, final_time;
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
 
-  for (int i = 0; i < this->height_band * this->width_band; i++)
-    this->short_wave_radiation[i] = (1367 * costheta * this->tal[i]) / (mtl.distance_earth_sun * mtl.distance_earth_sun);
+  int stage = this->graph.find("SHORT_WAVE_RADIATION");
+  precision_dispatch([&](auto policy) {
+    parallel_kernel([&](int start, int end) {
+      packed_kernel(stage, start, end, [&](Products &view, int first, int last) { view.short_wave_radiation_kernel<decltype(policy)>(mtl, first, last); });
+    });
+  });
 
   end = system_clock::now();
   general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-  return "SERIAL,SHORT_WAVE_RADIATION," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  record_stage("SHORT_WAVE_RADIATION", general_time, metrics_since(sample), initial_time, final_time, processed_pixels(), false);
+  return backend() + ",SHORT_WAVE_RADIATION," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
 };
 
 string Products::large_wave_radiation_surface_function()
@@ -452,18 +1150,20 @@ string Products::large_wave_radiation_surface_function()
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
 
-  for (int i = 0; i < this->height_band * this->width_band; i++)
-  {
-    float temperature_pixel = this->surface_temperature[i];
-    float surface_temperature_pow_4 = temperature_pixel * temperature_pixel * temperature_pixel * temperature_pixel;
-    this->large_wave_radiation_surface[i] = this->eo_emissivity[i] * 5.67 * 1e-8 * surface_temperature_pow_4;
-  }
+  int stage = this->graph.find("LARGE_WAVE_RADIATION_SURFACE");
+  precision_dispatch([&](auto policy) {
+    parallel_kernel([&](int start, int end) {
+      packed_kernel(stage, start, end, [&](Products &view, int first, int last) { view.large_wave_radiation_surface_kernel<decltype(policy)>(first, last); });
+    });
+  });
 
   end = system_clock::now();
   general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-  return "SERIAL,LARGE_WAVE_RADIATION_SURFACE," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  record_stage("LARGE_WAVE_RADIATION_SURFACE", general_time, metrics_since(sample), initial_time, final_time, processed_pixels(), false);
+  return backend() + ",LARGE_WAVE_RADIATION_SURFACE," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
 };
 
 string Products::large_wave_radiation_atmosphere_function(float temperature)
@@ -473,17 +1173,20 @@ string Products::large_wave_radiation_atmosphere_function(float temperature)
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
 
-  float temperature_kelvin = temperature + 273.15;
-  float temperature_kelvin_pow_4 = temperature_kelvin * temperature_kelvin * temperature_kelvin * temperature_kelvin;
-
-  for (int i = 0; i < this->height_band * this->width_band; i++)
-    this->large_wave_radiation_atmosphere[i] = this->ea_emissivity[i] * 5.67 * 1e-8 * temperature_kelvin_pow_4;
+  int stage = this->graph.find("LARGE_WAVE_RADIATION_ATMOSPHERE");
+  precision_dispatch([&](auto policy) {
+    parallel_kernel([&](int start, int end) {
+      packed_kernel(stage, start, end, [&](Products &view, int first, int last) { view.large_wave_radiation_atmosphere_kernel<decltype(policy)>(temperature, first, last); });
+    });
+  });
 
   end = system_clock::now();
   general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-  return "SERIAL,LARGE_WAVE_RADIATION_ATMOSPHERE," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  record_stage("LARGE_WAVE_RADIATION_ATMOSPHERE", general_time, metrics_since(sample), initial_time, final_time, processed_pixels(), false);
+  return backend() + ",LARGE_WAVE_RADIATION_ATMOSPHERE," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
 };
 
 string Products::net_radiation_function()
@@ -493,22 +1196,20 @@ string Products::net_radiation_function()
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
 
-  for (int i = 0; i < this->height_band * this->width_band; i++)
-  {
-    this->net_radiation[i] = this->short_wave_radiation[i] -
-                             (this->short_wave_radiation[i] * this->albedo[i]) +
-                             this->large_wave_radiation_atmosphere[i] - this->large_wave_radiation_surface[i] -
-                             (1 - this->eo_emissivity[i]) * this->large_wave_radiation_atmosphere[i];
-
-    if (this->net_radiation[i] < 0)
-      this->net_radiation[i] = 0;
-  }
+  int stage = this->graph.find("NET_RADIATION");
+  precision_dispatch([&](auto policy) {
+    parallel_kernel([&](int start, int end) {
+      packed_kernel(stage, start, end, [&](Products &view, int first, int last) { view.net_radiation_kernel<decltype(policy)>(first, last); });
+    });
+  });
 
   end = system_clock::now();
   general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-  return "SERIAL,NET_RADIATION," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+  record_stage("NET_RADIATION", general_time, metrics_since(sample), initial_time, final_time, processed_pixels(), false);
+  return backend() + ",NET_RADIATION," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
 };
 
 string Products::soil_heat_flux_function()
@@ -518,24 +1219,117 @@ string Products::soil_heat_flux_function()
 
   begin = system_clock::now();
   initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
 
-  for (int i = 0; i < this->height_band * this->width_band; i++)
-  {
-    if ((this->ndvi[i] < 0) || this->ndvi[i] > 0)
+  int stage = this->graph.find("SOIL_HEAT_FLUX");
+  precision_dispatch([&](auto policy) {
+    parallel_kernel([&](int start, int end) {
+      packed_kernel(stage, start, end, [&](Products &view, int first, int last) { view.soil_heat_flux_kernel<decltype(policy)>(first, last); });
+    });
+  });
+
+  end = system_clock::now();
+  general_time = duration_cast<nanoseconds>(end - begin).count();
+  final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  record_stage("SOIL_HEAT_FLUX", general_time, metrics_since(sample), initial_time, final_time, processed_pixels(), false);
+  return backend() + ",SOIL_HEAT_FLUX," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+};
+
+void Products::rn_g_fused_kernel(MTL mtl, float temperature, int stages_count, int start, int end, int64_t *stage_time)
+{
+  // Each block runs the whole chain while its planes are still resident in cache, with the policy chosen once.
+  precision_dispatch([&](auto policy) {
+    typedef decltype(policy) Policy;
+
+    function<void(Products &, int, int)> stages[RN_G_STAGES] = {
+        [&](Products &view, int first, int last) { view.radiance_kernel<Policy>(mtl, first, last); },
+        [&](Products &view, int first, int last) { view.reflectance_kernel<Policy>(mtl, first, last); },
+        [&](Products &view, int first, int last) { view.albedo_kernel<Policy>(mtl, first, last); },
+        [&](Products &view, int first, int last) { view.ndvi_kernel<Policy>(first, last); },
+        [&](Products &view, int first, int last) { view.pai_kernel<Policy>(first, last); },
+        [&](Products &view, int first, int last) { view.lai_kernel<Policy>(first, last); },
+        [&](Products &view, int first, int last) { view.evi_kernel<Policy>(first, last); },
+        [&](Products &view, int first, int last) { view.enb_emissivity_kernel<Policy>(first, last); },
+        [&](Products &view, int first, int last) { view.eo_emissivity_kernel<Policy>(first, last); },
+        [&](Products &view, int first, int last) { view.ea_emissivity_kernel<Policy>(first, last); },
+        [&](Products &view, int first, int last) { view.surface_temperature_kernel<Policy>(mtl, first, last); },
+        [&](Products &view, int first, int last) { view.short_wave_radiation_kernel<Policy>(mtl, first, last); },
+        [&](Products &view, int first, int last) { view.large_wave_radiation_surface_kernel<Policy>(first, last); },
+        [&](Products &view, int first, int last) { view.large_wave_radiation_atmosphere_kernel<Policy>(temperature, first, last); },
+        [&](Products &view, int first, int last) { view.net_radiation_kernel<Policy>(first, last); },
+        [&](Products &view, int first, int last) { view.soil_heat_flux_kernel<Policy>(first, last); }};
+
+    // Once a block is calibrated, its later stages skip the words the calibration left without a value. Only the
+    // words inside the block are refreshed, those shared with the neighbour ranges of other threads stay as they are
+    int reflectance = rn_g_graph().find("REFLECTANCE");
+    int size = this->height_band * this->width_band;
+
+    for (int block = start; block < end; block += FUSED_BLOCK_SIZE)
     {
-      float ndvi_pixel_pow_4 = this->ndvi[i] * this->ndvi[i] * this->ndvi[i] * this->ndvi[i];
-      this->soil_heat[i] = (this->surface_temperature[i] - 273.15) * (0.0038 + 0.0074 * this->albedo[i]) *
-                           (1 - 0.98 * ndvi_pixel_pow_4) * this->net_radiation[i];
+      int block_end = min(block + FUSED_BLOCK_SIZE, end);
+
+      for (int s = 0; s < stages_count; s++)
+      {
+        if (!this->graph.runs(s))
+          continue;
+
+        system_clock::time_point stage_begin = system_clock::now();
+        if (s <= reflectance)
+          packed_kernel(s, block, block_end, stages[s]);
+        else
+          valid_runs(this->valid_mask, block, block_end, [&](int first, int last) { packed_kernel(s, first, last, stages[s]); });
+        if (s == reflectance)
+          refresh_valid_mask((block + 63) / 64, block_end == size ? mask_words(size) : block_end / 64);
+        stage_time[s] += duration_cast<nanoseconds>(system_clock::now() - stage_begin).count();
+      }
     }
-    else
-      this->soil_heat[i] = 0.5 * this->net_radiation[i];
+  });
+}
+
+string Products::rn_g_stage_timing(int64_t *stage_time, int stages_count, int64_t initial_time, int64_t final_time, int64_t calibrated_pixels, int64_t pixels)
+{
+  vector<StageNode> stages = rn_g_graph().stages;
+  int reflectance = rn_g_graph().find("REFLECTANCE");
+
+  // Stage times are summed over all blocks (and threads), so they remain comparable with the staged execution.
+  // The CPU time of a stage is its summed time, as every thread runs the stages back to back. The counters cannot
+  // be split among the stages of a block, they are only recorded for the whole sweep.
+  string result = "";
+  for (int s = 0; s < stages_count; s++)
+  {
+    if (!this->graph.runs(s))
+      continue;
 
-    if (this->soil_heat[i] < 0)
-      this->soil_heat[i] = 0;
+    result += backend() + "," + stages[s].name + "," + std::to_string(stage_time[s]) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+    record_stage(stages[s].name, stage_time[s], MetricsSample(stage_time[s]), initial_time, final_time, s <= reflectance ? calibrated_pixels : pixels, true);
   }
+  return result;
+}
+
+void Products::rn_g_fused_sweep(MTL mtl, float temperature, int stages_count, int64_t *stage_time)
+{
+  mutex time_lock;
+
+  parallel_kernel([&](int start, int end) {
+    int64_t chunk_time[RN_G_STAGES] = {0};
+    rn_g_fused_kernel(mtl, temperature, stages_count, start, end, chunk_time);
+
+    unique_lock<mutex> guard(time_lock);
+    for (int s = 0; s < RN_G_STAGES; s++)
+      stage_time[s] += chunk_time[s];
+  });
+}
+
+string Products::rn_g_fused_function(MTL mtl, float temperature)
+{
+  int64_t stage_time[RN_G_STAGES] = {0};
+  int64_t initial_time, final_time;
+
+  initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  int64_t calibrated_pixels = processed_pixels();
+
+  rn_g_fused_sweep(mtl, temperature, RN_G_STAGES, stage_time);
 
-  end = system_clock::now();
-  general_time = duration_cast<nanoseconds>(end - begin).count();
   final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
-  return "SERIAL,SOIL_HEAT_FLUX," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
-};
+  return rn_g_stage_timing(stage_time, RN_G_STAGES, initial_time, final_time, calibrated_pixels, processed_pixels());
+}
@@ -0,0 +1,94 @@
+#include "pyramid.h"
+
+Pyramid::Pyramid()
+{
+  this->factor = 0;
+  this->width_band = this->height_band = 0;
+  this->width = this->height = 0;
+}
+
+Pyramid::Pyramid(int width_band, int height_band, int factor)
+{
+  this->factor = factor;
+  this->width_band = width_band;
+  this->height_band = height_band;
+  this->width = (width_band + factor - 1) / factor;
+  this->height = (height_band + factor - 1) / factor;
+
+  int cells = this->width * this->height;
+  this->sums.assign(3 * cells, 0);
+  this->counts.assign(3 * cells, 0);
+}
+
+void Pyramid::accumulate(float *ndvi, float *surface_temperature, float *albedo, int first_line, int lines, ThreadPool *pool)
+{
+  float *planes[3] = {ndvi, surface_temperature, albedo};
+  int cells = this->width * this->height;
+  int first_row = first_line / this->factor;
+  int last_row = (first_line + lines - 1) / this->factor;
+
+  // Each cell row is summed by a single thread, in line order
+  auto rows = [&](int start, int end)
+  {
+    for (int row = start; row < end; row++)
+    {
+      int line_begin = max(row * this->factor, first_line);
+      int line_end = min((row + 1) * this->factor, first_line + lines);
+      for (int line = line_begin; line < line_end; line++)
+      {
+        for (int p = 0; p < 3; p++)
+        {
+          const float *src = planes[p] + (line - first_line) * this->width_band;
+          double *sums = this->sums.data() + p * cells + row * this->width;
+          int *counts = this->counts.data() + p * cells + row * this->width;
+          for (int cell = 0; cell < this->width; cell++)
+          {
+            double sum = 0;
+            int count = 0;
+            for (int col = cell * this->factor; col < min((cell + 1) * this->factor, this->width_band); col++)
+            {
+              if (isfinite(src[col]))
+              {
+                sum += src[col];
+                count++;
+              }
+            }
+            sums[cell] += sum;
+            counts[cell] += count;
+          }
+        }
+      }
+    }
+  };
+
+  if (pool == NULL)
+    rows(first_row, last_row + 1);
+  else
+    pool->parallel_for(first_row, last_row + 1, 1, rows);
+}
+
+void Pyramid::finish()
+{
+  int cells = this->width * this->height;
+  vector<float> *planes[3] = {&this->ndvi, &this->surface_temperature, &this->albedo};
+
+  for (int p = 0; p < 3; p++)
+  {
+    planes[p]->resize(cells);
+    for (int c = 0; c < cells; c++)
+      (*planes[p])[c] = this->counts[p * cells + c] == 0 ? NAN : this->sums[p * cells + c] / this->counts[p * cells + c];
+  }
+
+  vector<double>().swap(this->sums);
+  vector<int>().swap(this->counts);
+}
+
+void Pyramid::close()
+{
+  vector<float>().swap(this->ndvi);
+  vector<float>().swap(this->surface_temperature);
+  vector<float>().swap(this->albedo);
+  vector<double>().swap(this->sums);
+  vector<int>().swap(this->counts);
+  this->factor = 0;
+}
@@ -0,0 +1,157 @@
+#include "quantiles.h"
+
+#include <cstring>
+
+// Bins of each histogram pass, one per value of 16 key bits
+static const int QUANTILE_BINS = 1 << 16;
+
+// Pixels per chunk of a histogram pass, large enough to amortize the per-chunk histograms
+static const int QUANTILE_CHUNK = 1 << 22;
+
+static int selected_mode = QUANTILE_EXACT;
+
+/**
+ * Maps a float to an unsigned key with the same order, negative values included.
+ */
+static inline uint32_t sortable_key(float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return (bits & 0x80000000) ? ~bits : bits | 0x80000000;
+}
+
+static inline float key_value(uint32_t key)
+{
+  uint32_t bits = (key & 0x80000000) ? key & 0x7fffffff : ~key;
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+/**
+ * Runs body over [0, size) in chunks, each with its own histogram of bins_count counters,
+ * and adds every chunk histogram into histogram.
+ */
+static void histogram_pass(int size, int bins_count, vector<uint64_t> &histogram, ThreadPool *pool,
+                           function<void(int, int, uint64_t *)> body)
+{
+  mutex merge_lock;
+  auto chunk = [&](int start, int end)
+  {
+    vector<uint64_t> local(bins_count, 0);
+    body(start, end, local.data());
+
+    unique_lock<mutex> guard(merge_lock);
+    for (int b = 0; b < bins_count; b++)
+      histogram[b] += local[b];
+  };
+
+  if (pool == NULL)
+    chunk(0, size);
+  else
+    pool->parallel_for(0, size, QUANTILE_CHUNK, chunk);
+}
+
+void quantile_select(int mode)
+{
+  selected_mode = mode;
+}
+
+int quantile_mode()
+{
+  return selected_mode;
+}
+
+void get_quantiles(float **rasters, int rasters_count, int size, const uint64_t *mask, const float *intervals, int intervals_count, float *quantiles, ThreadPool *pool)
+{
+  int targets = rasters_count * intervals_count;
+
+  // First pass: high 16 bits of the keys of every raster
+  vector<uint64_t> high(rasters_count * QUANTILE_BINS, 0);
+  histogram_pass(size, rasters_count * QUANTILE_BINS, high, pool, [&](int start, int end, uint64_t *local)
+  {
+    valid_runs(mask, start, end, [&](int first, int last)
+    {
+      for (int r = 0; r < rasters_count; r++)
+      {
+        const float *raster = rasters[r];
+        uint64_t *bins = local + r * QUANTILE_BINS;
+        for (int i = first; i < last; i++)
+          if (!isnan(raster[i]) && !isinf(raster[i]))
+            bins[sortable_key(raster[i]) >> 16]++;
+      }
+    });
+  });
+
+  // Bin holding each requested rank, and the rank left inside that bin
+  vector<int> target_bin(targets, -1);
+  vector<uint64_t> target_rank(targets, 0);
+  for (int r = 0; r < rasters_count; r++)
+  {
+    const uint64_t *bins = high.data() + r * QUANTILE_BINS;
+
+    int pos = 0;
+    for (int b = 0; b < QUANTILE_BINS; b++)
+      pos += bins[b];
+
+    for (int q = 0; q < intervals_count; q++)
+    {
+      int t = r * intervals_count + q;
+      quantiles[t] = NAN;
+      if (pos == 0)
+        continue;
+
+      uint64_t rank = min(static_cast<int>(floor(intervals[t] * pos)), pos - 1);
+      int b = 0;
+      while (rank >= bins[b])
+        rank -= bins[b++];
+
+      target_bin[t] = b;
+      target_rank[t] = rank;
+      quantiles[t] = key_value(((uint32_t)b << 16) | 0x8000);
+    }
+  }
+
+  if (selected_mode == QUANTILE_APPROX)
+    return;
+
+  // Second pass: low 16 bits of the keys falling into each target bin
+  vector<uint64_t> low(targets * QUANTILE_BINS, 0);
+  histogram_pass(size, targets * QUANTILE_BINS, low, pool, [&](int start, int end, uint64_t *local)
+  {
+    valid_runs(mask, start, end, [&](int first, int last)
+    {
+      for (int r = 0; r < rasters_count; r++)
+      {
+        const float *raster = rasters[r];
+        for (int i = first; i < last; i++)
+        {
+          if (isnan(raster[i]) || isinf(raster[i]))
+            continue;
+
+          uint32_t key = sortable_key(raster[i]);
+          for (int q = 0; q < intervals_count; q++)
+          {
+            int t = r * intervals_count + q;
+            if (target_bin[t] == (int)(key >> 16))
+              local[t * QUANTILE_BINS + (key & 0xffff)]++;
+          }
+        }
+      }
+    });
+  });
+
+  for (int t = 0; t < targets; t++)
+  {
+    if (target_bin[t] < 0)
+      continue;
+
+    const uint64_t *bins = low.data() + t * QUANTILE_BINS;
+    uint64_t rank = target_rank[t];
+    int b = 0;
+    while (rank >= bins[b])
+      rank -= bins[b++];
+
+    quantiles[t] = key_value(((uint32_t)target_bin[t] << 16) | b);
+  }
+}
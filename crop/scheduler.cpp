@@ -0,0 +1,133 @@
+#include "scheduler.h"
+#include "metrics.h"
+#include "counters.h"
+
+ThreadPool::ThreadPool(int threads)
+{
+  if (threads <= 0)
+    threads = max(1, (int)thread::hardware_concurrency());
+
+  this->threads = threads;
+  this->next_chunk = 0;
+  this->job_end = 0;
+  this->job_chunk = 1;
+  this->pending = 0;
+  this->generation = 0;
+  this->stop = false;
+
+  for (int i = 1; i < threads; i++)
+    this->workers.emplace_back(&ThreadPool::worker_loop, this);
+}
+
+void ThreadPool::close()
+{
+  {
+    unique_lock<mutex> guard(this->lock);
+    this->stop = true;
+  }
+  this->wake.notify_all();
+
+  for (int i = 0; i < this->workers.size(); i++)
+    this->workers[i].join();
+  this->workers.clear();
+}
+
+void ThreadPool::parallel_for(int begin, int end, int chunk, function<void(int, int)> body)
+{
+  if (chunk <= 0)
+    chunk = 1;
+
+  if (this->workers.empty() || end - begin <= chunk)
+  {
+    if (begin < end)
+      body(begin, end);
+    return;
+  }
+
+  {
+    unique_lock<mutex> guard(this->lock);
+    this->job = body;
+    this->job_end = end;
+    this->job_chunk = chunk;
+    this->next_chunk = begin;
+    this->pending = this->workers.size();
+    this->generation++;
+  }
+  this->wake.notify_all();
+
+  run_chunks();
+
+  unique_lock<mutex> guard(this->lock);
+  this->done.wait(guard, [&] { return this->pending == 0; });
+  this->job = nullptr;
+
+  exception_ptr error = this->error;
+  this->error = nullptr;
+  guard.unlock();
+  if (error)
+    rethrow_exception(error);
+}
+
+ThreadPool::~ThreadPool()
+{
+  close();
+}
+
+string ThreadPool::backend()
+{
+  return this->threads > 1 ? "PARALLEL" : "SERIAL";
+}
+
+void ThreadPool::worker_loop()
+{
+  uint64_t seen = 0;
+  counters_attach(this);
+
+  while (true)
+  {
+    unique_lock<mutex> guard(this->lock);
+    this->wake.wait(guard, [&] { return this->stop || this->generation != seen; });
+    if (this->stop)
+      return;
+
+    seen = this->generation;
+    guard.unlock();
+
+    run_chunks();
+
+    guard.lock();
+    if (--this->pending == 0)
+      this->done.notify_all();
+  }
+}
+
+void ThreadPool::run_chunks()
+{
+  int64_t initial_time = 0;
+  int chunks = 0;
+
+  while (true)
+  {
+    int start = this->next_chunk.fetch_add(this->job_chunk);
+    if (start >= this->job_end)
+      break;
+
+    if (chunks++ == 0 && metrics_tracing())
+      initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+
+    try
+    {
+      this->job(start, min(start + this->job_chunk, this->job_end));
+    }
+    catch (...)
+    {
+      unique_lock<mutex> guard(this->lock);
+      if (!this->error)
+        this->error = current_exception();
+      this->next_chunk = this->job_end;
+    }
+  }
+
+  if (chunks > 0 && metrics_tracing())
+    metrics_worker(initial_time, duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count(), chunks);
+}
@@ -0,0 +1,523 @@
+#include "simd.h"
+
+#include <immintrin.h>
+
+// The kernels below must round exactly like the scalar ones, so they rely on the build
+// not contracting multiplications and additions into FMA (-ffp-contract=off).
+
+static int selected_isa = SIMD_SCALAR;
+
+// Every CPU with AVX2 has F16C in practice, but the half conversions still check for it
+static bool has_f16c = false;
+
+static void calibrate_scalar(const float *band, float *out, float mult, float add, float divisor, int start, int end)
+{
+  for (int i = start; i < end; i++)
+  {
+    float value = (band[i] * mult + add) / divisor;
+    out[i] = value <= 0 ? NAN : value;
+  }
+}
+
+static void albedo_scalar(const float *const *reflectances, const float *weights, const float *tal, float *out, int start, int end)
+{
+  for (int i = start; i < end; i++)
+  {
+    float alb = reflectances[0][i] * weights[0] +
+                reflectances[1][i] * weights[1] +
+                reflectances[2][i] * weights[2] +
+                reflectances[3][i] * weights[3] +
+                reflectances[4][i] * weights[4] +
+                reflectances[5][i] * weights[5];
+
+    float value = (alb - 0.03) / (tal[i] * tal[i]);
+    out[i] = value <= 0 ? NAN : value;
+  }
+}
+
+__attribute__((target("avx2"))) static void calibrate_avx2(const float *band, float *out, float mult, float add, float divisor, int start, int end)
+{
+  const __m256 v_mult = _mm256_set1_ps(mult);
+  const __m256 v_add = _mm256_set1_ps(add);
+  const __m256 v_divisor = _mm256_set1_ps(divisor);
+  const __m256 v_zero = _mm256_setzero_ps();
+  const __m256 v_nan = _mm256_set1_ps(NAN);
+
+  int i = start;
+  for (; i + 8 <= end; i += 8)
+  {
+    __m256 value = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(band + i), v_mult), v_add), v_divisor);
+    __m256 invalid = _mm256_cmp_ps(value, v_zero, _CMP_LE_OQ);
+    _mm256_storeu_ps(out + i, _mm256_blendv_ps(value, v_nan, invalid));
+  }
+
+  calibrate_scalar(band, out, mult, add, divisor, i, end);
+}
+
+__attribute__((target("avx2"))) static __m128 albedo_correction_avx2(__m128 alb, __m128 tal)
+{
+  const __m256d v_offset = _mm256_set1_pd(0.03);
+
+  __m256d numerator = _mm256_sub_pd(_mm256_cvtps_pd(alb), v_offset);
+  __m256d denominator = _mm256_cvtps_pd(_mm_mul_ps(tal, tal));
+  return _mm256_cvtpd_ps(_mm256_div_pd(numerator, denominator));
+}
+
+__attribute__((target("avx2"))) static void albedo_avx2(const float *const *reflectances, const float *weights, const float *tal, float *out, int start, int end)
+{
+  const __m256 v_zero = _mm256_setzero_ps();
+  const __m256 v_nan = _mm256_set1_ps(NAN);
+  __m256 v_weights[6];
+  for (int b = 0; b < 6; b++)
+    v_weights[b] = _mm256_set1_ps(weights[b]);
+
+  int i = start;
+  for (; i + 8 <= end; i += 8)
+  {
+    __m256 alb = _mm256_mul_ps(_mm256_loadu_ps(reflectances[0] + i), v_weights[0]);
+    for (int b = 1; b < 6; b++)
+      alb = _mm256_add_ps(alb, _mm256_mul_ps(_mm256_loadu_ps(reflectances[b] + i), v_weights[b]));
+
+    __m256 v_tal = _mm256_loadu_ps(tal + i);
+    __m128 low = albedo_correction_avx2(_mm256_castps256_ps128(alb), _mm256_castps256_ps128(v_tal));
+    __m128 high = albedo_correction_avx2(_mm256_extractf128_ps(alb, 1), _mm256_extractf128_ps(v_tal, 1));
+    __m256 value = _mm256_insertf128_ps(_mm256_castps128_ps256(low), high, 1);
+
+    __m256 invalid = _mm256_cmp_ps(value, v_zero, _CMP_LE_OQ);
+    _mm256_storeu_ps(out + i, _mm256_blendv_ps(value, v_nan, invalid));
+  }
+
+  // The tail is a jump to SSE code, which the compiler does not precede with a vzeroupper: without it the dirty upper
+  // state slows every later SSE instruction, libm included, by an order of magnitude
+  _mm256_zeroupper();
+  albedo_scalar(reflectances, weights, tal, out, i, end);
+}
+
+__attribute__((target("avx512f"))) static void calibrate_avx512(const float *band, float *out, float mult, float add, float divisor, int start, int end)
+{
+  const __m512 v_mult = _mm512_set1_ps(mult);
+  const __m512 v_add = _mm512_set1_ps(add);
+  const __m512 v_divisor = _mm512_set1_ps(divisor);
+  const __m512 v_zero = _mm512_setzero_ps();
+  const __m512 v_nan = _mm512_set1_ps(NAN);
+
+  int i = start;
+  for (; i + 16 <= end; i += 16)
+  {
+    __m512 value = _mm512_div_ps(_mm512_add_ps(_mm512_mul_ps(_mm512_loadu_ps(band + i), v_mult), v_add), v_divisor);
+    __mmask16 invalid = _mm512_cmp_ps_mask(value, v_zero, _CMP_LE_OQ);
+    _mm512_storeu_ps(out + i, _mm512_mask_blend_ps(invalid, value, v_nan));
+  }
+
+  calibrate_scalar(band, out, mult, add, divisor, i, end);
+}
+
+__attribute__((target("avx512f"))) static __m256 albedo_correction_avx512(__m256 alb, __m256 tal)
+{
+  const __m512d v_offset = _mm512_set1_pd(0.03);
+
+  __m512d numerator = _mm512_sub_pd(_mm512_cvtps_pd(alb), v_offset);
+  __m512d denominator = _mm512_cvtps_pd(_mm256_mul_ps(tal, tal));
+  return _mm512_cvtpd_ps(_mm512_div_pd(numerator, denominator));
+}
+
+__attribute__((target("avx512f"))) static void albedo_avx512(const float *const *reflectances, const float *weights, const float *tal, float *out, int start, int end)
+{
+  const __m512 v_zero = _mm512_setzero_ps();
+  const __m512 v_nan = _mm512_set1_ps(NAN);
+  __m512 v_weights[6];
+  for (int b = 0; b < 6; b++)
+    v_weights[b] = _mm512_set1_ps(weights[b]);
+
+  int i = start;
+  for (; i + 16 <= end; i += 16)
+  {
+    __m512 alb = _mm512_mul_ps(_mm512_loadu_ps(reflectances[0] + i), v_weights[0]);
+    for (int b = 1; b < 6; b++)
+      alb = _mm512_add_ps(alb, _mm512_mul_ps(_mm512_loadu_ps(reflectances[b] + i), v_weights[b]));
+
+    __m512 v_tal = _mm512_loadu_ps(tal + i);
+    __m256 low = albedo_correction_avx512(_mm512_castps512_ps256(alb), _mm512_castps512_ps256(v_tal));
+    __m256 high = albedo_correction_avx512(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(alb), 1)),
+                                           _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v_tal), 1)));
+    __m512 value = _mm512_castpd_ps(_mm512_insertf64x4(_mm512_castps_pd(_mm512_castps256_ps512(low)), _mm256_castps_pd(high), 1));
+
+    __mmask16 invalid = _mm512_cmp_ps_mask(value, v_zero, _CMP_LE_OQ);
+    _mm512_storeu_ps(out + i, _mm512_mask_blend_ps(invalid, value, v_nan));
+  }
+
+  // Same as albedo_avx2
+  _mm256_zeroupper();
+  albedo_scalar(reflectances, weights, tal, out, i, end);
+}
+
+__attribute__((target("avx2"))) static int widen_u16_avx2(const uint16_t *src, float *out, int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src + i)))));
+  return i;
+}
+
+__attribute__((target("avx2"))) static int widen_i16_avx2(const int16_t *src, float *out, int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + i)))));
+  return i;
+}
+
+__attribute__((target("avx512f"))) static int widen_u16_avx512(const uint16_t *src, float *out, int n)
+{
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+    _mm512_storeu_ps(out + i, _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(src + i)))));
+  return i;
+}
+
+__attribute__((target("avx512f"))) static int widen_i16_avx512(const int16_t *src, float *out, int n)
+{
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+    _mm512_storeu_ps(out + i, _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(_mm256_loadu_si256((const __m256i *)(src + i)))));
+  return i;
+}
+
+static uint16_t pack_fp16_scalar(float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  uint16_t sign = (bits >> 16) & 0x8000;
+  uint32_t magnitude = bits & 0x7FFFFFFF;
+
+  // NaN keeps the upper bits of its payload and is made quiet, values rounding past 65504 become infinite
+  if (magnitude > 0x7F800000)
+    return sign | 0x7E00 | ((magnitude >> 13) & 0x3FF);
+  if (magnitude >= 0x477FF000)
+    return sign | 0x7C00;
+
+  uint32_t half, remainder, tie;
+  if (magnitude < 0x38800000)
+  {
+    // Below 2^-14 the half is subnormal, in units of 2^-24
+    int shift = 126 - (int)(magnitude >> 23);
+    if (shift > 24)
+      return sign;
+    uint32_t mantissa = (magnitude & 0x7FFFFF) | 0x800000;
+    half = mantissa >> shift;
+    remainder = mantissa & ((1u << shift) - 1);
+    tie = 1u << (shift - 1);
+  }
+  else
+  {
+    half = (magnitude >> 13) - (112 << 10);
+    remainder = magnitude & 0x1FFF;
+    tie = 0x1000;
+  }
+
+  if (remainder > tie || (remainder == tie && (half & 1)))
+    half++;
+  return sign | half;
+}
+
+static float unpack_fp16_scalar(uint16_t half)
+{
+  uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+  uint32_t exponent = (half >> 10) & 0x1F;
+  uint32_t mantissa = half & 0x3FF;
+
+  uint32_t bits;
+  if (exponent == 0)
+  {
+    float value = mantissa * (1.0f / 16777216);
+    memcpy(&bits, &value, sizeof(bits));
+    bits |= sign;
+  }
+  else if (exponent == 31)
+    bits = sign | 0x7F800000 | (mantissa << 13) | (mantissa != 0 ? 0x400000 : 0);
+  else
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static uint16_t pack_bf16_scalar(float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  if ((bits & 0x7FFFFFFF) > 0x7F800000)
+    return (bits >> 16) | 0x40;
+  return (bits + 0x7FFF + ((bits >> 16) & 1)) >> 16;
+}
+
+static float unpack_bf16_scalar(uint16_t bf16)
+{
+  uint32_t bits = (uint32_t)bf16 << 16;
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+__attribute__((target("avx2,f16c"))) static int pack_fp16_avx2(const float *src, uint16_t *out, int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm_storeu_si128((__m128i *)(out + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+  return i;
+}
+
+__attribute__((target("avx2,f16c"))) static int unpack_fp16_avx2(const uint16_t *src, float *out, int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(src + i))));
+  return i;
+}
+
+__attribute__((target("avx2"))) static int pack_bf16_avx2(const float *src, uint16_t *out, int n)
+{
+  const __m256i v_bias = _mm256_set1_epi32(0x7FFF);
+  const __m256i v_one = _mm256_set1_epi32(1);
+  const __m256i v_quiet = _mm256_set1_epi32(0x40);
+
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+  {
+    __m256 value = _mm256_loadu_ps(src + i);
+    __m256i bits = _mm256_castps_si256(value);
+    __m256i upper = _mm256_srli_epi32(bits, 16);
+    __m256i rounded = _mm256_srli_epi32(_mm256_add_epi32(bits, _mm256_add_epi32(v_bias, _mm256_and_si256(upper, v_one))), 16);
+    __m256i nan = _mm256_castps_si256(_mm256_cmp_ps(value, value, _CMP_UNORD_Q));
+    __m256i packed = _mm256_blendv_epi8(rounded, _mm256_or_si256(upper, v_quiet), nan);
+
+    // The 32 to 16 bit pack works within each 128-bit lane, so the low quadwords of both lanes are gathered
+    packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(packed, packed), 0x08);
+    _mm_storeu_si128((__m128i *)(out + i), _mm256_castsi256_si128(packed));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static int unpack_bf16_avx2(const uint16_t *src, float *out, int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src + i))), 16)));
+  return i;
+}
+
+__attribute__((target("avx512f"))) static int pack_fp16_avx512(const float *src, uint16_t *out, int n)
+{
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+    _mm256_storeu_si256((__m256i *)(out + i), _mm512_cvtps_ph(_mm512_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+  return i;
+}
+
+__attribute__((target("avx512f"))) static int unpack_fp16_avx512(const uint16_t *src, float *out, int n)
+{
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+    _mm512_storeu_ps(out + i, _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(src + i))));
+  return i;
+}
+
+__attribute__((target("avx512f"))) static int pack_bf16_avx512(const float *src, uint16_t *out, int n)
+{
+  const __m512i v_bias = _mm512_set1_epi32(0x7FFF);
+  const __m512i v_one = _mm512_set1_epi32(1);
+  const __m512i v_quiet = _mm512_set1_epi32(0x40);
+
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    __m512 value = _mm512_loadu_ps(src + i);
+    __m512i bits = _mm512_castps_si512(value);
+    __m512i upper = _mm512_srli_epi32(bits, 16);
+    __m512i rounded = _mm512_srli_epi32(_mm512_add_epi32(bits, _mm512_add_epi32(v_bias, _mm512_and_si512(upper, v_one))), 16);
+    __mmask16 nan = _mm512_cmp_ps_mask(value, value, _CMP_UNORD_Q);
+    __m512i packed = _mm512_mask_blend_epi32(nan, rounded, _mm512_or_si512(upper, v_quiet));
+    _mm256_storeu_si256((__m256i *)(out + i), _mm512_cvtepi32_epi16(packed));
+  }
+  return i;
+}
+
+__attribute__((target("avx512f"))) static int unpack_bf16_avx512(const uint16_t *src, float *out, int n)
+{
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+    _mm512_storeu_ps(out + i, _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(src + i))), 16)));
+  return i;
+}
+
+int simd_select(int requested)
+{
+  __builtin_cpu_init();
+
+  int available = SIMD_SCALAR;
+  if (__builtin_cpu_supports("avx2"))
+    available = SIMD_AVX2;
+  if (__builtin_cpu_supports("avx512f"))
+    available = SIMD_AVX512;
+
+  has_f16c = __builtin_cpu_supports("f16c");
+
+  if (requested == SIMD_AUTO || requested > available)
+    requested = available;
+
+  selected_isa = requested;
+  return selected_isa;
+}
+
+int simd_isa()
+{
+  return selected_isa;
+}
+
+string simd_name(int isa)
+{
+  switch (isa)
+  {
+  case SIMD_AVX512:
+    return "avx512";
+  case SIMD_AVX2:
+    return "avx2";
+  default:
+    return "scalar";
+  }
+}
+
+void simd_calibrate(const float *band, float *out, float mult, float add, float divisor, int start, int end)
+{
+  switch (selected_isa)
+  {
+  case SIMD_AVX512:
+    calibrate_avx512(band, out, mult, add, divisor, start, end);
+    break;
+  case SIMD_AVX2:
+    calibrate_avx2(band, out, mult, add, divisor, start, end);
+    break;
+  default:
+    calibrate_scalar(band, out, mult, add, divisor, start, end);
+  }
+}
+
+void simd_albedo(const float *const *reflectances, const float *weights, const float *tal, float *out, int start, int end)
+{
+  switch (selected_isa)
+  {
+  case SIMD_AVX512:
+    albedo_avx512(reflectances, weights, tal, out, start, end);
+    break;
+  case SIMD_AVX2:
+    albedo_avx2(reflectances, weights, tal, out, start, end);
+    break;
+  default:
+    albedo_scalar(reflectances, weights, tal, out, start, end);
+  }
+}
+
+void simd_widen_u16(const uint16_t *src, float *out, int n)
+{
+  int i = 0;
+  switch (selected_isa)
+  {
+  case SIMD_AVX512:
+    i = widen_u16_avx512(src, out, n);
+    break;
+  case SIMD_AVX2:
+    i = widen_u16_avx2(src, out, n);
+    break;
+  }
+
+  for (; i < n; i++)
+    out[i] = src[i];
+}
+
+void simd_widen_i16(const int16_t *src, float *out, int n)
+{
+  int i = 0;
+  switch (selected_isa)
+  {
+  case SIMD_AVX512:
+    i = widen_i16_avx512(src, out, n);
+    break;
+  case SIMD_AVX2:
+    i = widen_i16_avx2(src, out, n);
+    break;
+  }
+
+  for (; i < n; i++)
+    out[i] = src[i];
+}
+
+void simd_pack_fp16(const float *src, uint16_t *out, int n)
+{
+  int i = 0;
+  switch (selected_isa)
+  {
+  case SIMD_AVX512:
+    i = pack_fp16_avx512(src, out, n);
+    break;
+  case SIMD_AVX2:
+    if (has_f16c)
+      i = pack_fp16_avx2(src, out, n);
+    break;
+  }
+
+  for (; i < n; i++)
+    out[i] = pack_fp16_scalar(src[i]);
+}
+
+void simd_unpack_fp16(const uint16_t *src, float *out, int n)
+{
+  int i = 0;
+  switch (selected_isa)
+  {
+  case SIMD_AVX512:
+    i = unpack_fp16_avx512(src, out, n);
+    break;
+  case SIMD_AVX2:
+    if (has_f16c)
+      i = unpack_fp16_avx2(src, out, n);
+    break;
+  }
+
+  for (; i < n; i++)
+    out[i] = unpack_fp16_scalar(src[i]);
+}
+
+void simd_pack_bf16(const float *src, uint16_t *out, int n)
+{
+  int i = 0;
+  switch (selected_isa)
+  {
+  case SIMD_AVX512:
+    i = pack_bf16_avx512(src, out, n);
+    break;
+  case SIMD_AVX2:
+    i = pack_bf16_avx2(src, out, n);
+    break;
+  }
+
+  for (; i < n; i++)
+    out[i] = pack_bf16_scalar(src[i]);
+}
+
+void simd_unpack_bf16(const uint16_t *src, float *out, int n)
+{
+  int i = 0;
+  switch (selected_isa)
+  {
+  case SIMD_AVX512:
+    i = unpack_bf16_avx512(src, out, n);
+    break;
+  case SIMD_AVX2:
+    i = unpack_bf16_avx2(src, out, n);
+    break;
+  }
+
+  for (; i < n; i++)
+    out[i] = unpack_bf16_scalar(src[i]);
+}
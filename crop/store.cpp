@@ -0,0 +1,169 @@
+#include "store.h"
+#include "mask.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char STORE_MAGIC[8] = {'L', 'S', 'P', 'R', 'O', 'D', 0, 0};
+static const uint32_t STORE_VERSION = 1;
+
+// Planes start on page boundaries, so each one can be mapped and read ahead on its own
+static const uint64_t STORE_ALIGNMENT = 4096;
+
+static uint64_t align_up(uint64_t bytes)
+{
+  return (bytes + STORE_ALIGNMENT - 1) / STORE_ALIGNMENT * STORE_ALIGNMENT;
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t bytes)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  for (size_t i = 0; i < bytes; i++)
+    hash = (hash ^ p[i]) * 1099511628211ULL;
+  return hash;
+}
+
+static bool write_all(int fd, const void *data, size_t bytes)
+{
+  const char *p = (const char *)data;
+  while (bytes > 0)
+  {
+    ssize_t written = write(fd, p, bytes);
+    if (written <= 0)
+      return false;
+    p += written;
+    bytes -= written;
+  }
+  return true;
+}
+
+uint64_t store_fingerprint(string paths[], int count, float temperature_image, int math_tier, int precision, int compact)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = 0; i < count; i++)
+  {
+    struct stat info;
+    int64_t stamp[3] = {-1, -1, -1};
+    if (stat(paths[i].c_str(), &info) == 0)
+    {
+      stamp[0] = info.st_size;
+      stamp[1] = info.st_mtim.tv_sec;
+      stamp[2] = info.st_mtim.tv_nsec;
+    }
+    hash = fnv1a(hash, stamp, sizeof(stamp));
+  }
+  hash = fnv1a(hash, &temperature_image, sizeof(temperature_image));
+  hash = fnv1a(hash, &math_tier, sizeof(math_tier));
+  hash = fnv1a(hash, &precision, sizeof(precision));
+  hash = fnv1a(hash, &compact, sizeof(compact));
+  return hash;
+}
+
+ProductStore::ProductStore()
+{
+  this->directory = "";
+  this->scene_id = "";
+  this->fingerprint = 0;
+}
+
+ProductStore::ProductStore(string directory, string scene_id, uint64_t fingerprint)
+{
+  this->directory = directory;
+  this->scene_id = scene_id.empty() ? "scene" : scene_id;
+  this->fingerprint = fingerprint;
+}
+
+bool ProductStore::enabled()
+{
+  return !this->directory.empty();
+}
+
+string ProductStore::path(string stage)
+{
+  return this->directory + "/" + this->scene_id + "." + stage + ".prod";
+}
+
+void *ProductStore::map(string stage, uint32_t width_band, uint32_t height_band, float *planes[], int count, uint64_t **valid_mask, size_t *size)
+{
+  int fd = open(path(stage).c_str(), O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  StoreHeader header;
+  struct stat info;
+  uint64_t plane_bytes = align_up((uint64_t)width_band * height_band * sizeof(float));
+  bool valid = pread(fd, &header, sizeof(header), 0) == sizeof(header) && fstat(fd, &info) == 0 &&
+               memcmp(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC)) == 0 && header.version == STORE_VERSION &&
+               header.width_band == width_band && header.height_band == height_band && header.planes == count &&
+               header.plane_bytes == plane_bytes && header.fingerprint == this->fingerprint &&
+               (header.mask_words == 0 || header.mask_words == mask_words(width_band * height_band)) &&
+               (uint64_t)info.st_size == STORE_ALIGNMENT + count * plane_bytes + header.mask_words * sizeof(uint64_t);
+
+  void *mapping = MAP_FAILED;
+  if (valid)
+    mapping = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (mapping == MAP_FAILED)
+    return NULL;
+  madvise(mapping, info.st_size, MADV_WILLNEED);
+
+  char *base = (char *)mapping + STORE_ALIGNMENT;
+  for (int i = 0; i < count; i++)
+    planes[i] = (float *)(base + i * plane_bytes);
+  *valid_mask = header.mask_words > 0 ? (uint64_t *)(base + count * plane_bytes) : NULL;
+  *size = info.st_size;
+  return mapping;
+}
+
+bool ProductStore::save(string stage, uint32_t width_band, uint32_t height_band, float *planes[], int count, const uint64_t *valid_mask)
+{
+  StoreHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+  header.version = STORE_VERSION;
+  header.width_band = width_band;
+  header.height_band = height_band;
+  header.planes = count;
+  header.plane_bytes = align_up((uint64_t)width_band * height_band * sizeof(float));
+  header.mask_words = valid_mask != NULL ? mask_words(width_band * height_band) : 0;
+  header.fingerprint = this->fingerprint;
+  strncpy(header.scene_id, this->scene_id.c_str(), sizeof(header.scene_id) - 1);
+  strncpy(header.stage, stage.c_str(), sizeof(header.stage) - 1);
+
+  string final_path = path(stage);
+
+  // Unique per call, since the batch jobs of one process may save the same scene and stage at once
+  string temporary_path = final_path + ".tmpXXXXXX";
+  int fd = mkstemp(&temporary_path[0]);
+  if (fd >= 0 && fchmod(fd, 0644) != 0)
+  {
+    close(fd);
+    unlink(temporary_path.c_str());
+    fd = -1;
+  }
+  if (fd < 0)
+  {
+    cerr << "Store problem! - Could not create " << temporary_path << endl;
+    return false;
+  }
+
+  vector<char> padding(STORE_ALIGNMENT, 0);
+  size_t data_bytes = (size_t)width_band * height_band * sizeof(float);
+  bool written = write_all(fd, &header, sizeof(header)) && write_all(fd, padding.data(), STORE_ALIGNMENT - sizeof(header));
+  for (int i = 0; i < count && written; i++)
+    written = write_all(fd, planes[i], data_bytes) && write_all(fd, padding.data(), header.plane_bytes - data_bytes);
+  if (written && valid_mask != NULL)
+    written = write_all(fd, valid_mask, header.mask_words * sizeof(uint64_t));
+  written = close(fd) == 0 && written;
+
+  if (!written || rename(temporary_path.c_str(), final_path.c_str()) != 0)
+  {
+    cerr << "Store problem! - Could not write " << final_path << endl;
+    unlink(temporary_path.c_str());
+    return false;
+  }
+  return true;
+}
@@ -1,23 +1,440 @@
 #include "utils.h"
+#include "metrics.h"
 
-void saveTiff(string path, float *data, int height, int width)
+#include <zlib.h>
+#include <sys/stat.h>
+
+// GeoTIFF tags, not known to libtiff itself
+static const ttag_t TIFFTAG_GEOPIXELSCALE = 33550;
+static const ttag_t TIFFTAG_GEOTIEPOINTS = 33922;
+static const ttag_t TIFFTAG_GEOKEYDIRECTORY = 34735;
+static const ttag_t TIFFTAG_GEODOUBLEPARAMS = 34736;
+static const ttag_t TIFFTAG_GEOASCIIPARAMS = 34737;
+
+static const TIFFFieldInfo geotiff_fields[] = {
+    {TIFFTAG_GEOPIXELSCALE, -1, -1, TIFF_DOUBLE, FIELD_CUSTOM, 1, 1, (char *)"GeoPixelScale"},
+    {TIFFTAG_GEOTIEPOINTS, -1, -1, TIFF_DOUBLE, FIELD_CUSTOM, 1, 1, (char *)"GeoTiePoints"},
+    {TIFFTAG_GEOKEYDIRECTORY, -1, -1, TIFF_SHORT, FIELD_CUSTOM, 1, 1, (char *)"GeoKeyDirectory"},
+    {TIFFTAG_GEODOUBLEPARAMS, -1, -1, TIFF_DOUBLE, FIELD_CUSTOM, 1, 1, (char *)"GeoDoubleParams"},
+    {TIFFTAG_GEOASCIIPARAMS, -1, -1, TIFF_ASCII, FIELD_CUSTOM, 1, 0, (char *)"GeoASCIIParams"}};
+
+static TIFFExtendProc parent_extender = NULL;
+
+static void geotiff_extender(TIFF *tif)
+{
+  TIFFMergeFieldInfo(tif, geotiff_fields, sizeof(geotiff_fields) / sizeof(geotiff_fields[0]));
+  if (parent_extender != NULL)
+    parent_extender(tif);
+}
+
+void GeoTags::register_tags()
+{
+  static once_flag registered;
+  call_once(registered, []() { parent_extender = TIFFSetTagExtender(geotiff_extender); });
+}
+
+template <typename T>
+static vector<T> get_array(TIFF *tif, ttag_t tag)
+{
+  uint16_t count = 0;
+  T *values = NULL;
+  if (!TIFFGetField(tif, tag, &count, &values) || values == NULL)
+    return vector<T>();
+  return vector<T>(values, values + count);
+}
+
+void GeoTags::read(TIFF *tif)
+{
+  this->pixel_scale = get_array<double>(tif, TIFFTAG_GEOPIXELSCALE);
+  this->tiepoint = get_array<double>(tif, TIFFTAG_GEOTIEPOINTS);
+  this->key_directory = get_array<uint16_t>(tif, TIFFTAG_GEOKEYDIRECTORY);
+  this->double_params = get_array<double>(tif, TIFFTAG_GEODOUBLEPARAMS);
+
+  char *ascii = NULL;
+  this->ascii_params = TIFFGetField(tif, TIFFTAG_GEOASCIIPARAMS, &ascii) && ascii != NULL ? ascii : "";
+
+  // Only a raster tied to the model by one tiepoint and a pixel scale can be shifted to a window
+  if (this->tiepoint.size() != 6 || this->pixel_scale.size() < 2 || this->key_directory.empty())
+    *this = GeoTags();
+}
+
+GeoTags GeoTags::shifted(int line, int col)
+{
+  GeoTags window = *this;
+  if (window.tiepoint.empty())
+    return window;
+
+  window.tiepoint[3] += (col - this->tiepoint[0]) * this->pixel_scale[0];
+  window.tiepoint[4] -= (line - this->tiepoint[1]) * this->pixel_scale[1];
+  window.tiepoint[0] = 0;
+  window.tiepoint[1] = 0;
+  return window;
+}
+
+void GeoTags::write(TIFF *tif)
+{
+  if (this->tiepoint.empty())
+    return;
+
+  TIFFSetField(tif, TIFFTAG_GEOPIXELSCALE, (uint16_t)this->pixel_scale.size(), this->pixel_scale.data());
+  TIFFSetField(tif, TIFFTAG_GEOTIEPOINTS, (uint16_t)this->tiepoint.size(), this->tiepoint.data());
+  TIFFSetField(tif, TIFFTAG_GEOKEYDIRECTORY, (uint16_t)this->key_directory.size(), this->key_directory.data());
+  if (!this->double_params.empty())
+    TIFFSetField(tif, TIFFTAG_GEODOUBLEPARAMS, (uint16_t)this->double_params.size(), this->double_params.data());
+  if (!this->ascii_params.empty())
+    TIFFSetField(tif, TIFFTAG_GEOASCIIPARAMS, this->ascii_params.c_str());
+}
+
+TiffOptions::TiffOptions()
+{
+  this->compression = COMPRESSION_ADOBE_DEFLATE;
+  this->level = -1;
+  this->tile_size = TIFF_TILE_SIZE;
+  this->overviews = false;
+}
+
+int tiff_compression(string name)
+{
+  if (name == "none")
+    return COMPRESSION_NONE;
+  if (name == "deflate")
+    return COMPRESSION_ADOBE_DEFLATE;
+  if (name == "zstd")
+    return COMPRESSION_ZSTD;
+  if (name == "lzw")
+    return COMPRESSION_LZW;
+  return -1;
+}
+
+/**
+ * Copies one tile of a raster, the parts outside the raster set to zero.
+ */
+static void extract_tile(float *raster, int height, int width, int tile_size, int tile, float *dest)
+{
+  int tiles_across = (width + tile_size - 1) / tile_size;
+  int first_line = (tile / tiles_across) * tile_size;
+  int first_col = (tile % tiles_across) * tile_size;
+  int cols = min(tile_size, width - first_col);
+
+  for (int line = 0; line < tile_size; line++)
+  {
+    float *row = dest + line * tile_size;
+    if (first_line + line >= height)
+    {
+      fill(row, row + tile_size, 0.0f);
+      continue;
+    }
+
+    memcpy(row, raster + (first_line + line) * width + first_col, cols * sizeof(float));
+    fill(row + cols, row + tile_size, 0.0f);
+  }
+}
+
+/**
+ * Floating-point predictor (TIFF predictor 3) of each row of a tile: the bytes of the samples are split in
+ * planes, most significant first, and each byte is replaced by its difference to the previous one.
+ */
+static void predict_float_rows(uint8_t *tile, int tile_size)
+{
+  int row_bytes = tile_size * sizeof(float);
+  vector<uint8_t> row(row_bytes);
+
+  for (int line = 0; line < tile_size; line++)
+  {
+    uint8_t *cp = tile + line * row_bytes;
+    memcpy(row.data(), cp, row_bytes);
+
+    for (int i = 0; i < tile_size; i++)
+    {
+      for (int byte = 0; byte < 4; byte++)
+      {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        cp[byte * tile_size + i] = row[4 * i + byte];
+#else
+        cp[(3 - byte) * tile_size + i] = row[4 * i + byte];
+#endif
+      }
+    }
+
+    for (int i = row_bytes - 1; i > 0; i--)
+      cp[i] = cp[i] - cp[i - 1];
+  }
+}
+
+/**
+ * Halves a raster, each pixel the mean of the finite pixels of a 2x2 block, NaN when there is none.
+ */
+static void reduce_raster(const float *raster, int height, int width, float *dest)
+{
+  int reduced_height = (height + 1) / 2;
+  int reduced_width = (width + 1) / 2;
+
+  for (int line = 0; line < reduced_height; line++)
+  {
+    for (int col = 0; col < reduced_width; col++)
+    {
+      float sum = 0;
+      int count = 0;
+      for (int l = 2 * line; l < min(2 * line + 2, height); l++)
+      {
+        for (int c = 2 * col; c < min(2 * col + 2, width); c++)
+        {
+          float value = raster[l * width + c];
+          if (isfinite(value))
+          {
+            sum += value;
+            count++;
+          }
+        }
+      }
+      dest[line * reduced_width + col] = count == 0 ? NAN : sum / count;
+    }
+  }
+}
+
+/**
+ * Sets the tags of a tiled float image. FALSE when libtiff refused the compression, its predictor or its level.
+ */
+static bool set_tiff_fields(TIFF *tif, int height, int width, TiffOptions options)
 {
-  TIFF *tif = TIFFOpen(path.c_str(), "w");
   TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
   TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
   TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 32);
   TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
-  TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, 1);
+  TIFFSetField(tif, TIFFTAG_TILEWIDTH, options.tile_size);
+  TIFFSetField(tif, TIFFTAG_TILELENGTH, options.tile_size);
   TIFFSetField(tif, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
   TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
   TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
   TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
-  TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+  if (!TIFFSetField(tif, TIFFTAG_COMPRESSION, options.compression))
+    return false;
+
+  if (options.compression == COMPRESSION_NONE)
+    return true;
+
+  if (!TIFFSetField(tif, TIFFTAG_PREDICTOR, PREDICTOR_FLOATINGPOINT))
+    return false;
+  if (options.level >= 0 && options.compression == COMPRESSION_ADOBE_DEFLATE && !TIFFSetField(tif, TIFFTAG_ZIPQUALITY, options.level))
+    return false;
+  if (options.level >= 0 && options.compression == COMPRESSION_ZSTD && !TIFFSetField(tif, TIFFTAG_ZSTD_LEVEL, options.level))
+    return false;
+  return true;
+}
+
+/**
+ * Sets the compression level again on a directory read back, libtiff does not store it in the file.
+ */
+static bool set_tiff_level(TIFF *tif, TiffOptions options)
+{
+  if (options.level >= 0 && options.compression == COMPRESSION_ADOBE_DEFLATE)
+    return TIFFSetField(tif, TIFFTAG_ZIPQUALITY, options.level);
+  if (options.level >= 0 && options.compression == COMPRESSION_ZSTD)
+    return TIFFSetField(tif, TIFFTAG_ZSTD_LEVEL, options.level);
+  return true;
+}
+
+void saveTiff(string path, float *data, int height, int width)
+{
+  saveTiffs(&path, &data, 1, height, width, TiffOptions(), NULL);
+}
+
+string saveTiffs(string paths[], float *rasters[], int count, int height, int width, TiffOptions options, ThreadPool *pool)
+{
+  system_clock::time_point begin, end;
+  int64_t general_time, initial_time, final_time;
+
+  begin = system_clock::now();
+  initial_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+  MetricsSample sample = metrics_sample();
+
+  int tile_size = options.tile_size;
+  int tile_bytes = tile_size * tile_size * sizeof(float);
+  bool raw_tiles = options.compression == COMPRESSION_ADOBE_DEFLATE;
+
+  // libtiff accepts the tag of a codec it was built without, and only fails on the first tile
+  if (!TIFFIsCODECConfigured(options.compression))
+    scene_problem("Save TIFF problem! - Compression " + std::to_string(options.compression) + " is not available in this libtiff", 19);
+
+  // Full resolution image first, then the overviews, halving down to a single tile
+  vector<int> heights(1, height), widths(1, width);
+  while (options.overviews && (heights.back() > tile_size || widths.back() > tile_size))
+  {
+    heights.push_back((heights.back() + 1) / 2);
+    widths.push_back((widths.back() + 1) / 2);
+  }
+  int levels = heights.size();
+
+  vector<int> level_tiles(levels), first_tile(levels + 1, 0);
+  for (int l = 0; l < levels; l++)
+  {
+    level_tiles[l] = ((heights[l] + tile_size - 1) / tile_size) * ((widths[l] + tile_size - 1) / tile_size);
+    first_tile[l + 1] = first_tile[l] + level_tiles[l];
+  }
+  int tiles = first_tile[levels];
+
+  vector<vector<float>> overviews(count * levels);
+  vector<float *> images(count * levels);
+  auto reduce = [&](int first, int last)
+  {
+    for (int f = first; f < last; f++)
+    {
+      images[f * levels] = rasters[f];
+      for (int l = 1; l < levels; l++)
+      {
+        overviews[f * levels + l].resize(heights[l] * widths[l]);
+        reduce_raster(images[f * levels + l - 1], heights[l - 1], widths[l - 1], overviews[f * levels + l].data());
+        images[f * levels + l] = overviews[f * levels + l].data();
+      }
+    }
+  };
+
+  // Tiles of every image are encoded in parallel, libtiff only appends them
+  vector<vector<uint8_t>> encoded(raw_tiles ? count * tiles : 0);
+  auto encode = [&](int first, int last)
+  {
+    vector<uint8_t> tile(tile_bytes);
+    for (int k = first; k < last; k++)
+    {
+      int f = k / tiles;
+      int l = upper_bound(first_tile.begin(), first_tile.end(), k % tiles) - first_tile.begin() - 1;
+      extract_tile(images[f * levels + l], heights[l], widths[l], tile_size, k % tiles - first_tile[l], (float *)tile.data());
+      predict_float_rows(tile.data(), tile_size);
+
+      uLongf size = compressBound(tile_bytes);
+      encoded[k].resize(size);
+      int status = compress2(encoded[k].data(), &size, tile.data(), tile_bytes, options.level < 0 ? Z_DEFAULT_COMPRESSION : options.level);
+      if (status != Z_OK)
+        scene_problem("Save TIFF problem! - Could not compress a tile of " + paths[k / tiles] + " (zlib error " + std::to_string(status) + ")", 19);
+      encoded[k].resize(size);
+    }
+  };
+
+  // Tiles of one level of a file, appended in order
+  auto write_tiles = [&](TIFF *tif, int f, int l, vector<uint8_t> &tile)
+  {
+    for (int t = 0; t < level_tiles[l]; t++)
+    {
+      if (raw_tiles)
+      {
+        vector<uint8_t> &data = encoded[f * tiles + first_tile[l] + t];
+        if (TIFFWriteRawTile(tif, t, data.data(), data.size()) < 0)
+          return false;
+        vector<uint8_t>().swap(data);
+      }
+      else
+      {
+        extract_tile(images[f * levels + l], heights[l], widths[l], tile_size, t, (float *)tile.data());
+        if (TIFFWriteEncodedTile(tif, t, tile.data(), tile_bytes) < 0)
+          return false;
+      }
+    }
+    return true;
+  };
+
+  auto write = [&](int first, int last)
+  {
+    vector<uint8_t> tile(tile_bytes);
+    for (int f = first; f < last; f++)
+    {
+      TIFF *tif = TIFFOpen(paths[f].c_str(), "w");
+      if (tif == NULL)
+        scene_problem("Save TIFF problem! - Could not create " + paths[f], 19);
+
+      auto fail = [&](string what)
+      {
+        TIFFClose(tif);
+        scene_problem("Save TIFF problem! - " + what + " " + paths[f], 19);
+      };
+
+      // A Cloud-Optimized GeoTIFF has every directory, with its tile offsets, ahead of the tile data: the
+      // directories are written first with their offsets deferred, then the tiles, smallest overview first
+      for (int l = 0; l < levels; l++)
+      {
+        if (!set_tiff_fields(tif, heights[l], widths[l], options))
+          fail("Compression settings rejected for");
+        if (l == 0)
+          options.geo.write(tif);
+        else
+          TIFFSetField(tif, TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
+
+        if (options.overviews)
+        {
+          if (!TIFFDeferStrileArrayWriting(tif) || !TIFFWriteCheck(tif, 1, "saveTiffs") || !TIFFWriteDirectory(tif))
+            fail("Could not write a directory of");
+          continue;
+        }
+
+        if (!write_tiles(tif, f, l, tile))
+          fail("Could not write a tile of");
+      }
+
+      // TIFFClose returns nothing, flushing first surfaces a failed last directory
+      if (!TIFFFlush(tif))
+        fail("Could not finish");
+      TIFFClose(tif);
+
+      if (!options.overviews)
+        continue;
+
+      tif = TIFFOpen(paths[f].c_str(), "r+");
+      if (tif == NULL)
+        scene_problem("Save TIFF problem! - Could not reopen " + paths[f], 19);
+
+      // The offset arrays, still empty, are placed right after the directories, and filled in place once the
+      // tiles of their level are written
+      for (int l = 0; l < levels; l++)
+        if (!TIFFSetDirectory(tif, l) || !TIFFForceStrileArrayWriting(tif))
+          fail("Could not write the tile offsets of");
+
+      for (int l = levels - 1; l >= 0; l--)
+      {
+        if (!TIFFSetDirectory(tif, l) || !set_tiff_level(tif, options))
+          fail("Could not reopen a directory of");
+        if (!write_tiles(tif, f, l, tile))
+          fail("Could not write a tile of");
+        if (!TIFFForceStrileArrayWriting(tif))
+          fail("Could not write the tile offsets of");
+      }
+
+      if (!TIFFFlush(tif))
+        fail("Could not finish");
+      TIFFClose(tif);
+    }
+  };
+
+  if (pool == NULL)
+  {
+    reduce(0, count);
+    if (raw_tiles)
+      encode(0, count * tiles);
+    write(0, count);
+  }
+  else
+  {
+    pool->parallel_for(0, count, 1, reduce);
+    if (raw_tiles)
+      pool->parallel_for(0, count * tiles, 1, encode);
+    pool->parallel_for(0, count, 1, write);
+  }
+
+  end = system_clock::now();
+  general_time = duration_cast<nanoseconds>(end - begin).count();
+  final_time = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
 
-  for (int i = 0; i < height; i++)
+  // The bytes written are the sizes of the files, after compression
+  if (metrics_enabled())
   {
-    TIFFWriteScanline(tif, &data[i * width], i, 0);
+    int64_t pixels = (int64_t)count * height * width, written = 0;
+    for (int f = 0; f < count; f++)
+    {
+      struct stat file;
+      if (stat(paths[f].c_str(), &file) == 0)
+        written += file.st_size;
+    }
+    metrics_record(pool == NULL ? "SERIAL" : pool->backend(), "P3_SAVE_TIFF", general_time, metrics_since(sample), initial_time, final_time,
+                   pixels, pixels * sizeof(float), written);
   }
 
-  TIFFClose(tif);
-}
\ No newline at end of file
+  return (pool == NULL ? "SERIAL" : pool->backend()) + ",P3_SAVE_TIFF," + std::to_string(general_time) + "," + std::to_string(initial_time) + "," + std::to_string(final_time) + "\n";
+}
@@ -0,0 +1,367 @@
+#include "vmath.h"
+
+#include <cfloat>
+#include <cstring>
+#include <immintrin.h>
+
+// Polynomial approximations from the Cephes library (logf, expf). Every instruction set runs the same
+// sequence of roundings, so the fast tier gives the same results whichever of them is selected. As in
+// simd.cpp, this relies on the build not contracting multiplications and additions into FMA.
+
+static int selected_tier = VMATH_EXACT;
+
+static const float LOG_SQRTHF = 0.707106781186547524f;
+static const float LOG_P0 = 7.0376836292e-2f;
+static const float LOG_P1 = -1.1514610310e-1f;
+static const float LOG_P2 = 1.1676998740e-1f;
+static const float LOG_P3 = -1.2420140846e-1f;
+static const float LOG_P4 = 1.4249322787e-1f;
+static const float LOG_P5 = -1.6668057665e-1f;
+static const float LOG_P6 = 2.0000714765e-1f;
+static const float LOG_P7 = -2.4999993993e-1f;
+static const float LOG_P8 = 3.3333331174e-1f;
+static const float LOG_Q1 = -2.12194440e-4f;
+static const float LOG_Q2 = 0.693359375f;
+
+static const float EXP_HI = 88.0f;
+static const float EXP_LO = -87.3365447505531f;
+static const float EXP_LOG2EF = 1.44269504088896341f;
+static const float EXP_C1 = 0.693359375f;
+static const float EXP_C2 = -2.12194440e-4f;
+static const float EXP_P0 = 1.9875691500e-4f;
+static const float EXP_P1 = 1.3981999507e-3f;
+static const float EXP_P2 = 8.3334519073e-3f;
+static const float EXP_P3 = 4.1665795894e-2f;
+static const float EXP_P4 = 1.6666665459e-1f;
+static const float EXP_P5 = 5.0000001201e-1f;
+
+static float log_scalar(float x)
+{
+  if (isnan(x) || x < 0)
+    return NAN;
+  if (x == 0)
+    return -INFINITY;
+  if (isinf(x))
+    return INFINITY;
+
+  // Subnormals are scaled by 2^23 so that their exponent field is meaningful
+  float exponent = 0;
+  if (x < FLT_MIN)
+  {
+    x = x * 8388608.0f;
+    exponent = -23;
+  }
+
+  uint32_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  exponent = exponent + (float)((int32_t)(bits >> 23) - 126);
+  bits = (bits & 0x007fffff) | 0x3f000000;
+
+  // Mantissa in [sqrt(0.5), sqrt(2)) minus one
+  float m;
+  memcpy(&m, &bits, sizeof(m));
+  if (m < LOG_SQRTHF)
+  {
+    exponent = exponent - 1;
+    m = m + m - 1;
+  }
+  else
+    m = m - 1;
+
+  float z = m * m;
+  float y = LOG_P0;
+  y = y * m + LOG_P1;
+  y = y * m + LOG_P2;
+  y = y * m + LOG_P3;
+  y = y * m + LOG_P4;
+  y = y * m + LOG_P5;
+  y = y * m + LOG_P6;
+  y = y * m + LOG_P7;
+  y = y * m + LOG_P8;
+  y = y * m * z;
+
+  y = y + exponent * LOG_Q1;
+  y = y - 0.5f * z;
+  m = m + y;
+  return m + exponent * LOG_Q2;
+}
+
+static float exp_scalar(float x)
+{
+  if (isnan(x))
+    return NAN;
+  if (x > EXP_HI)
+    return INFINITY;
+  if (x < EXP_LO)
+    return 0;
+
+  // exp(x) = 2^n * exp(g), with |g| <= 0.5 * ln(2)
+  float n = floorf(x * EXP_LOG2EF + 0.5f);
+  x = x - n * EXP_C1;
+  x = x - n * EXP_C2;
+
+  float z = x * x;
+  float y = EXP_P0;
+  y = y * x + EXP_P1;
+  y = y * x + EXP_P2;
+  y = y * x + EXP_P3;
+  y = y * x + EXP_P4;
+  y = y * x + EXP_P5;
+  y = y * z + x + 1;
+
+  int32_t bits = ((int32_t)n + 127) << 23;
+  float scale;
+  memcpy(&scale, &bits, sizeof(scale));
+  return y * scale;
+}
+
+__attribute__((target("avx2"))) static __m256 log_avx2(__m256 x)
+{
+  const __m256 v_zero = _mm256_setzero_ps();
+  const __m256 v_one = _mm256_set1_ps(1);
+
+  __m256 subnormal = _mm256_cmp_ps(x, _mm256_set1_ps(FLT_MIN), _CMP_LT_OQ);
+  __m256 scaled = _mm256_blendv_ps(x, _mm256_mul_ps(x, _mm256_set1_ps(8388608.0f)), subnormal);
+  __m256 exponent = _mm256_blendv_ps(v_zero, _mm256_set1_ps(-23), subnormal);
+
+  __m256i bits = _mm256_castps_si256(scaled);
+  __m256i biased = _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(126));
+  exponent = _mm256_add_ps(exponent, _mm256_cvtepi32_ps(biased));
+  bits = _mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x3f000000));
+
+  __m256 m = _mm256_castsi256_ps(bits);
+  __m256 small = _mm256_cmp_ps(m, _mm256_set1_ps(LOG_SQRTHF), _CMP_LT_OQ);
+  exponent = _mm256_blendv_ps(exponent, _mm256_sub_ps(exponent, v_one), small);
+  m = _mm256_blendv_ps(_mm256_sub_ps(m, v_one), _mm256_sub_ps(_mm256_add_ps(m, m), v_one), small);
+
+  __m256 z = _mm256_mul_ps(m, m);
+  __m256 y = _mm256_set1_ps(LOG_P0);
+  y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(LOG_P1));
+  y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(LOG_P2));
+  y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(LOG_P3));
+  y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(LOG_P4));
+  y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(LOG_P5));
+  y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(LOG_P6));
+  y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(LOG_P7));
+  y = _mm256_add_ps(_mm256_mul_ps(y, m), _mm256_set1_ps(LOG_P8));
+  y = _mm256_mul_ps(_mm256_mul_ps(y, m), z);
+
+  y = _mm256_add_ps(y, _mm256_mul_ps(exponent, _mm256_set1_ps(LOG_Q1)));
+  y = _mm256_sub_ps(y, _mm256_mul_ps(_mm256_set1_ps(0.5f), z));
+  m = _mm256_add_ps(m, y);
+  __m256 result = _mm256_add_ps(m, _mm256_mul_ps(exponent, _mm256_set1_ps(LOG_Q2)));
+
+  result = _mm256_blendv_ps(result, _mm256_set1_ps(INFINITY), _mm256_cmp_ps(x, _mm256_set1_ps(INFINITY), _CMP_EQ_OQ));
+  result = _mm256_blendv_ps(result, _mm256_set1_ps(-INFINITY), _mm256_cmp_ps(x, v_zero, _CMP_EQ_OQ));
+  return _mm256_blendv_ps(result, _mm256_set1_ps(NAN), _mm256_cmp_ps(x, v_zero, _CMP_NGE_UQ));
+}
+
+__attribute__((target("avx2"))) static __m256 exp_avx2(__m256 x)
+{
+  __m256 clamped = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(EXP_LO)), _mm256_set1_ps(EXP_HI));
+
+  __m256 n = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(clamped, _mm256_set1_ps(EXP_LOG2EF)), _mm256_set1_ps(0.5f)));
+  __m256 g = _mm256_sub_ps(clamped, _mm256_mul_ps(n, _mm256_set1_ps(EXP_C1)));
+  g = _mm256_sub_ps(g, _mm256_mul_ps(n, _mm256_set1_ps(EXP_C2)));
+
+  __m256 z = _mm256_mul_ps(g, g);
+  __m256 y = _mm256_set1_ps(EXP_P0);
+  y = _mm256_add_ps(_mm256_mul_ps(y, g), _mm256_set1_ps(EXP_P1));
+  y = _mm256_add_ps(_mm256_mul_ps(y, g), _mm256_set1_ps(EXP_P2));
+  y = _mm256_add_ps(_mm256_mul_ps(y, g), _mm256_set1_ps(EXP_P3));
+  y = _mm256_add_ps(_mm256_mul_ps(y, g), _mm256_set1_ps(EXP_P4));
+  y = _mm256_add_ps(_mm256_mul_ps(y, g), _mm256_set1_ps(EXP_P5));
+  y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(y, z), g), _mm256_set1_ps(1));
+
+  __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(n), _mm256_set1_epi32(127)), 23);
+  __m256 result = _mm256_mul_ps(y, _mm256_castsi256_ps(bits));
+
+  result = _mm256_blendv_ps(result, _mm256_set1_ps(INFINITY), _mm256_cmp_ps(x, _mm256_set1_ps(EXP_HI), _CMP_GT_OQ));
+  result = _mm256_blendv_ps(result, _mm256_setzero_ps(), _mm256_cmp_ps(x, _mm256_set1_ps(EXP_LO), _CMP_LT_OQ));
+  return _mm256_blendv_ps(result, _mm256_set1_ps(NAN), _mm256_cmp_ps(x, x, _CMP_UNORD_Q));
+}
+
+__attribute__((target("avx512f"))) static __m512 log_avx512(__m512 x)
+{
+  const __m512 v_zero = _mm512_setzero_ps();
+  const __m512 v_one = _mm512_set1_ps(1);
+
+  __mmask16 subnormal = _mm512_cmp_ps_mask(x, _mm512_set1_ps(FLT_MIN), _CMP_LT_OQ);
+  __m512 scaled = _mm512_mask_blend_ps(subnormal, x, _mm512_mul_ps(x, _mm512_set1_ps(8388608.0f)));
+  __m512 exponent = _mm512_mask_blend_ps(subnormal, v_zero, _mm512_set1_ps(-23));
+
+  __m512i bits = _mm512_castps_si512(scaled);
+  __m512i biased = _mm512_sub_epi32(_mm512_srli_epi32(bits, 23), _mm512_set1_epi32(126));
+  exponent = _mm512_add_ps(exponent, _mm512_cvtepi32_ps(biased));
+  bits = _mm512_or_si512(_mm512_and_si512(bits, _mm512_set1_epi32(0x007fffff)), _mm512_set1_epi32(0x3f000000));
+
+  __m512 m = _mm512_castsi512_ps(bits);
+  __mmask16 small = _mm512_cmp_ps_mask(m, _mm512_set1_ps(LOG_SQRTHF), _CMP_LT_OQ);
+  exponent = _mm512_mask_blend_ps(small, exponent, _mm512_sub_ps(exponent, v_one));
+  m = _mm512_mask_blend_ps(small, _mm512_sub_ps(m, v_one), _mm512_sub_ps(_mm512_add_ps(m, m), v_one));
+
+  __m512 z = _mm512_mul_ps(m, m);
+  __m512 y = _mm512_set1_ps(LOG_P0);
+  y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(LOG_P1));
+  y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(LOG_P2));
+  y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(LOG_P3));
+  y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(LOG_P4));
+  y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(LOG_P5));
+  y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(LOG_P6));
+  y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(LOG_P7));
+  y = _mm512_add_ps(_mm512_mul_ps(y, m), _mm512_set1_ps(LOG_P8));
+  y = _mm512_mul_ps(_mm512_mul_ps(y, m), z);
+
+  y = _mm512_add_ps(y, _mm512_mul_ps(exponent, _mm512_set1_ps(LOG_Q1)));
+  y = _mm512_sub_ps(y, _mm512_mul_ps(_mm512_set1_ps(0.5f), z));
+  m = _mm512_add_ps(m, y);
+  __m512 result = _mm512_add_ps(m, _mm512_mul_ps(exponent, _mm512_set1_ps(LOG_Q2)));
+
+  result = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(x, _mm512_set1_ps(INFINITY), _CMP_EQ_OQ), result, _mm512_set1_ps(INFINITY));
+  result = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(x, v_zero, _CMP_EQ_OQ), result, _mm512_set1_ps(-INFINITY));
+  return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(x, v_zero, _CMP_NGE_UQ), result, _mm512_set1_ps(NAN));
+}
+
+__attribute__((target("avx512f"))) static __m512 exp_avx512(__m512 x)
+{
+  __m512 clamped = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(EXP_LO)), _mm512_set1_ps(EXP_HI));
+
+  __m512 n = _mm512_roundscale_ps(_mm512_add_ps(_mm512_mul_ps(clamped, _mm512_set1_ps(EXP_LOG2EF)), _mm512_set1_ps(0.5f)),
+                                  _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+  __m512 g = _mm512_sub_ps(clamped, _mm512_mul_ps(n, _mm512_set1_ps(EXP_C1)));
+  g = _mm512_sub_ps(g, _mm512_mul_ps(n, _mm512_set1_ps(EXP_C2)));
+
+  __m512 z = _mm512_mul_ps(g, g);
+  __m512 y = _mm512_set1_ps(EXP_P0);
+  y = _mm512_add_ps(_mm512_mul_ps(y, g), _mm512_set1_ps(EXP_P1));
+  y = _mm512_add_ps(_mm512_mul_ps(y, g), _mm512_set1_ps(EXP_P2));
+  y = _mm512_add_ps(_mm512_mul_ps(y, g), _mm512_set1_ps(EXP_P3));
+  y = _mm512_add_ps(_mm512_mul_ps(y, g), _mm512_set1_ps(EXP_P4));
+  y = _mm512_add_ps(_mm512_mul_ps(y, g), _mm512_set1_ps(EXP_P5));
+  y = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(y, z), g), _mm512_set1_ps(1));
+
+  __m512i bits = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvttps_epi32(n), _mm512_set1_epi32(127)), 23);
+  __m512 result = _mm512_mul_ps(y, _mm512_castsi512_ps(bits));
+
+  result = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(x, _mm512_set1_ps(EXP_HI), _CMP_GT_OQ), result, _mm512_set1_ps(INFINITY));
+  result = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(x, _mm512_set1_ps(EXP_LO), _CMP_LT_OQ), result, _mm512_setzero_ps());
+  return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(x, x, _CMP_UNORD_Q), result, _mm512_set1_ps(NAN));
+}
+
+__attribute__((target("avx2"))) static int log_block_avx2(const float *x, float *out, int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i, log_avx2(_mm256_loadu_ps(x + i)));
+  return i;
+}
+
+__attribute__((target("avx2"))) static int exp_block_avx2(const float *x, float *out, int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i, exp_avx2(_mm256_loadu_ps(x + i)));
+  return i;
+}
+
+__attribute__((target("avx2"))) static int pow_block_avx2(const float *x, float y, float *out, int n)
+{
+  const __m256 v_y = _mm256_set1_ps(y);
+
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i, exp_avx2(_mm256_mul_ps(v_y, log_avx2(_mm256_loadu_ps(x + i)))));
+  return i;
+}
+
+__attribute__((target("avx512f"))) static int log_block_avx512(const float *x, float *out, int n)
+{
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+    _mm512_storeu_ps(out + i, log_avx512(_mm512_loadu_ps(x + i)));
+  return i;
+}
+
+__attribute__((target("avx512f"))) static int exp_block_avx512(const float *x, float *out, int n)
+{
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+    _mm512_storeu_ps(out + i, exp_avx512(_mm512_loadu_ps(x + i)));
+  return i;
+}
+
+__attribute__((target("avx512f"))) static int pow_block_avx512(const float *x, float y, float *out, int n)
+{
+  const __m512 v_y = _mm512_set1_ps(y);
+
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+    _mm512_storeu_ps(out + i, exp_avx512(_mm512_mul_ps(v_y, log_avx512(_mm512_loadu_ps(x + i)))));
+  return i;
+}
+
+void vmath_select(int tier)
+{
+  selected_tier = tier;
+}
+
+int vmath_tier()
+{
+  return selected_tier;
+}
+
+string vmath_name(int tier)
+{
+  return tier == VMATH_FAST ? "fast" : "exact";
+}
+
+void vmath_log(const float *x, float *out, int n)
+{
+  int i = 0;
+  switch (simd_isa())
+  {
+  case SIMD_AVX512:
+    i = log_block_avx512(x, out, n);
+    break;
+  case SIMD_AVX2:
+    i = log_block_avx2(x, out, n);
+    break;
+  }
+
+  for (; i < n; i++)
+    out[i] = log_scalar(x[i]);
+}
+
+void vmath_exp(const float *x, float *out, int n)
+{
+  int i = 0;
+  switch (simd_isa())
+  {
+  case SIMD_AVX512:
+    i = exp_block_avx512(x, out, n);
+    break;
+  case SIMD_AVX2:
+    i = exp_block_avx2(x, out, n);
+    break;
+  }
+
+  for (; i < n; i++)
+    out[i] = exp_scalar(x[i]);
+}
+
+void vmath_pow(const float *x, float y, float *out, int n)
+{
+  int i = 0;
+  switch (simd_isa())
+  {
+  case SIMD_AVX512:
+    i = pow_block_avx512(x, y, out, n);
+    break;
+  case SIMD_AVX2:
+    i = pow_block_avx2(x, y, out, n);
+    break;
+  }
+
+  for (; i < n; i++)
+    out[i] = exp_scalar(y * log_scalar(x[i]));
+}
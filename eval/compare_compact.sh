@@ -0,0 +1,52 @@
+#!/bin/bash
+
+# Measures the accuracy impact of the packed intermediate planes (-compact=fp16 and -compact=bf16) against float
+# storage. Each format saves the Rn/G chain outputs (NDVI, albedo, Ts, Rn and G) through the product store, and
+# eval/compare_store.py reports the max and mean error of each output against the -compact=none run.
+#
+# Settings (environment):
+#   EVAL_SCENE        Folder of the scene: B2-B7 and B10 TIFs, elevation.tif, MTL.txt and station.csv
+#   EVAL_COMPACT_DIR  Folder of the store files and results
+#   METHOD            Endmembers method, -meth= of each run
+#   EXEC_FLAGS        Extra flags of every run
+
+EVAL_SCENE=${EVAL_SCENE:-./input}
+EVAL_COMPACT_DIR=${EVAL_COMPACT_DIR:-./output/eval-compact}
+METHOD=${METHOD:-0}
+EXEC_FLAGS=${EXEC_FLAGS:-}
+
+MAIN=./crop/main
+
+if [ ! -x $MAIN ]; then
+  echo "Eval problem! - $MAIN is missing, run make build-crop" >&2
+  exit 1
+fi
+
+scene=$EVAL_SCENE
+rm -rf $EVAL_COMPACT_DIR
+for compact in none fp16 bf16; do
+  store=$EVAL_COMPACT_DIR/$compact
+  mkdir -p $store
+  $MAIN $scene/B2.TIF $scene/B3.TIF $scene/B4.TIF $scene/B5.TIF $scene/B6.TIF $scene/B10.TIF $scene/B7.TIF \
+    $scene/elevation.tif $scene/MTL.txt $scene/station.csv $store \
+    -meth=$METHOD -compact=$compact -store=$store $EXEC_FLAGS > $store/timing.txt 2>&1
+  if [ $? -ne 0 ] || ! ls $store/*.prod > /dev/null 2>&1; then
+    echo "Eval problem! - Run failed, see $store/timing.txt" >&2
+    exit 1
+  fi
+  grep -E "HOT|COLD" $store/timing.txt > $store/endmembers.txt
+done
+
+for compact in fp16 bf16; do
+  echo "compact=$compact against none"
+  for file in $EVAL_COMPACT_DIR/$compact/*.prod; do
+    python3 eval/compare_store.py $EVAL_COMPACT_DIR/none/$(basename $file) $file | tee $EVAL_COMPACT_DIR/$compact.csv
+  done
+  if cmp -s $EVAL_COMPACT_DIR/none/endmembers.txt $EVAL_COMPACT_DIR/$compact/endmembers.txt; then
+    echo "endmembers: same as none"
+  else
+    echo "endmembers: differ from none"
+    paste $EVAL_COMPACT_DIR/none/endmembers.txt $EVAL_COMPACT_DIR/$compact/endmembers.txt
+  fi
+  echo
+done
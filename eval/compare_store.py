@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+import argparse
+import struct
+import sys
+
+import numpy as np
+
+# StoreHeader of include/store.h, the planes start at the next page
+HEADER = struct.Struct('<8sIIIIQQQ64s16s')
+STORE_ALIGNMENT = 4096
+
+PLANES = {
+    'rn_g': ['ndvi', 'albedo', 'surface_temperature', 'net_radiation', 'soil_heat'],
+    'ts': ['ndvi', 'albedo', 'surface_temperature'],
+}
+
+
+def load_store(path):
+    """
+    Planes of a product store file, keyed by product name, with the header fields.
+    """
+    with open(path, 'rb') as store:
+        data = store.read()
+
+    magic, version, width, height, count, plane_bytes, mask_words, fingerprint, scene_id, stage = HEADER.unpack_from(data)
+    if magic[:6] != b'LSPROD':
+        sys.exit(f"Store problem! - {path} is not a product store file")
+
+    stage = stage.rstrip(b'\0').decode()
+    names = PLANES.get(stage, [f'plane_{i}' for i in range(count)])
+    planes = {}
+    for i in range(count):
+        offset = STORE_ALIGNMENT + i * plane_bytes
+        planes[names[i]] = np.frombuffer(data, dtype=np.float32, count=width * height, offset=offset)
+
+    return stage, width, height, planes
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Compares the product planes of two product store files')
+    parser.add_argument('reference', help='Store file of the reference run')
+    parser.add_argument('other', help='Store file of the run to measure')
+    args = parser.parse_args()
+
+    stage, width, height, reference = load_store(args.reference)
+    other_stage, other_width, other_height, other = load_store(args.other)
+    if (stage, width, height) != (other_stage, other_width, other_height):
+        sys.exit("Store problem! - The files hold different stages or scene sizes")
+
+    # Errors over the pixels finite in both runs, relative ones only where the reference is above 1e-3 in magnitude
+    print("product,pixels,nan_mismatches,max_abs_error,mean_abs_error,max_rel_error,mean_rel_error")
+    for name, expected in reference.items():
+        measured = other[name]
+        finite = np.isfinite(expected) & np.isfinite(measured)
+        nan_mismatches = int(np.count_nonzero(np.isfinite(expected) != np.isfinite(measured)))
+
+        error = np.abs(expected[finite].astype(np.float64) - measured[finite])
+        scale = np.abs(expected[finite].astype(np.float64))
+        relative = error[scale > 1e-3] / scale[scale > 1e-3]
+
+        max_abs = error.max() if error.size else 0.0
+        mean_abs = error.mean() if error.size else 0.0
+        max_rel = relative.max() if relative.size else 0.0
+        mean_rel = relative.mean() if relative.size else 0.0
+        print(f"{name},{int(finite.sum())},{nan_mismatches},{max_abs:.6g},{mean_abs:.6g},{max_rel:.6g},{mean_rel:.6g}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "constants.h"
+#include "errors.h"
+
+/**
+ * @brief  Single aligned block of memory handing out buffers by bumping an offset. Buffers are not freed one by one:
+ *         the arena is reset as a whole and carved again, so a block sized for one scene serves every later scene
+ *         of the same or smaller dimensions without going back to the system.
+ */
+struct Arena
+{
+  char *block;
+  size_t mapped;
+  char *base;
+  size_t capacity;
+  size_t used;
+  size_t high_water;
+
+  /**
+   * @brief  Empty constructor, no memory is held.
+   */
+  Arena();
+
+  /**
+   * @brief  Makes sure the block holds at least bytes. A smaller block is released and mapped again, ARENA_HUGEPAGE
+   *         aligned and advised for huge pages. The arena is left reset.
+   * @param  bytes: Size needed.
+   */
+  void reserve(size_t bytes);
+
+  /**
+   * @brief  Carves an ARENA_ALIGNMENT aligned buffer. The block must have room for it.
+   * @param  bytes: Size of the buffer.
+   * @retval Address of the buffer.
+   */
+  void *allocate(size_t bytes);
+
+  /**
+   * @brief  Forgets every carved buffer, keeping the block.
+   */
+  void reset();
+
+  /**
+   * @brief  Destructor. Releases the block, can be called more than once.
+   */
+  void close();
+};
+
+/**
+ * @brief  Size of a buffer carved from an arena, rounded up to ARENA_ALIGNMENT.
+ * @param  bytes: Size of the buffer.
+ * @retval size_t
+ */
+size_t arena_size(size_t bytes);
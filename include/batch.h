@@ -0,0 +1,91 @@
+#pragma once
+
+#include "utils.h"
+#include "landsat.h"
+#include "constants.h"
+#include "parameters.h"
+#include "scheduler.h"
+
+/**
+ * @brief  Input files and output folder of one scene, in the order of the positional arguments.
+ */
+struct Scene
+{
+  string bands_paths[8];
+  string mtl_path;
+  string station_path;
+  string output_folder;
+};
+
+/**
+ * @brief  Execution flags shared by every scene of a run.
+ */
+struct RunOptions
+{
+  int method;
+  bool fused;
+  bool streaming;
+  bool crop_only;
+  int tile_rows;
+  int pyramid_factor;
+  int math;
+  int precision;
+  int compact;
+  string store_directory;
+  TiffOptions tiff_options;
+  int height_crop, width_crop;
+
+  /**
+   * @brief  Empty constructor, the defaults of the flags.
+   */
+  RunOptions();
+};
+
+/**
+ * @brief  Runs the whole processing of one scene: the products, the endmembers selection and the crop outputs.
+ *         A failure of the scene throws a SceneError, once its band files are closed and its planes released.
+ *
+ * @param  scene: Scene to process.
+ * @param  options: Execution flags.
+ * @param  pool: Threads running the product kernels.
+ * @param  buffers: Products planes left by a previous scene, reused when they are large enough and replaced by the
+ *                  planes of this scene on return. NULL allocates and keeps the planes for this scene only.
+ * @retval string with the selected pixels and the dimensions, one "KEY: value" line each.
+ */
+string process_scene(Scene &scene, RunOptions &options, ThreadPool *pool, Products *buffers);
+
+/**
+ * @brief  Reads a batch manifest: one scene per line, the 7 bands, the elevation, the MTL, the station data and the
+ *         output folder separated by spaces. Empty lines and lines starting with # are skipped. Every line is checked
+ *         first, its field count, inputs readable and output folder writable, and the run exits when any is wrong.
+ *
+ * @param  manifest_path: Manifest file path.
+ * @retval vector<Scene>
+ */
+vector<Scene> read_manifest(string manifest_path);
+
+/**
+ * @brief  Estimated peak memory of one scene, the whole-scene planes kept by the chosen mode plus the crop outputs.
+ *
+ * @param  width_band: Band width.
+ * @param  height_band: Band height.
+ * @param  options: Execution flags.
+ * @retval Bytes.
+ */
+int64_t scene_memory(uint32_t width_band, uint32_t height_band, RunOptions &options);
+
+/**
+ * @brief  Processes every scene of a manifest in one process. Up to jobs scenes run at once, each one on its own pool
+ *         of threads / jobs threads, and a scene only starts once its estimated memory fits in memory_budget next to
+ *         the running ones. Each job keeps its Products planes from one scene to the next, and the band files of the
+ *         next scene are read ahead into the page cache while the current one is computed. A scene that fails is
+ *         reported with a SCENE_PROBLEM line and skipped.
+ *
+ * @param  scenes: Scenes to process, started in order.
+ * @param  options: Execution flags.
+ * @param  jobs: Number of scenes processed at once.
+ * @param  threads: Total number of threads (0 uses every core).
+ * @param  memory_budget: Bytes shared by the running scenes, 0 for no limit.
+ * @retval Number of scenes that failed.
+ */
+int run_batch(vector<Scene> &scenes, RunOptions &options, int jobs, int threads, int64_t memory_budget);
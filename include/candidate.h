@@ -57,3 +57,55 @@ bool equals(Candidate a, Candidate b);
  * @retval TRUE if second candidate is greater than first one, and FALSE otherwise.
  */
 bool compare_candidate_temperature(Candidate a, Candidate b);
+
+/**
+ * @brief  Ranks hot pixel candidates: hotter first, then higher NDVI, then pixel order.
+ * @param  a: First candidate.
+ * @param  b: Second candidate.
+ * @retval TRUE if the first candidate ranks before the second one, and FALSE otherwise.
+ */
+bool rank_hot_candidate(Candidate a, Candidate b);
+
+/**
+ * @brief  Ranks cold pixel candidates: colder first, then lower NDVI, then pixel order.
+ * @param  a: First candidate.
+ * @param  b: Second candidate.
+ * @retval TRUE if the first candidate ranks before the second one, and FALSE otherwise.
+ */
+bool rank_cold_candidate(Candidate a, Candidate b);
+
+/**
+ * @brief  Bounded collector keeping the best ranked candidates pushed into it, as a heap whose top is the worst
+ *         kept one. Each thread fills its own collector and the collectors are merged at the end.
+ */
+struct CandidateHeap
+{
+  int capacity;
+  bool (*rank)(Candidate, Candidate);
+  vector<Candidate> heap;
+
+  /**
+   * @brief  Constructor.
+   * @param  capacity: Maximum number of candidates kept, 0 keeps every one.
+   * @param  rank: Strict total order, TRUE when the first candidate ranks before the second one.
+   */
+  CandidateHeap(int capacity, bool (*rank)(Candidate, Candidate));
+
+  /**
+   * @brief  Adds a candidate, dropping the worst kept one when the collector is full.
+   * @param  candidate: Candidate to add.
+   */
+  void push(const Candidate &candidate);
+
+  /**
+   * @brief  Adds every candidate kept by another collector with the same rank.
+   * @param  other: Collector to merge.
+   */
+  void merge(CandidateHeap &other);
+
+  /**
+   * @brief  Moves the kept candidates out, best ranked first. The collector is left empty.
+   * @retval vector<Candidate>
+   */
+  vector<Candidate> sorted();
+};
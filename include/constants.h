@@ -17,6 +17,10 @@
 #include <set>
 #include <thread>
 #include <assert.h>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 using namespace std;
 using namespace std::chrono;
@@ -55,6 +59,42 @@ const float SPECIFIC_HEAT_AIR = 1004;
 // Solar constant
 const float GSC = 0.082;
 
+// Pixels processed per block by the fused Rn/G chain (about 40 planes must fit in L2)
+const int FUSED_BLOCK_SIZE = 2048;
+
+// Rows per chunk handed to each thread by the parallel backend
+const int PARALLEL_BLOCK_ROWS = 16;
+
+// Number of stages in the Rn/G chain
+const int RN_G_STAGES = 16;
+
+// Leading stages of the Rn/G chain needed for NDVI, albedo and surface temperature
+const int TS_STAGES = 11;
+
+// Default rows per strip of the streaming pipeline
+const int STREAM_TILE_ROWS = 128;
+
+// Pixels per buffer handed to the vector math functions by the fast math tier
+const int VMATH_BLOCK_SIZE = 1024;
+
+// Minimum cell side, in pixels, of the grid pairing hot and cold candidates
+const int CANDIDATE_GRID_MIN_CELL = 32;
+
+// Default number of hot and of cold candidates kept by the endmembers search, except with the second filter
+const int CANDIDATE_TOP_K = 1 << 16;
+
+// Side, in pixels, of the tiles of the written TIFF files
+const int TIFF_TILE_SIZE = 256;
+
+// Default side, in pixels, of the blocks reduced into each cell of the endmembers pyramid
+const int PYRAMID_FACTOR = 8;
+
+// Alignment, in bytes, of each plane carved from an arena (a cache line, and an AVX-512 vector)
+const int ARENA_ALIGNMENT = 64;
+
+// Alignment, in bytes, of the arena blocks, so they can be backed by transparent huge pages
+const int ARENA_HUGEPAGE = 2 << 20;
+
 // Agricultural field land cover value
 // Available at https://mapbiomas.org/downloads_codigos
 const int AGP = 14, PAS = 15, AGR = 18, CAP = 19, CSP = 20, MAP = 21;
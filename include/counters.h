@@ -0,0 +1,69 @@
+#pragma once
+
+#include "constants.h"
+
+#define COUNTER_CYCLES        0
+#define COUNTER_INSTRUCTIONS  1
+#define COUNTER_LLC_MISSES    2
+#define COUNTERS              3
+
+// Bytes moved between the last level cache and memory by each miss
+#define COUNTER_LINE_BYTES  64
+
+/**
+ * @brief  Hardware counter values, summed over every thread counting them. A counter the kernel or the CPU does
+ *         not provide is -1.
+ */
+struct CounterSample
+{
+  int64_t values[COUNTERS];
+
+  /**
+   * @brief  Empty constructor, every counter unavailable.
+   */
+  CounterSample();
+};
+
+/**
+ * @brief  Selects whether the threads count cycles, instructions and last level cache misses with perf_event_open.
+ *         When the kernel refuses the counters (no PMU, or perf_event_paranoid too high), a single warning is
+ *         printed and every sample is unavailable.
+ *
+ * @param  enabled: Whether to count.
+ */
+void counters_select(bool enabled);
+
+/**
+ * @brief  Whether counting was selected and the counters could be opened so far.
+ *
+ * @retval bool
+ */
+bool counters_enabled();
+
+/**
+ * @brief  Starts counting the user-space events of the calling thread, once per thread, in a scope shared by the
+ *         threads of one scene: its pool threads, which attach when they start, and the thread calling the pool.
+ *         Every thread whose work should be counted must call it before that work. A thread attached again only
+ *         moves to the new scope.
+ *
+ * @param  scope: Pool the thread works for, NULL before any.
+ */
+void counters_attach(const void *scope);
+
+/**
+ * @brief  Current values of the counters of the threads in the scope of the calling thread, those already finished
+ *         included, scaled up when the kernel multiplexed them. Concurrent batch jobs have their own pools, so a
+ *         stage only counts the work of its own scene.
+ *
+ * @retval CounterSample
+ */
+CounterSample counters_read();
+
+/**
+ * @brief  Counts between two samples, unavailable where either sample is.
+ *
+ * @param  initial: Sample taken first.
+ * @param  final: Sample taken last.
+ * @retval CounterSample
+ */
+CounterSample counters_delta(CounterSample initial, CounterSample final);
@@ -3,9 +3,12 @@
 #include "utils.h"
 #include "constants.h"
 #include "candidate.h"
+#include "quantiles.h"
+#include "pyramid.h"
+#include "precision.h"
 
 /**
- * @brief Calculates the four quartiles of a vector. CPU version.
+ * @brief Calculates the three quartiles of a vector, with the quantile engine. CPU version.
  *
  * @param target: Vector to be calculated the quartiles.
  * @param v_quartile: Vector to store the quartiles.
@@ -20,8 +23,172 @@
 void get_quartiles(float *target, float *v_quartile, int height_band, int width_band, float first_interval, float middle_interval, float last_interval);
 
 /**
- * @brief Get the hot pixel based on the STEPP algorithm. CPU version.
+ * @brief  Selects how many hot and how many cold candidates are kept by the endmembers search, the best ranked
+ *         ones. Collection memory stays bounded, and the result is the same as keeping every candidate unless
+ *         the chosen pixels fall outside the kept ones.
  *
+ * @param  limit: Candidates kept per list, 0 keeps every one.
+ */
+void candidate_limit_select(int limit);
+
+/**
+ * @brief  Candidates kept per list currently selected.
+ *
+ * @retval Number of candidates, 0 for every one.
+ */
+int candidate_limit();
+
+#define METHOD_SEBAL          0
+#define METHOD_STEEP          1
+#define METHOD_SECOND_FILTER  2
+
+/**
+ * @brief  SEBAL endmembers filter. The quartiles of every raster are the 25th, 50th and 75th percentiles.
+ *         Each strategy gives the percentiles of the NDVI, albedo and surface temperature quartiles, the hot and
+ *         cold candidate tests (whose literal thresholds take the constant type of a precision policy), and a second
+ *         filter applied to the candidate lists.
+ */
+struct SEBAL
+{
+  static const float intervals[9];
+
+  template <typename Policy>
+  static bool is_hot(float ndvi, float surface_temperature, float albedo, const float *ndviQuartile, const float *tsQuartile, const float *albedoQuartile)
+  {
+    typedef typename Policy::constant K;
+
+    bool hotNDVI = !std::isnan(ndvi) && ndvi > K(0.10) && ndvi < ndviQuartile[0];
+    bool hotAlbedo = !std::isnan(albedo) && albedo > albedoQuartile[1];
+    bool hotTS = !std::isnan(surface_temperature) && surface_temperature > tsQuartile[1];
+
+    return hotAlbedo && hotNDVI && hotTS;
+  }
+
+  template <typename Policy>
+  static bool is_cold(float ndvi, float surface_temperature, float albedo, const float *ndviQuartile, const float *tsQuartile, const float *albedoQuartile)
+  {
+    bool coldNDVI = !std::isnan(ndvi) && ndvi > ndviQuartile[2];
+    bool coldAlbedo = !std::isnan(surface_temperature) && albedo < albedoQuartile[1];
+    bool coldTS = !std::isnan(albedo) && surface_temperature < tsQuartile[0];
+
+    return coldNDVI && coldAlbedo && coldTS;
+  }
+
+  static void second_filter(vector<Candidate> &, vector<Candidate> &) {}
+};
+
+/**
+ * @brief  STEEP endmembers filter, with narrower NDVI and surface temperature percentiles and bounded albedo ranges.
+ */
+struct STEEP
+{
+  static const float intervals[9];
+
+  template <typename Policy>
+  static bool is_hot(float ndvi, float surface_temperature, float albedo, const float *ndviQuartile, const float *tsQuartile, const float *albedoQuartile)
+  {
+    typedef typename Policy::constant K;
+
+    bool hotNDVI = !std::isnan(ndvi) && ndvi > K(0.10) && ndvi < ndviQuartile[0];
+    bool hotAlbedo = !std::isnan(albedo) && albedo > albedoQuartile[1] && albedo < albedoQuartile[2];
+    bool hotTS = !std::isnan(surface_temperature) && surface_temperature > tsQuartile[1] && surface_temperature < tsQuartile[2];
+
+    return hotAlbedo && hotNDVI && hotTS;
+  }
+
+  template <typename Policy>
+  static bool is_cold(float ndvi, float surface_temperature, float albedo, const float *ndviQuartile, const float *tsQuartile, const float *albedoQuartile)
+  {
+    bool coldNDVI = !std::isnan(ndvi) && ndvi > ndviQuartile[2];
+    bool coldAlbedo = !std::isnan(surface_temperature) && albedo > albedoQuartile[0] && albedo < albedoQuartile[1];
+    bool coldTS = !std::isnan(albedo) && surface_temperature < tsQuartile[0];
+
+    return coldNDVI && coldAlbedo && coldTS;
+  }
+
+  static void second_filter(vector<Candidate> &, vector<Candidate> &) {}
+};
+
+/**
+ * @brief  STEEP filter followed by a second filter on the candidate lists: only the hot candidates at or above
+ *         the median hot temperature, and the cold candidates at or below the median cold temperature, are kept.
+ */
+struct SecondFilter : STEEP
+{
+  static void second_filter(vector<Candidate> &hotCandidates, vector<Candidate> &coldCandidates);
+};
+
+/**
+ * @brief Calculates the NDVI, surface temperature and albedo quartiles used to filter the candidates.
+ *
+ * @tparam Method: SEBAL, STEEP or SecondFilter.
+ * @param ndvi: NDVI vector.
+ * @param surface_temperature: Surface temperature vector.
+ * @param albedo: Albedo vector.
+ * @param height_band: Band height.
+ * @param width_band: Band width.
+ * @param ndviQuartile: Vector to store the NDVI quartiles.
+ * @param tsQuartile: Vector to store the surface temperature quartiles.
+ * @param albedoQuartile: Vector to store the albedo quartiles.
+ * @param valid_mask: Valid mask of the rasters, or NULL.
+ * @param pool: Threads sharing the quantile passes, or NULL.
+ *
+ * @retval void
+ */
+template <typename Method>
+void get_endmember_quartiles(float *ndvi, float *surface_temperature, float *albedo, int height_band, int width_band, float *ndviQuartile, float *tsQuartile, float *albedoQuartile, const uint64_t *valid_mask, ThreadPool *pool);
+
+/**
+ * @brief  Uniform grid over candidates, each cell listing its candidates in rank order.
+ */
+struct CandidateGrid
+{
+  int cell_height, cell_width;
+  int grid_lines, grid_cols;
+  vector<int> cell_start;
+  vector<int> ranks;
+
+  /**
+   * @brief  Constructor. Buckets the candidates into cells no smaller than the window limits.
+   * @param  candidates: Candidates, already sorted by rank.
+   * @param  height_limit: Maximum line distance, exclusive.
+   * @param  width_limit: Maximum column distance, exclusive.
+   */
+  CandidateGrid(vector<Candidate> &candidates, int height_limit, int width_limit);
+
+  /**
+   * @brief  Index of the cell holding a pixel position.
+   */
+  int cell_of(int line, int col);
+
+  /**
+   * @brief  Best ranked candidate within the window limits of a pixel, searching its cell and the 8 neighbouring ones.
+   * @param  candidates: Candidates the grid was built from.
+   * @param  pixel: Pixel at the center of the window.
+   * @param  height_limit: Maximum line distance, exclusive.
+   * @param  width_limit: Maximum column distance, exclusive.
+   * @retval Index of the candidate, or -1 if none lies within the window.
+   */
+  int best_match(vector<Candidate> &candidates, Candidate pixel, int height_limit, int width_limit);
+};
+
+/**
+ * @brief Picks the hottest hot candidate having a cold candidate within the window limits, paired with the coldest
+ *        such cold candidate. Temperature ties are broken by NDVI and then by pixel order.
+ *
+ * @param hotCandidates: Hot pixel candidates, sorted in place by rank.
+ * @param coldCandidates: Cold pixel candidates, sorted in place by rank.
+ * @param height_limit: Maximum line distance, exclusive.
+ * @param width_limit: Maximum column distance, exclusive.
+ *
+ * @retval pair<Candidate, Candidate>
+ */
+pair<Candidate, Candidate> pair_endmembers(vector<Candidate> &hotCandidates, vector<Candidate> &coldCandidates, int height_limit, int width_limit);
+
+/**
+ * @brief Get the hot and cold pixels with the chosen method. CPU version.
+ *
+ * @param method: METHOD_SEBAL, METHOD_STEEP or METHOD_SECOND_FILTER.
  * @param ndvi: NDVI vector.
  * @param surface_temperature: Surface temperature vector.
  * @param albedo: Albedo vector.
@@ -29,13 +196,15 @@ void get_quartiles(float *target, float *v_quartile, int height_band, int width_
  * @param soil_heat: Soil heat flux vector.
  * @param height_band: Band height.
  * @param width_band: Band width.
+ * @param valid_mask: Valid mask of the rasters, whose words without a valid pixel are skipped, or NULL.
+ * @param pool: Threads sharing the quantile passes, or NULL.
  *
  * @retval Candidate
  */
-pair<Candidate, Candidate> getEndmembers(float *ndvi, float *surface_temperature, float *albedo, float *net_radiation, float *soil_heat, int height_band, int width_band, int height_limit, int width_limit);
+pair<Candidate, Candidate> getEndmembers(int method, float *ndvi, float *surface_temperature, float *albedo, float *net_radiation, float *soil_heat, int height_band, int width_band, int height_limit, int width_limit, const uint64_t *valid_mask, ThreadPool *pool);
 
 /**
- * @brief Get the hot and cold pixels based on the ASEBAL algorithm.
+ * @brief Get the hot and cold pixels based on the ASEBAL algorithm, the STEEP filter followed by the second filter.
  *
  * @param ndvi_vector: NDVI vector.
  * @param surface_temperature_vector: Surface temperature vector.
@@ -48,3 +217,23 @@ pair<Candidate, Candidate> getEndmembers(float *ndvi, float *surface_temperature
  * @retval Candidate
  */
 pair<Candidate, Candidate> endmembersSeconfFilter(float *ndvi, float *surface_temperature, float *albedo, float *net_radiation, float *soil_heat, int height_band, int width_band, int height_limit, int width_limit);
+
+/**
+ * @brief Get the hot and cold pixels with the chosen method, searching first on a reduced-resolution pyramid.
+ *        The quartiles are taken over the pyramid cells, and only the full resolution pixels of the cells whose
+ *        means pass the hot or cold tests become candidates. Falls back to getEndmembers when a list stays empty.
+ *
+ * @param method: METHOD_SEBAL, METHOD_STEEP or METHOD_SECOND_FILTER.
+ * @param pyramid: Finished pyramid of the NDVI, surface temperature and albedo.
+ * @param ndvi: NDVI vector.
+ * @param surface_temperature: Surface temperature vector.
+ * @param albedo: Albedo vector.
+ * @param net_radiation: Net radiation vector.
+ * @param soil_heat: Soil heat flux vector.
+ * @param height_band: Band height.
+ * @param width_band: Band width.
+ * @param pool: Threads sharing the quantile passes, or NULL.
+ *
+ * @retval Candidate
+ */
+pair<Candidate, Candidate> getEndmembersPyramid(int method, Pyramid &pyramid, float *ndvi, float *surface_temperature, float *albedo, float *net_radiation, float *soil_heat, int height_band, int width_band, int height_limit, int width_limit, ThreadPool *pool);
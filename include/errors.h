@@ -0,0 +1,32 @@
+#pragma once
+
+#include "constants.h"
+
+#include <stdexcept>
+#include <exception>
+
+/**
+ * @brief  Failure of one scene: an input that cannot be opened or read, an output that cannot be written, or no
+ *         endmembers. A single scene run reports it and exits with its code, a batch records it and goes on with the
+ *         other scenes.
+ */
+struct SceneError : runtime_error
+{
+  int code;
+
+  /**
+   * @brief  Constructor.
+   * @param  message: Description, in the "X problem! - ..." form.
+   * @param  code: Exit code of a single scene run.
+   */
+  SceneError(string message, int code);
+};
+
+/**
+ * @brief  Stops the scene being processed by throwing a SceneError. A throw from a pool worker reaches the thread
+ *         that called ThreadPool::parallel_for.
+ *
+ * @param  message: Description, in the "X problem! - ..." form.
+ * @param  code: Exit code of a single scene run.
+ */
+[[noreturn]] void scene_problem(string message, int code);
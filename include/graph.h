@@ -0,0 +1,77 @@
+#pragma once
+
+#include "constants.h"
+
+/**
+ * @brief  One stage of a chain of kernels, with the plane slots it reads and the ones it writes.
+ */
+struct StageNode
+{
+  string name;
+  vector<int> inputs;
+  vector<int> outputs;
+};
+
+/**
+ * @brief  Stages of a chain of kernels as a DAG over numbered plane slots, declared in execution order. Once planned
+ *         for a set of requested slots, a stage runs only when one of its outputs is consumed, and every slot that
+ *         is consumed gets a buffer. A buffer is handed to a later slot once the stages reading its previous slot
+ *         are done, so dead intermediates are aliased into later outputs. When planned compact, the intermediates
+ *         (neither sources nor requested) only take half of a buffer, two of them sharing one.
+ */
+struct StageGraph
+{
+  int planes_count;
+  vector<StageNode> stages;
+
+  vector<bool> active;
+  vector<int> buffer;
+  vector<int> half;
+  int buffers_count;
+
+  /**
+   * @brief  Empty constructor, a graph without stages where every stage runs.
+   */
+  StageGraph();
+
+  /**
+   * @brief  Constructor.
+   * @param  planes_count: Number of plane slots.
+   */
+  StageGraph(int planes_count);
+
+  /**
+   * @brief  Declares the next stage of the chain.
+   * @param  name: Stage name, as in the timing lines.
+   * @param  inputs: Slots read by the stage.
+   * @param  outputs: Slots written by the stage.
+   */
+  void add(string name, vector<int> inputs, vector<int> outputs);
+
+  /**
+   * @brief  Index of a stage.
+   * @param  name: Stage name.
+   * @retval The index, or -1 when there is no such stage.
+   */
+  int find(string name);
+
+  /**
+   * @brief  Computes the stages to run and the buffer of every slot. The sources are filled before the first stage
+   *         and are all live at once, the requested slots stay live after the last stage. A stage output that is
+   *         never consumed gets no buffer (-1), so the kernel must skip it. The half of every slot is -1 when it
+   *         takes the whole buffer, 0 or 1 when it takes the first or second half.
+   *
+   * @param  sources: Slots filled before the chain.
+   * @param  requested: Slots consumed after the chain.
+   * @param  stages_count: Number of leading stages that may run.
+   * @param  compact: Whether the intermediates take half a buffer.
+   */
+  void plan(vector<int> sources, vector<int> requested, int stages_count, bool compact);
+
+  /**
+   * @brief  Whether a stage runs. Every stage runs until the graph is planned.
+   * @param  stage: Stage index.
+   * @retval bool
+   */
+  bool runs(int stage);
+};
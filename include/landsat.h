@@ -7,6 +7,9 @@
 #include "constants.h"
 #include "endmembers.h"
 #include "parameters.h"
+#include "scheduler.h"
+#include "pyramid.h"
+#include "store.h"
 
 /**
  * @brief  Struct to manage the products calculation.
@@ -15,22 +18,39 @@ struct Landsat
 {
   TIFF *bands_resampled[9];
   uint16_t sample_bands;
+  uint16_t band_formats[8];
+  uint16_t band_bits[8];
   uint32_t height_band;
   uint32_t width_band;
+  GeoTags geo;
 
   Candidate hot_pixel;
   Candidate cold_pixel;
 
   MTL mtl;
   Products products;
+  ThreadPool *pool;
+
+  int pyramid_factor;
+  Pyramid pyramid;
+
+  ProductStore store;
+  bool restored;
 
   /**
-   * @brief  Constructor.
+   * @brief  Constructor. Opens the bands and reads their dimensions and sample formats (float32, uint16
+   *         or int16), and the georeferencing of the first band, the pixels are loaded by load_bands. The pyramid is
+   *         disabled until pyramid_factor is set, and the product store until store is set.
    * @param  bands_paths: Paths to the bands.
-   * @param  tal_path: Path to the TAL file.
-   * @param  land_cover_path: Path to the land cover file.
+   * @param  mtl: MTL struct.
+   * @param  pool: Threads running the product kernels, or NULL to run them serially.
+   */
+  Landsat(string bands_paths[], MTL mtl, ThreadPool *pool);
+
+  /**
+   * @brief  Closes the band files that are open.
    */
-  Landsat(string bands_paths[], MTL mtl);
+  void close_bands();
 
   /**
    * @brief  Destructor.
@@ -38,16 +58,207 @@ struct Landsat
   void close();
 
   /**
-   * @brief Compute the initial products.
-   * 
+   * @brief  Whether a band stores 32-bit floats, the layout of the products planes.
+   *
+   * @param  band: Index of the band in bands_resampled.
+   * @retval bool
+   */
+  bool is_float32(int band);
+
+  /**
+   * @brief  Bytes of the band files holding a number of pixels of each band, at their stored sample sizes.
+   *
+   * @param  pixels: Pixels read from every band.
+   * @retval int64_t
+   */
+  int64_t band_bytes(int64_t pixels);
+
+  /**
+   * @brief  Converts samples of a band to float. The band must be float32, uint16 or int16.
+   *
+   * @param  band: Index of the band in bands_resampled.
+   * @param  src: Samples as stored in the band.
+   * @param  dest: Output buffer.
+   * @param  count: Number of samples.
+   */
+  void convert_samples(int band, const void *src, float *dest, int count);
+
+  /**
+   * @brief  Stops the scene on a failed read of a band.
+   *
+   * @param  band: Index of the band in bands_resampled.
+   * @param  unit: What could not be read: strip or tile.
+   * @param  index: Index of the strip or tile.
+   */
+  void read_problem(int band, const char *unit, uint32_t index);
+
+  /**
+   * @brief  Reads a window of a strip-organized band, decoding only the strips the window overlaps. Float strips
+   *         inside a full-width window are decoded straight into dest, the others through a buffer that is widened to
+   *         float. Pixels outside the scene are set to NaN.
+   *
+   * @param  band: Index of the band in bands_resampled.
+   * @param  line: First line of the window.
+   * @param  col: First column of the window.
+   * @param  height: Window height.
+   * @param  width: Window width.
+   * @param  dest: Buffer of height * width floats.
+   */
+  void read_strips(int band, int line, int col, int height, int width, float *dest);
+
+  /**
+   * @brief  Reads a window of a tile-organized band, decoding only the tiles the window overlaps. Pixels outside the
+   *         scene are set to NaN.
+   *
+   * @param  band: Index of the band in bands_resampled.
+   * @param  line: First line of the window.
+   * @param  col: First column of the window.
+   * @param  height: Window height.
+   * @param  width: Window width.
+   * @param  dest: Buffer of height * width floats.
+   */
+  void read_tiles(int band, int line, int col, int height, int width, float *dest);
+
+  /**
+   * @brief  Reads a window of one input band, through its tiles or its strips. Pixels outside the scene are set to NaN.
+   *
+   * @param  band: Index of the band in bands_resampled (7 is the elevation).
+   * @param  line: First line of the window.
+   * @param  col: First column of the window.
+   * @param  height: Window height.
+   * @param  width: Window width.
+   * @param  dest: Buffer of height * width floats.
+   */
+  void read_window(int band, int line, int col, int height, int width, float *dest);
+
+  /**
+   * @brief  Reads the same window of the 7 bands and the elevation, one band per thread of the pool.
+   *
+   * @param  line: First line of the window.
+   * @param  col: First column of the window.
+   * @param  height: Window height.
+   * @param  width: Window width.
+   * @param  dests: 8 buffers of height * width floats, in bands_resampled order.
+   */
+  void read_windows(int line, int col, int height, int width, float *dests[]);
+
+  /**
+   * @brief Load the whole bands and the elevation into the products, with the planes planned for the Rn/G chain of a
+   *        staged scene (Products::staged_outputs).
+   *
+   * @return string with the time spent.
+   */
+  string load_bands();
+
+  /**
+   * @brief Compute the initial products. With a pyramid_factor, the pyramid of NDVI, surface temperature and albedo
+   *        is reduced once the chain is done.
+   *
+   * @param  station: Station struct.
+   * @param  fused: Whether the chain runs in a single blocked sweep instead of one pass per product.
+   * @return string with the time spent.
+   */
+  string compute_Rn_G(Station station, bool fused);
+
+  /**
+   * @brief Reduces the NDVI, surface temperature and albedo of the whole scene into the pyramid.
+   *
+   * @return string with the time spent.
+   */
+  string build_pyramid();
+
+  /**
+   * @brief Points the products planes kept by a stage of the store (NDVI, albedo and surface temperature, plus net
+   *        radiation and soil heat flux for STORE_STAGE_RN_G) at their slots.
+   *
+   * @param  stage: Stage name.
+   * @param  planes: Output, the addresses of the products planes.
+   * @return Number of planes.
+   */
+  int store_planes(string stage, float **planes[]);
+
+  /**
+   * @brief Maps the planes of a stage from the product store instead of computing them, and sets restored when they
+   *        were found. The bands are not loaded, so the crop must be read from the files. With a pyramid_factor, the
+   *        pyramid of STORE_STAGE_RN_G is reduced from the mapped planes.
+   *
+   * @param  stage: Stage name.
+   * @return string with the time spent.
+   */
+  string restore_products(string stage);
+
+  /**
+   * @brief Writes the planes of a stage to the product store, for the next runs on the scene.
+   *
+   * @param  stage: Stage name.
+   * @return string with the time spent.
+   */
+  string save_products(string stage);
+
+  /**
+   * @brief Compute the initial products strip by strip, reading the rows straight from the bands.
+   *        Only NDVI, albedo, surface temperature, net radiation and soil heat flux are kept for the
+   *        whole scene, every other plane is sized to a single strip. Those 5 planes are what the endmembers
+   *        selection reads, so the memory of a streamed scene is bounded by the strip size except for them, and
+   *        still grows with the scene. With a pyramid_factor, each strip is added to the pyramid as soon as it is
+   *        computed.
+   *
+   * @param  station: Station struct.
+   * @param  tile_rows: Number of rows per strip.
+   * @return string with the time spent.
+   */
+  string compute_Rn_G_streaming(Station station, int tile_rows);
+
+  /**
+   * @brief Reads one strip of rows of the 8 bands into a strip-sized Products and runs the leading stages of the chain on it.
+   *
+   * @param  tile: Products sized to the strip.
+   * @param  station: Station struct.
+   * @param  first_line: First line of the strip.
+   * @param  lines: Number of lines of the strip.
+   * @param  stages_count: Number of leading stages to run, RN_G_STAGES for the whole chain.
+   * @param  stage_time: RN_G_STAGES accumulators of the time spent on each stage, in nanoseconds.
+   * @param  read_time: Accumulator of the time spent reading the bands, in nanoseconds.
+   * @retval Pixels of the strip calibrated, before the calibration cleared mask words.
+   */
+  int64_t compute_strip(Products &tile, Station station, int first_line, int lines, int stages_count, int64_t *stage_time, int64_t *read_time);
+
+  /**
+   * @brief Compute only the NDVI, albedo and surface temperature of the whole scene, strip by strip. These are the
+   *        inputs of the endmembers quartiles, every other plane is sized to a single strip.
+   *
+   * @param  station: Station struct.
+   * @param  tile_rows: Number of rows per strip.
+   * @return string with the time spent.
+   */
+  string compute_quartile_inputs(Station station, int tile_rows);
+
+  /**
+   * @brief Hot and cold endmembers of one method from the planes of compute_quartile_inputs.
+   *
+   * @tparam Method: SEBAL, STEEP or SecondFilter.
+   * @tparam Policy: Precision policy of the candidate tests.
+   * @param  station: Station struct.
+   * @param  tile_rows: Number of rows per strip.
+   * @return pair with the hot and the cold pixels.
+   */
+  template <typename Method, typename Policy>
+  pair<Candidate, Candidate> stream_endmembers(Station station, int tile_rows, int height_limit, int width_limit);
+
+  /**
+   * @brief Select the cold and hot endmembers from the planes of compute_quartile_inputs. The net radiation and soil
+   *        heat flux of the candidates are recomputed only for the strips that hold one.
+   *
    * @param  station: Station struct.
+   * @param  tile_rows: Number of rows per strip.
+   * @param  method: Method to select the endmembers (METHOD_SEBAL, METHOD_STEEP or METHOD_SECOND_FILTER).
    * @return string with the time spent.
    */
-  string compute_Rn_G(Station station);
+  string select_endmembers_streaming(Station station, int tile_rows, int method, int height_limit, int width_limit);
 
   /**
-   * @brief Select the cold and hot endmembers
-   * 
+   * @brief Select the cold and hot endmembers, through the pyramid when one was built.
+   *
    * @param  method: Method to select the endmembers.
    * @return string with the time spent.
    */
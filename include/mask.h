@@ -0,0 +1,36 @@
+#pragma once
+
+#include "constants.h"
+#include "scheduler.h"
+
+/**
+ * @brief  Number of 64-bit words of a packed mask of size pixels. Pixel i is bit i % 64 of word i / 64.
+ *
+ * @param  size: Number of pixels.
+ * @retval Number of words.
+ */
+int mask_words(int size);
+
+/**
+ * @brief  Builds a packed mask with the bit of a pixel set when at least one of the bands holds a positive sample
+ *         there. Pixels where every band is NaN or a digital number of 0 (or less) are scene fill, every product
+ *         computed from them is NaN.
+ *
+ * @param  bands: Bands of size pixels each.
+ * @param  bands_count: Number of bands.
+ * @param  size: Number of pixels.
+ * @param  mask: Output, mask_words(size) words.
+ * @param  pool: Threads sharing the words, or NULL.
+ */
+void build_valid_mask(float **bands, int bands_count, int size, uint64_t *mask, ThreadPool *pool);
+
+/**
+ * @brief  Runs body over the runs of [start, end) made of whole mask words holding at least one valid pixel,
+ *         clipped to the range. Words without a valid pixel are skipped.
+ *
+ * @param  mask: Packed mask, or NULL to run body over the whole range.
+ * @param  start: First pixel index.
+ * @param  end: Pixel index after the last one.
+ * @param  body: Function receiving the [start, end) of each run.
+ */
+void valid_runs(const uint64_t *mask, int start, int end, function<void(int, int)> body);
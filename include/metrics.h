@@ -0,0 +1,124 @@
+#pragma once
+
+#include "constants.h"
+#include "counters.h"
+
+/**
+ * @brief  Process CPU time and hardware counters, either as read at some point or as spent between two points.
+ */
+struct MetricsSample
+{
+  int64_t cpu_time;
+  CounterSample counters;
+
+  /**
+   * @brief  Empty constructor, nothing measured.
+   */
+  MetricsSample();
+
+  /**
+   * @brief  Constructor, a CPU time known without counters.
+   * @param  cpu_time: CPU time, in nanoseconds.
+   */
+  MetricsSample(int64_t cpu_time);
+};
+
+/**
+ * @brief  Measurements of one stage of a scene, as recorded next to its timing line.
+ */
+struct StageMetric
+{
+  string scene;
+  string backend;
+  string stage;
+  int thread;
+  int64_t wall_time;
+  int64_t cpu_time;
+  int64_t initial_time;
+  int64_t final_time;
+  int64_t pixels;
+  int64_t bytes_read;
+  int64_t bytes_written;
+  int64_t peak_rss;
+  CounterSample counters;
+  bool summed;
+};
+
+/**
+ * @brief  Selects the outputs of the metrics registry. Nothing is recorded while both paths are empty.
+ *
+ * @param  metrics_path: File receiving one record per stage, JSON when it ends in .json and CSV otherwise. Empty for none.
+ * @param  trace_path: File receiving the stages and the pool threads activity in the Chrome trace event format. Empty for none.
+ */
+void metrics_select(string metrics_path, string trace_path);
+
+/**
+ * @brief  Whether the stages are being recorded, for either output.
+ *
+ * @retval bool
+ */
+bool metrics_enabled();
+
+/**
+ * @brief  Whether the pool threads activity is being recorded, for the trace output.
+ *
+ * @retval bool
+ */
+bool metrics_tracing();
+
+/**
+ * @brief  CPU time consumed by the whole process so far, and counters of the threads of the calling thread's scene:
+ *         itself and its pool.
+ *
+ * @retval MetricsSample, nothing measured while the stages are not recorded.
+ */
+MetricsSample metrics_sample();
+
+/**
+ * @brief  CPU time and counters spent since a sample.
+ *
+ * @param  initial: Sample taken at the start of a stage.
+ * @retval MetricsSample
+ */
+MetricsSample metrics_since(MetricsSample initial);
+
+/**
+ * @brief  Labels the stages recorded from now on by the calling thread with a scene, so the scenes of a batch can be
+ *         told apart.
+ *
+ * @param  scene: Scene label, the output folder.
+ */
+void metrics_scene(string scene);
+
+/**
+ * @brief  Records one stage run by the calling thread, along with the peak resident memory of the process so far.
+ *         The counters of a stage only include the threads of its scene, but its CPU time is that of the whole process,
+ *         other scenes of a batch running at the time included.
+ *
+ * @param  backend: Backend of the timing line.
+ * @param  stage: Stage name of the timing line.
+ * @param  wall_time: Time spent on the stage, in nanoseconds.
+ * @param  usage: Process CPU time and counters spent during the stage, -1 where they were not measured.
+ * @param  initial_time: Start of the stage, nanoseconds since the epoch.
+ * @param  final_time: End of the stage, nanoseconds since the epoch.
+ * @param  pixels: Pixels processed.
+ * @param  bytes_read: Bytes of the planes read.
+ * @param  bytes_written: Bytes of the planes written.
+ * @param  summed: Whether wall_time is summed over the blocks of a sweep, instead of spanning initial to final time.
+ */
+void metrics_record(string backend, string stage, int64_t wall_time, MetricsSample usage, int64_t initial_time, int64_t final_time,
+                    int64_t pixels, int64_t bytes_read, int64_t bytes_written, bool summed = false);
+
+/**
+ * @brief  Records the span of a pool thread running the chunks of one loop, only kept for the trace output.
+ *
+ * @param  initial_time: Start of the first chunk, nanoseconds since the epoch.
+ * @param  final_time: End of the last chunk, nanoseconds since the epoch.
+ * @param  chunks: Chunks run by the thread.
+ */
+void metrics_worker(int64_t initial_time, int64_t final_time, int chunks);
+
+/**
+ * @brief  Writes every record to the selected outputs.
+ */
+void metrics_write();
@@ -1,12 +1,14 @@
 #pragma once
 
 #include "constants.h"
+#include "errors.h"
 
 /**
  * @brief  Struct to hold some metadata informations.
  */
 struct MTL
 {
+  string scene_id;
   float image_hour;
   int number_sensor, julian_day, year;
   float sun_elevation, distance_earth_sun;
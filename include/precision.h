@@ -0,0 +1,131 @@
+#pragma once
+
+#include "constants.h"
+
+#define PRECISION_MIXED       0
+#define PRECISION_FLOAT       1
+#define PRECISION_ACCUMULATE  2
+#define PRECISION_DOUBLE      3
+
+#define COMPACT_NONE  0
+#define COMPACT_FP16  1
+#define COMPACT_BF16  2
+
+// Policy selected before any -precision= flag, set at build time with -DPRECISION_DEFAULT=...
+#ifndef PRECISION_DEFAULT
+#define PRECISION_DEFAULT PRECISION_MIXED
+#endif
+
+/**
+ * @brief  Precision policy of the product kernels and the endmembers search. The planes are stored as Storage, the
+ *         pixels are loaded as Compute for the arithmetic, the literal constants are Constant (so a double literal
+ *         promotes the expression it appears in), and the albedo and net radiation sums are accumulated as
+ *         Accumulate. Every policy stores float planes, the layout of Products, the store and the outputs.
+ */
+template <typename Storage, typename Compute, typename Constant, typename Accumulate>
+struct PrecisionPolicy
+{
+  typedef Storage storage;
+  typedef Compute compute;
+  typedef Constant constant;
+  typedef Accumulate accumulate;
+};
+
+// The original float/double mix: float pixels and sums, double literals
+typedef PrecisionPolicy<float, float, double, float> MixedPrecision;
+
+// Float arithmetic throughout
+typedef PrecisionPolicy<float, float, float, float> FloatPrecision;
+
+// Float arithmetic, with the albedo and net radiation sums in double
+typedef PrecisionPolicy<float, float, float, double> AccumulatePrecision;
+
+// Double arithmetic, the results rounded to float when stored
+typedef PrecisionPolicy<float, double, double, double> DoublePrecision;
+
+/**
+ * @brief  Selects the precision policy of the product kernels and the endmembers search.
+ *
+ * @param  policy: PRECISION_MIXED, PRECISION_FLOAT, PRECISION_ACCUMULATE or PRECISION_DOUBLE.
+ */
+void precision_select(int policy);
+
+/**
+ * @brief  Precision policy currently selected, PRECISION_DEFAULT until precision_select is called.
+ *
+ * @retval PRECISION_MIXED, PRECISION_FLOAT, PRECISION_ACCUMULATE or PRECISION_DOUBLE.
+ */
+int precision_policy();
+
+/**
+ * @brief  Name of a precision policy, as accepted by the -precision= flag.
+ *
+ * @param  policy: PRECISION_MIXED, PRECISION_FLOAT, PRECISION_ACCUMULATE or PRECISION_DOUBLE.
+ * @retval "mixed", "float", "accumulate" or "double".
+ */
+string precision_name(int policy);
+
+/**
+ * @brief  Precision policy of a -precision= flag value.
+ *
+ * @param  name: "mixed", "float", "accumulate" or "double".
+ * @retval The policy, or -1 for an unknown name.
+ */
+int precision_parse(string name);
+
+/**
+ * @brief  Selects the storage of the intermediate planes of the Rn/G chain, the ones neither filled before the chain
+ *         nor read after it. COMPACT_FP16 and COMPACT_BF16 store them in 16 bits, two to a float plane, rounding
+ *         every value a stage writes, while the kernels still compute and accumulate at their own precision.
+ *
+ * @param  format: COMPACT_NONE, COMPACT_FP16 or COMPACT_BF16.
+ */
+void compact_select(int format);
+
+/**
+ * @brief  Storage of the intermediate planes currently selected, COMPACT_NONE until compact_select is called.
+ *
+ * @retval COMPACT_NONE, COMPACT_FP16 or COMPACT_BF16.
+ */
+int compact_format();
+
+/**
+ * @brief  Name of a storage of the intermediate planes, as accepted by the -compact= flag.
+ *
+ * @param  format: COMPACT_NONE, COMPACT_FP16 or COMPACT_BF16.
+ * @retval "none", "fp16" or "bf16".
+ */
+string compact_name(int format);
+
+/**
+ * @brief  Storage of the intermediate planes of a -compact= flag value.
+ *
+ * @param  name: "none", "fp16" or "bf16".
+ * @retval The format, or -1 for an unknown name.
+ */
+int compact_parse(string name);
+
+/**
+ * @brief  Calls body with a value of the selected policy type, so that a generic lambda instantiates its templates
+ *         for that policy.
+ *
+ * @param  body: Callable taking MixedPrecision, FloatPrecision, AccumulatePrecision and DoublePrecision.
+ */
+template <typename Body>
+void precision_dispatch(Body body)
+{
+  switch (precision_policy())
+  {
+  case PRECISION_FLOAT:
+    body(FloatPrecision());
+    break;
+  case PRECISION_ACCUMULATE:
+    body(AccumulatePrecision());
+    break;
+  case PRECISION_DOUBLE:
+    body(DoublePrecision());
+    break;
+  default:
+    body(MixedPrecision());
+  }
+}
@@ -4,6 +4,14 @@
 #include "candidate.h"
 #include "constants.h"
 #include "parameters.h"
+#include "scheduler.h"
+#include "simd.h"
+#include "vmath.h"
+#include "mask.h"
+#include "arena.h"
+#include "graph.h"
+#include "precision.h"
+#include "metrics.h"
 
 /**
  * @brief  Struct to manage the products calculation.
@@ -13,6 +21,19 @@ struct Products
   int nBytes_band;
   uint32_t width_band;
   uint32_t height_band;
+  uint64_t capacity;
+
+  ThreadPool *pool;
+  uint64_t *valid_mask;
+  Arena arena;
+  vector<int> layout;
+  vector<int> halves;
+  StageGraph graph;
+  int compact;
+  vector<uint16_t *> packed;
+
+  void *mapping;
+  size_t mapping_size;
 
   float H_pf_terra;
   float H_pq_terra;
@@ -63,22 +84,287 @@ struct Products
   float *large_wave_radiation_atmosphere;
 
   /**
-   * @brief  Constructor.
+   * @brief  Empty constructor, no plane is allocated.
    */
   Products();
 
   /**
-   * @brief  Constructor.
+   * @brief  Constructor, every plane and the valid mask are carved from the arena.
    * @param  width_band: Band width.
    * @param  height_band: Band height.
    */
   Products(uint32_t width_band, uint32_t height_band);
 
   /**
-   * @brief  Destructor.
+   * @brief  Destructor. Releases the arena holding every plane, or only the mapping when the planes are views of a
+   *         product store.
    */
   void close();
 
+  /**
+   * @brief  Addresses of every plane pointer, NULL or not.
+   * @retval vector<float **>
+   */
+  vector<float **> planes();
+
+  /**
+   * @brief  Sizes the products to width_band x height_band pixels, with the given planes allocated. The planes are
+   *         carved from the arena, which is kept as long as the scene is not larger and no plane is missing, so a
+   *         Products can be handed from one scene to the next without allocating again. Otherwise every plane held
+   *         is carved again from a reset (or larger) arena, without keeping its contents.
+   * @param  width_band: Band width.
+   * @param  height_band: Band height.
+   * @param  planes: Addresses of the plane pointers needed.
+   * @param  count: Number of planes.
+   */
+  void reserve(uint32_t width_band, uint32_t height_band, float **planes[], int count);
+
+  /**
+   * @brief  Same as reserve for every plane and the valid mask, the layout of the constructor.
+   * @param  width_band: Band width.
+   * @param  height_band: Band height.
+   */
+  void reserve_all(uint32_t width_band, uint32_t height_band);
+
+  /**
+   * @brief  Same as reserve_all with only the planes the Rn/G chain needs to produce the requested ones, and the
+   *         planes whose lifetimes do not overlap sharing a buffer. The bands, the elevation and tal are always
+   *         carved, and the stages producing nothing requested are skipped by the chain. With a compact format
+   *         selected, the intermediates are packed planes of 16-bit values instead, two sharing a buffer.
+   * @param  width_band: Band width.
+   * @param  height_band: Band height.
+   * @param  requested: Addresses of the plane pointers read after the chain.
+   * @param  count: Number of requested planes.
+   * @param  stages_count: Number of leading stages of the chain that will run, RN_G_STAGES for the whole chain.
+   */
+  void plan(uint32_t width_band, uint32_t height_band, float **requested[], int count, int stages_count);
+
+  /**
+   * @brief  Carves the buffers of a layout, and the valid mask when asked, for reserve, reserve_all and plan.
+   *         Nothing is carved again when the scene is not larger and the layout is the one held.
+   * @param  width_band: Band width.
+   * @param  height_band: Band height.
+   * @param  layout: Buffer of each plane of planes(), -1 for none. Planes with the same buffer share it.
+   * @param  halves: Half of its buffer holding each plane as a packed plane, -1 for a float plane.
+   * @param  with_mask: Whether the valid mask is carved too.
+   */
+  void carve(uint32_t width_band, uint32_t height_band, vector<int> layout, vector<int> halves, bool with_mask);
+
+  /**
+   * @brief  Declares the stages of the Rn/G chain, in the order of rn_g_fused_kernel, over the slots of planes().
+   * @retval StageGraph, not planned.
+   */
+  StageGraph rn_g_graph();
+
+  /**
+   * @brief  Declares the Rn/G chain and plans it for the requested planes, the bands, the elevation and tal being
+   *         filled before the chain. Nothing is carved.
+   * @param  requested: Addresses of the plane pointers read after the chain.
+   * @param  count: Number of requested planes.
+   * @param  stages_count: Number of leading stages of the chain that will run.
+   * @retval StageGraph, planned.
+   */
+  StageGraph rn_g_plan(float **requested[], int count, int stages_count);
+
+  /**
+   * @brief  Points the planes read after the chain of a staged scene at their slots: NDVI, albedo, surface
+   *         temperature, net radiation and soil heat flux for the endmembers, and the bands and elevation for the crop.
+   * @param  planes: Output, the addresses of the plane pointers.
+   * @retval Number of planes.
+   */
+  int staged_outputs(float **planes[]);
+
+  /**
+   * @brief  Builds the valid mask from the seven bands, and sets every product of the mask words without a
+   *         valid pixel to NaN, since the kernels skip them.
+   */
+  void update_valid_mask();
+
+  /**
+   * @brief  Clears the valid mask words of [first_word, last_word) where the calibration left every reflectance NaN
+   *         (values of 0 or less), and sets the products of the later stages to NaN there, since the kernels of those
+   *         stages skip them.
+   * @param  first_word: First mask word.
+   * @param  last_word: Mask word after the last one.
+   */
+  void refresh_valid_mask(int first_word, int last_word);
+
+  /**
+   * @brief  Runs a kernel over every pixel, split in row blocks among the pool threads when there is a pool.
+   *         With a valid mask, the mask words without a valid pixel are skipped.
+   * @param  kernel: Function receiving the [start, end) of a block.
+   */
+  void parallel_kernel(function<void(int, int)> kernel);
+
+  /**
+   * @brief  Runs one stage of the Rn/G chain over the pixels [start, end). When the stage reads or writes packed
+   *         planes, it runs block by block on a view of the products whose packed planes are float buffers: the
+   *         packed inputs are widened into them before the block, and the packed outputs are rounded back after.
+   * @tparam Body: Callable taking the products to compute on and the [first, last) pixels.
+   * @param  stage: Index of the stage in the planned graph, -1 when it is not in the graph.
+   * @param  start: First pixel index.
+   * @param  end: Pixel index after the last one.
+   * @param  body: Stage kernel.
+   */
+  template <typename Body>
+  void packed_kernel(int stage, int start, int end, Body body);
+
+  /**
+   * @brief  Pixels the kernels run over: those of the valid mask words with a valid pixel, every pixel without a mask.
+   * @retval Number of pixels.
+   */
+  int64_t processed_pixels();
+
+  /**
+   * @brief  Bytes per pixel of the planes a stage of the Rn/G chain reads or writes, 4 for a float plane and 2 for a
+   *         packed one. Outputs without a buffer are not written.
+   * @param  stage: Index of the stage in the chain.
+   * @param  written: Whether to count the outputs instead of the inputs.
+   * @retval Bytes per pixel.
+   */
+  int64_t stage_pixel_bytes(int stage, bool written);
+
+  /**
+   * @brief  Records the metrics of a stage of the Rn/G chain run over the processed pixels.
+   * @param  name: Stage name.
+   * @param  general_time: Time spent on the stage, in nanoseconds.
+   * @param  usage: Process CPU time and counters spent on the stage.
+   * @param  initial_time: Start of the stage.
+   * @param  final_time: End of the stage.
+   * @param  pixels: Pixels processed.
+   * @param  summed: Whether general_time is summed over the blocks of a sweep.
+   */
+  void record_stage(string name, int64_t general_time, MetricsSample usage, int64_t initial_time, int64_t final_time, int64_t pixels, bool summed);
+
+  /**
+   * @brief  Name of the backend running the kernels, used as the first field of the timing lines.
+   */
+  string backend();
+
+  /**
+   * @brief  The spectral radiance for each band is computed over the pixels [start, end).
+   * @tparam Policy: Precision policy of the arithmetic.
+   * @param  mtl: MTL struct.
+   * @param  start: First pixel index.
+   * @param  end: Pixel index after the last one.
+   */
+  template <typename Policy>
+  void radiance_kernel(MTL mtl, int start, int end);
+
+  /**
+   * @brief  The spectral reflectance for each band is computed over the pixels [start, end).
+   * @tparam Policy: Precision policy of the arithmetic.
+   * @param  mtl: MTL struct.
+   * @param  start: First pixel index.
+   * @param  end: Pixel index after the last one.
+   */
+  template <typename Policy>
+  void reflectance_kernel(MTL mtl, int start, int end);
+
+  /**
+   * @brief  The surface albedo is computed over the pixels [start, end).
+   * @tparam Policy: Precision policy of the arithmetic.
+   * @param  mtl: MTL struct.
+   * @param  start: First pixel index.
+   * @param  end: Pixel index after the last one.
+   */
+  template <typename Policy>
+  void albedo_kernel(MTL mtl, int start, int end);
+
+  /**
+   * @brief  The NDVI is computed over the pixels [start, end).
+   * @tparam Policy: Precision policy of the arithmetic.
+   */
+  template <typename Policy>
+  void ndvi_kernel(int start, int end);
+
+  /**
+   * @brief  The PAI is computed over the pixels [start, end).
+   * @tparam Policy: Precision policy of the arithmetic.
+   */
+  template <typename Policy>
+  void pai_kernel(int start, int end);
+
+  /**
+   * @brief  The SAVI and LAI are computed over the pixels [start, end).
+   * @tparam Policy: Precision policy of the arithmetic.
+   */
+  template <typename Policy>
+  void lai_kernel(int start, int end);
+
+  /**
+   * @brief  The EVI is computed over the pixels [start, end).
+   * @tparam Policy: Precision policy of the arithmetic.
+   */
+  template <typename Policy>
+  void evi_kernel(int start, int end);
+
+  /**
+   * @brief  The emissivity is computed over the pixels [start, end).
+   * @tparam Policy: Precision policy of the arithmetic.
+   */
+  template <typename Policy>
+  void enb_emissivity_kernel(int start, int end);
+
+  /**
+   * @brief  The emissivity is computed over the pixels [start, end).
+   * @tparam Policy: Precision policy of the arithmetic.
+   */
+  template <typename Policy>
+  void eo_emissivity_kernel(int start, int end);
+
+  /**
+   * @brief  The emissivity is computed over the pixels [start, end).
+   * @tparam Policy: Precision policy of the arithmetic.
+   */
+  template <typename Policy>
+  void ea_emissivity_kernel(int start, int end);
+
+  /**
+   * @brief  The surface temperature is computed over the pixels [start, end).
+   * @tparam Policy: Precision policy of the arithmetic.
+   * @param  mtl: MTL struct.
+   */
+  template <typename Policy>
+  void surface_temperature_kernel(MTL mtl, int start, int end);
+
+  /**
+   * @brief  The short wave radiation is computed over the pixels [start, end).
+   * @tparam Policy: Precision policy of the arithmetic.
+   * @param  mtl: MTL struct.
+   */
+  template <typename Policy>
+  void short_wave_radiation_kernel(MTL mtl, int start, int end);
+
+  /**
+   * @brief  The large wave radiation is computed over the pixels [start, end).
+   * @tparam Policy: Precision policy of the arithmetic.
+   */
+  template <typename Policy>
+  void large_wave_radiation_surface_kernel(int start, int end);
+
+  /**
+   * @brief  The large wave radiation is computed over the pixels [start, end).
+   * @tparam Policy: Precision policy of the arithmetic.
+   * @param  temperature: Pixel's temperature.
+   */
+  template <typename Policy>
+  void large_wave_radiation_atmosphere_kernel(float temperature, int start, int end);
+
+  /**
+   * @brief  The net radiation is computed over the pixels [start, end).
+   * @tparam Policy: Precision policy of the arithmetic.
+   */
+  template <typename Policy>
+  void net_radiation_kernel(int start, int end);
+
+  /**
+   * @brief  The soil heat flux is computed over the pixels [start, end).
+   * @tparam Policy: Precision policy of the arithmetic.
+   */
+  template <typename Policy>
+  void soil_heat_flux_kernel(int start, int end);
+
   /**
    * @brief  The spectral radiance for each band is computed.
    * @param  mtl: MTL struct.
@@ -165,4 +451,45 @@ struct Products
    * @brief  The soil heat flux is computed.
    */
   string soil_heat_flux_function();
+
+  /**
+   * @brief  The whole chain, from radiance to soil heat flux, is computed over the pixels [start, end).
+   *         Every stage runs over one block of FUSED_BLOCK_SIZE pixels before moving to the next block,
+   *         so the results are the same as calling each function in sequence. Stages the planned graph skips
+   *         are not run.
+   * @param  mtl: MTL struct.
+   * @param  temperature: Station temperature at the image time.
+   * @param  stages_count: Number of leading stages to run, RN_G_STAGES for the whole chain.
+   * @param  stage_time: RN_G_STAGES accumulators, in nanoseconds, incremented by the time spent on each stage.
+   */
+  void rn_g_fused_kernel(MTL mtl, float temperature, int stages_count, int start, int end, int64_t *stage_time);
+
+  /**
+   * @brief  The whole chain is computed over every pixel, with row blocks spread among the pool threads.
+   * @param  mtl: MTL struct.
+   * @param  temperature: Station temperature at the image time.
+   * @param  stages_count: Number of leading stages to run, RN_G_STAGES for the whole chain.
+   * @param  stage_time: RN_G_STAGES accumulators, in nanoseconds, incremented by the time every thread spent on each stage.
+   */
+  void rn_g_fused_sweep(MTL mtl, float temperature, int stages_count, int64_t *stage_time);
+
+  /**
+   * @brief  Formats the accumulated stage times of the fused chain, skipping the stages that did not run.
+   * @param  stage_time: Time spent on each stage, in nanoseconds.
+   * @param  stages_count: Number of leading stages that were run.
+   * @param  initial_time: Start of the sweep.
+   * @param  final_time: End of the sweep.
+   * @param  calibrated_pixels: Pixels processed by the calibration stages, recorded with them.
+   * @param  pixels: Pixels processed by the later stages, recorded with each of them.
+   * @return string with one line per stage.
+   */
+  string rn_g_stage_timing(int64_t *stage_time, int stages_count, int64_t initial_time, int64_t final_time, int64_t calibrated_pixels, int64_t pixels);
+
+  /**
+   * @brief  The whole chain, from radiance to soil heat flux, is computed in a single sweep.
+   * @param  mtl: MTL struct.
+   * @param  temperature: Station temperature at the image time.
+   * @return string with the time spent on each stage, summed over all blocks.
+   */
+  string rn_g_fused_function(MTL mtl, float temperature);
 };
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "utils.h"
+#include "constants.h"
+#include "scheduler.h"
+
+/**
+ * @brief  Reduced-resolution level of the NDVI, surface temperature and albedo, each cell holding the mean
+ *         of the finite pixels of a factor x factor block. Used to find the endmembers candidate regions
+ *         before refining them at full resolution.
+ */
+struct Pyramid
+{
+  int factor;
+  int width_band, height_band;
+  int width, height;
+
+  vector<float> ndvi;
+  vector<float> surface_temperature;
+  vector<float> albedo;
+  vector<double> sums;
+  vector<int> counts;
+
+  /**
+   * @brief  Empty constructor, the pyramid is disabled.
+   */
+  Pyramid();
+
+  /**
+   * @brief  Constructor.
+   * @param  width_band: Full resolution width.
+   * @param  height_band: Full resolution height.
+   * @param  factor: Side of the blocks reduced into each cell.
+   */
+  Pyramid(int width_band, int height_band, int factor);
+
+  /**
+   * @brief  Adds a strip of full resolution rows to the block sums. Strips can come in any order, but each row once.
+   *
+   * @param  ndvi: NDVI of the strip.
+   * @param  surface_temperature: Surface temperature of the strip.
+   * @param  albedo: Albedo of the strip.
+   * @param  first_line: Line of the scene holding the first row of the strip.
+   * @param  lines: Number of rows of the strip.
+   * @param  pool: Threads sharing the cell rows, or NULL.
+   */
+  void accumulate(float *ndvi, float *surface_temperature, float *albedo, int first_line, int lines, ThreadPool *pool);
+
+  /**
+   * @brief  Turns the block sums into means, NaN for blocks without finite pixels.
+   */
+  void finish();
+
+  /**
+   * @brief  Destructor.
+   */
+  void close();
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "constants.h"
+#include "scheduler.h"
+#include "mask.h"
+
+#define QUANTILE_EXACT   0
+#define QUANTILE_APPROX  1
+
+/**
+ * @brief  Selects how get_quantiles works. QUANTILE_EXACT returns the same values as sorting the finite pixels,
+ *         QUANTILE_APPROX skips the refinement pass and returns the middle of the histogram bin holding the
+ *         requested rank, whose relative distance to the exact value is below 2^-8 for
+ *         normal floats.
+ *
+ * @param  mode: QUANTILE_EXACT or QUANTILE_APPROX.
+ */
+void quantile_select(int mode);
+
+/**
+ * @brief  Quantile mode currently selected.
+ *
+ * @retval QUANTILE_EXACT or QUANTILE_APPROX.
+ */
+int quantile_mode();
+
+/**
+ * @brief  Computes several percentiles of several rasters in one histogram pass over the high 16 bits of the
+ *         sortable float keys, plus, in exact mode, a second pass over the low 16 bits of the bins holding the
+ *         requested ranks. NaN and infinite pixels are ignored, and the percentile p of n finite pixels is the
+ *         value of rank floor(p * n), as nth_element would give. No copy of the rasters is made.
+ *
+ * @param  rasters: Rasters of size pixels each.
+ * @param  rasters_count: Number of rasters.
+ * @param  size: Pixels per raster.
+ * @param  mask: Valid mask shared by the rasters, whose words without a valid pixel are skipped, or NULL.
+ * @param  intervals: intervals_count percentiles, in [0, 1), for each raster.
+ * @param  intervals_count: Percentiles per raster.
+ * @param  quantiles: Output, intervals_count values for each raster. NaN when a raster has no finite pixel.
+ * @param  pool: Threads sharing the passes, or NULL to run them serially.
+ */
+void get_quantiles(float **rasters, int rasters_count, int size, const uint64_t *mask, const float *intervals, int intervals_count, float *quantiles, ThreadPool *pool);
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "constants.h"
+#include "errors.h"
+
+/**
+ * @brief  Fixed pool of worker threads running data-parallel loops.
+ *         Ranges are split in chunks that the workers (and the calling thread) claim one at a time,
+ *         so faster threads take over the remaining work.
+ */
+struct ThreadPool
+{
+  int threads;
+
+  vector<thread> workers;
+  mutex lock;
+  condition_variable wake;
+  condition_variable done;
+
+  function<void(int, int)> job;
+  atomic<int> next_chunk;
+  int job_end;
+  int job_chunk;
+  int pending;
+  uint64_t generation;
+  bool stop;
+  exception_ptr error;
+
+  /**
+   * @brief  Constructor.
+   * @param  threads: Number of threads, including the caller. 0 uses every available core.
+   */
+  ThreadPool(int threads);
+
+  /**
+   * @brief  Destructor. Joins the workers, can be called more than once.
+   */
+  void close();
+
+  ~ThreadPool();
+
+  /**
+   * @brief  Runs body over [begin, end), split in chunks of at most chunk elements.
+   *         Returns once every chunk is done. Calls must not be nested. The first exception thrown by body skips the
+   *         chunks not yet claimed and is thrown again here once the running ones are done.
+   *
+   * @param  begin: First index.
+   * @param  end: Index after the last one.
+   * @param  chunk: Number of indexes per call of body.
+   * @param  body: Function receiving the [start, end) of a chunk.
+   */
+  void parallel_for(int begin, int end, int chunk, function<void(int, int)> body);
+
+  /**
+   * @brief  Name of the backend, used as the first field of the timing lines.
+   * @return "SERIAL" for a single thread, "PARALLEL" otherwise.
+   */
+  string backend();
+
+  void worker_loop();
+  void run_chunks();
+};
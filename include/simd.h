@@ -0,0 +1,115 @@
+#pragma once
+
+#include "constants.h"
+
+#define SIMD_AUTO    -1
+#define SIMD_SCALAR  0
+#define SIMD_AVX2    1
+#define SIMD_AVX512  2
+
+/**
+ * @brief  Selects the instruction set used by the vector kernels. SIMD_AUTO picks the widest one
+ *         reported by CPUID, and a request the CPU does not support falls back to the widest available.
+ *
+ * @param  requested: SIMD_AUTO, SIMD_SCALAR, SIMD_AVX2 or SIMD_AVX512.
+ * @retval The instruction set actually selected.
+ */
+int simd_select(int requested);
+
+/**
+ * @brief  Instruction set currently used by the vector kernels.
+ *
+ * @retval SIMD_SCALAR, SIMD_AVX2 or SIMD_AVX512.
+ */
+int simd_isa();
+
+/**
+ * @brief  Name of an instruction set, as accepted by the -simd= flag.
+ *
+ * @param  isa: SIMD_SCALAR, SIMD_AVX2 or SIMD_AVX512.
+ * @retval "scalar", "avx2" or "avx512".
+ */
+string simd_name(int isa);
+
+/**
+ * @brief  Radiometric calibration of one band, out = (band * mult + add) / divisor, with values <= 0 set to NaN.
+ *         Radiance uses a divisor of 1, reflectance the sine of the sun elevation.
+ *
+ * @param  band: Input band.
+ * @param  out: Output plane.
+ * @param  mult: Multiplicative rescaling factor.
+ * @param  add: Additive rescaling factor.
+ * @param  divisor: Value dividing the rescaled band.
+ * @param  start: First pixel index.
+ * @param  end: Pixel index after the last one.
+ */
+void simd_calibrate(const float *band, float *out, float mult, float add, float divisor, int start, int end);
+
+/**
+ * @brief  Surface albedo, out = (sum(reflectance * weight) - 0.03) / tal^2, with values <= 0 set to NaN.
+ *         The sum is accumulated in float and the correction in double, as the scalar kernel does.
+ *
+ * @param  reflectances: Blue, green, red, NIR, SWIR1 and SWIR2 reflectances.
+ * @param  weights: Weight of each reflectance.
+ * @param  tal: Atmospheric transmissivity.
+ * @param  out: Output plane.
+ * @param  start: First pixel index.
+ * @param  end: Pixel index after the last one.
+ */
+void simd_albedo(const float *const *reflectances, const float *weights, const float *tal, float *out, int start, int end);
+
+/**
+ * @brief  Widens unsigned 16-bit samples, such as Level-1 digital numbers, to float.
+ *
+ * @param  src: Input samples.
+ * @param  out: Output values.
+ * @param  n: Number of samples.
+ */
+void simd_widen_u16(const uint16_t *src, float *out, int n);
+
+/**
+ * @brief  Widens signed 16-bit samples, such as elevation models, to float.
+ *
+ * @param  src: Input samples.
+ * @param  out: Output values.
+ * @param  n: Number of samples.
+ */
+void simd_widen_i16(const int16_t *src, float *out, int n);
+
+/**
+ * @brief  Rounds float values to IEEE half precision (fp16), to nearest even, as the F16C and AVX-512 conversions do.
+ *         Values beyond 65504 become infinite.
+ *
+ * @param  src: Input values.
+ * @param  out: Output half values.
+ * @param  n: Number of values.
+ */
+void simd_pack_fp16(const float *src, uint16_t *out, int n);
+
+/**
+ * @brief  Widens IEEE half precision (fp16) values to float, exactly. A signaling NaN is made quiet, as the hardware
+ *         conversions do.
+ *
+ * @param  src: Input half values.
+ * @param  out: Output values.
+ * @param  n: Number of values.
+ */
+void simd_unpack_fp16(const uint16_t *src, float *out, int n);
+
+/**
+ * @brief  Rounds float values to bfloat16, the upper half of a float, to nearest even. NaN stays a quiet NaN.
+ *
+ * @param  src: Input values.
+ * @param  out: Output bfloat16 values.
+ * @param  n: Number of values.
+ */
+void simd_pack_bf16(const float *src, uint16_t *out, int n);
+
+/**
+ * @brief  Widens bfloat16 values to float, exactly.
+ *
+ * @param  src: Input bfloat16 values.
+ * @param  out: Output values.
+ * @param  n: Number of values.
+ */
+void simd_unpack_bf16(const uint16_t *src, float *out, int n);
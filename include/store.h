@@ -0,0 +1,103 @@
+#pragma once
+
+#include "constants.h"
+
+// Stages kept by the product store: the Rn/G chain outputs, or only the endmembers quartile inputs
+#define STORE_STAGE_RN_G    "rn_g"
+#define STORE_STAGE_TS      "ts"
+
+/**
+ * @brief  Header at the start of a product store file. The planes follow it contiguously, page aligned, in the order
+ *         they were saved, then the valid mask words when there is one.
+ */
+struct StoreHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t width_band, height_band;
+  uint32_t planes;
+  uint64_t plane_bytes;
+  uint64_t mask_words;
+  uint64_t fingerprint;
+  char scene_id[64];
+  char stage[16];
+};
+
+/**
+ * @brief  On-disk store of whole-scene product planes, one file per scene ID and stage. A rerun on the same scene maps
+ *         the file instead of computing the planes again, so consecutive runs share them through the page cache.
+ */
+struct ProductStore
+{
+  string directory;
+  string scene_id;
+  uint64_t fingerprint;
+
+  /**
+   * @brief  Empty constructor, the store is disabled.
+   */
+  ProductStore();
+
+  /**
+   * @brief  Constructor.
+   * @param  directory: Directory holding the store files.
+   * @param  scene_id: Scene identifier, the first part of the file names.
+   * @param  fingerprint: Hash of the inputs of the planes, a file saved with another one is computed again.
+   */
+  ProductStore(string directory, string scene_id, uint64_t fingerprint);
+
+  /**
+   * @brief  Whether a directory was given.
+   * @retval bool
+   */
+  bool enabled();
+
+  /**
+   * @brief  Path of the file of a stage.
+   * @param  stage: Stage name.
+   * @retval string
+   */
+  string path(string stage);
+
+  /**
+   * @brief  Maps the file of a stage, copy-on-write, and points the planes into it. Nothing is mapped when the file is
+   *         missing or was saved for other dimensions, planes or inputs.
+   *
+   * @param  stage: Stage name.
+   * @param  width_band: Band width.
+   * @param  height_band: Band height.
+   * @param  planes: Output, count plane pointers into the mapping.
+   * @param  count: Number of planes.
+   * @param  valid_mask: Output, the valid mask in the mapping, or NULL when none was saved.
+   * @param  size: Output, size of the mapping.
+   * @retval Address of the mapping, or NULL when nothing was mapped.
+   */
+  void *map(string stage, uint32_t width_band, uint32_t height_band, float *planes[], int count, uint64_t **valid_mask, size_t *size);
+
+  /**
+   * @brief  Writes the planes of a stage to a temporary file renamed over the previous one, so concurrent runs never
+   *         map a partial file. Failures are reported but not fatal, the run only loses the store.
+   *
+   * @param  stage: Stage name.
+   * @param  width_band: Band width.
+   * @param  height_band: Band height.
+   * @param  planes: count planes of width_band * height_band floats.
+   * @param  count: Number of planes.
+   * @param  valid_mask: Valid mask of the planes, or NULL.
+   * @retval bool whether the file was written.
+   */
+  bool save(string stage, uint32_t width_band, uint32_t height_band, float *planes[], int count, const uint64_t *valid_mask);
+};
+
+/**
+ * @brief  Hash of the size and modification time of the input files and of the settings changing the products.
+ *
+ * @param  paths: Paths of the input files.
+ * @param  count: Number of paths.
+ * @param  temperature_image: Air temperature of the station at the image time.
+ * @param  math_tier: Accuracy tier of the math kernels.
+ * @param  precision: Precision policy of the kernels.
+ * @param  compact: Storage of the intermediate planes.
+ * @retval uint64_t
+ */
+uint64_t store_fingerprint(string paths[], int count, float temperature_image, int math_tier, int precision, int compact);
@@ -1,9 +1,74 @@
 #pragma once
 
 #include "constants.h"
+#include "scheduler.h"
+#include "errors.h"
 
 /**
- * @brief  Saves a TIFF file.
+ * @brief  GeoTIFF georeferencing of a raster: pixel scale, tiepoint and GeoKeys with their parameters.
+ */
+struct GeoTags
+{
+  vector<double> pixel_scale;
+  vector<double> tiepoint;
+  vector<uint16_t> key_directory;
+  vector<double> double_params;
+  string ascii_params;
+
+  /**
+   * @brief  Registers the GeoTIFF tags in libtiff. Must be called before opening the files to read them from.
+   */
+  static void register_tags();
+
+  /**
+   * @brief  Reads the GeoTIFF tags of a file. Left empty when the file has no single tiepoint and pixel scale.
+   * @param  tif: Opened file.
+   */
+  void read(TIFF *tif);
+
+  /**
+   * @brief  Georeferencing of a window of the raster, the tiepoint moved to its first pixel.
+   * @param  line: First line of the window.
+   * @param  col: First column of the window.
+   * @retval GeoTags
+   */
+  GeoTags shifted(int line, int col);
+
+  /**
+   * @brief  Writes the GeoTIFF tags into the current directory of a file, if there are any.
+   * @param  tif: Opened file.
+   */
+  void write(TIFF *tif);
+};
+
+/**
+ * @brief  Layout and compression of the written TIFF files.
+ */
+struct TiffOptions
+{
+  int compression;
+  int level;
+  int tile_size;
+  bool overviews;
+  GeoTags geo;
+
+  /**
+   * @brief  Constructor. DEFLATE with floating-point predictor at the codec default level, in TIFF_TILE_SIZE tiles,
+   *         without overviews nor georeferencing.
+   */
+  TiffOptions();
+};
+
+/**
+ * @brief  Codec of a -compress= flag value.
+ *
+ * @param  name: none, deflate, zstd or lzw.
+ * @retval COMPRESSION_NONE, COMPRESSION_ADOBE_DEFLATE, COMPRESSION_ZSTD or COMPRESSION_LZW, -1 for an unknown name.
+ */
+int tiff_compression(string name);
+
+/**
+ * @brief Saves a TIFF file.
  * 
  * @param path: Path to save the TIFF file.
  * @param data: Data to be saved.
@@ -11,3 +76,21 @@
  * @param width: Width of the data.
  */
 void saveTiff(string path, float *data, int height, int width);
+
+/**
+ * @brief  Saves several float32 rasters of the same size as tiled TIFF files, written concurrently. DEFLATE tiles
+ *         of every file are encoded in parallel and written raw, the other codecs go through libtiff, one thread
+ *         per file. With overviews, each file is a Cloud-Optimized GeoTIFF: the directories of the full resolution
+ *         image, with the GeoTIFF tags, and of the reduced images halving its size down to a single tile come first,
+ *         with their tile offsets, then the tiles, smallest image first.
+ *
+ * @param  paths: Paths of the files.
+ * @param  rasters: Rasters to save.
+ * @param  count: Number of files.
+ * @param  height: Height of the rasters.
+ * @param  width: Width of the rasters.
+ * @param  options: Compression and tile size.
+ * @param  pool: Threads sharing the tiles and files, or NULL.
+ * @return string with the time spent.
+ */
+string saveTiffs(string paths[], float *rasters[], int count, int height, int width, TiffOptions options, ThreadPool *pool);
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "constants.h"
+#include "simd.h"
+
+#define VMATH_EXACT  0
+#define VMATH_FAST   1
+
+/**
+ * @brief  Selects the accuracy tier of the transcendental functions used by the LAI, emissivity and
+ *         surface temperature kernels. VMATH_EXACT keeps the libm calls in their original precision,
+ *         VMATH_FAST uses the polynomial approximations below on the instruction set picked by simd_select.
+ *
+ * @param  tier: VMATH_EXACT or VMATH_FAST.
+ */
+void vmath_select(int tier);
+
+/**
+ * @brief  Accuracy tier currently selected.
+ *
+ * @retval VMATH_EXACT or VMATH_FAST.
+ */
+int vmath_tier();
+
+/**
+ * @brief  Name of an accuracy tier, as accepted by the -math= flag.
+ *
+ * @param  tier: VMATH_EXACT or VMATH_FAST.
+ * @retval "exact" or "fast".
+ */
+string vmath_name(int tier);
+
+/**
+ * @brief  Natural logarithm of n values, within 1 ULP of the correctly rounded result for positive
+ *         inputs, subnormals included. Zero gives -inf, negative values and NaN give NaN, +inf gives +inf. The input and
+ *         output may alias.
+ *
+ * @param  x: Input values.
+ * @param  out: Output values.
+ * @param  n: Number of values.
+ */
+void vmath_log(const float *x, float *out, int n);
+
+/**
+ * @brief  Exponential of n values, within 1 ULP of the correctly rounded result for inputs in [-87.3, 88].
+ *         Larger inputs give +inf, smaller ones give 0 and NaN gives NaN. The input and output may alias.
+ *
+ * @param  x: Input values.
+ * @param  out: Output values.
+ * @param  n: Number of values.
+ */
+void vmath_exp(const float *x, float *out, int n);
+
+/**
+ * @brief  Power x^y of n values with a common exponent, computed as exp(y * log(x)). The error grows with
+ *         |y * log(x)|, staying within 2 ULP of the correctly rounded result while it is below 1. Zero
+ *         gives 0 for a positive exponent, negative values and NaN give NaN. The input and output may alias.
+ *
+ * @param  x: Input values.
+ * @param  y: Exponent.
+ * @param  out: Output values.
+ * @param  n: Number of values.
+ */
+void vmath_pow(const float *x, float y, float *out, int n);